@@ -0,0 +1,80 @@
+#pragma once
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_Reduce.H>
+#include <climits>
+
+// Active-region tracking (active_region = 1, opt = 0 and 1).
+//
+// Away from the source both wavefields start at zero, and one step can only
+// make a cell nonzero if it lies within HL of a nonzero cell.  The propagator
+// keeps a bounding box of the nonzero cells of prev and next and updates that
+// box grown by HL each step, until it covers the domain.  A skipped cell would
+// have been computed as +0 from an all-zero stencil, so results are identical.
+
+// Bounding box of the nonzero valid cells of mf; empty if there are none.
+inline amrex::Box NonZeroBox (amrex::MultiFab const& mf)
+{
+    amrex::ReduceOps<amrex::ReduceOpMin, amrex::ReduceOpMin, amrex::ReduceOpMin,
+                     amrex::ReduceOpMax, amrex::ReduceOpMax, amrex::ReduceOpMax> reduce_op;
+    amrex::ReduceData<int, int, int, int, int, int> reduce_data(reduce_op);
+    using ReduceTuple = typename decltype(reduce_data)::Type;
+    for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+        auto const& a = mf.const_array(mfi);
+        reduce_op.eval(mfi.validbox(), reduce_data,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple
+        {
+            if (a(i,j,k) != 0.0f) {
+                return {i, j, k, i, j, k};
+            }
+            return {INT_MAX, INT_MAX, INT_MAX, INT_MIN, INT_MIN, INT_MIN};
+        });
+    }
+    auto const r = reduce_data.value();
+    int lo[3] = {amrex::get<0>(r), amrex::get<1>(r), amrex::get<2>(r)};
+    int hi[3] = {amrex::get<3>(r), amrex::get<4>(r), amrex::get<5>(r)};
+    amrex::ParallelDescriptor::ReduceIntMin(lo, 3);
+    amrex::ParallelDescriptor::ReduceIntMax(hi, 3);
+    if (lo[0] > hi[0]) {
+        return amrex::Box();
+    }
+    return amrex::Box(amrex::IntVect(lo[0], lo[1], lo[2]), amrex::IntVect(hi[0], hi[1], hi[2]));
+}
+
+struct ActiveRegion
+{
+    amrex::Box domain;
+    // Bounds the nonzero cells of both wavefields.
+    amrex::Box box;
+    // Cell updates performed and skipped so far.
+    double updated = 0.0;
+    double skipped = 0.0;
+
+    ActiveRegion (amrex::MultiFab const& prev, amrex::MultiFab const& next,
+                  amrex::Box const& a_domain, bool enabled)
+        : domain(a_domain), box(a_domain)
+    {
+        if (enabled) {
+            amrex::Box const bp = NonZeroBox(prev);
+            amrex::Box const bn = NonZeroBox(next);
+            box = !bp.ok() ? bn : (!bn.ok() ? bp : amrex::Box(bp).minBox(bn));
+        }
+    }
+
+    // The cells to update in the next step, over the whole x extent of the
+    // domain if whole_rows is set.
+    amrex::Box step (int half_length, bool whole_rows = false)
+    {
+        if (box.ok() && box != domain) {
+            box = amrex::grow(box, half_length) & domain;
+        }
+        amrex::Box region = box;
+        if (whole_rows && region.ok()) {
+            region.setSmall(0, domain.smallEnd(0));
+            region.setBig(0, domain.bigEnd(0));
+        }
+        updated += region.ok() ? region.d_numPts() : 0.0;
+        skipped += domain.d_numPts() - (region.ok() ? region.d_numPts() : 0.0);
+        return region;
+    }
+};
@@ -0,0 +1,305 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FArrayBox.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "PersistentStepping.hpp"
+#include "Propagators.hpp"
+#include "TemporalBlocking.hpp"
+
+// Tile-size autotuning (tune = off|on|force).
+//
+// The knobs of the selected kernel (the opt = 1 block, the temporal-blocking
+// depth and tile, the MFIter tile of opt = 0, the slabs per thread of opt = 3
+// and the OpenMP thread count) are searched one at a time, keeping the best
+// value of each, with short timed runs on scratch fields.  The winner is
+// stored in tune.cache_file under the CPU model, grid size, stencil order and
+// kernel.  tune = on loads a cached entry without searching; tune = force
+// searches again and replaces it.
+
+struct TuneKnobs
+{
+    amrex::IntVect block{32, 8, 64};
+    amrex::IntVect mfiter_tile{1024000, 8, 8};
+    int fused_steps = 4;
+    amrex::IntVect tb_tile{0, 16, 0};
+    int slabs_per_thread = 1;
+    int threads = 1;
+};
+
+// One searched knob and the values it is tried with.
+struct TuneDim
+{
+    std::string name;
+    int* value;
+    std::vector<int> candidates;
+};
+
+// Make the knobs that are global state take effect.
+inline void ApplyKnobs (TuneKnobs const& knobs)
+{
+    amrex::FabArrayBase::mfiter_tile_size = knobs.mfiter_tile;
+#ifdef AMREX_USE_OMP
+    omp_set_num_threads(knobs.threads);
+#endif
+}
+
+struct Autotuner
+{
+    std::string mode = "off";
+    std::string cache_file = "iso3dfd_tune.cache";
+    int trial_steps = 4;
+    int trials = 3;
+
+    Autotuner ()
+    {
+        amrex::ParmParse pp;
+        pp.query("tune", mode);
+        amrex::ParmParse ppt("tune");
+        ppt.query("cache_file", cache_file);
+        ppt.query("trial_steps", trial_steps);
+        ppt.query("trials", trials);
+        if (mode != "off" && mode != "on" && mode != "force") {
+            amrex::Abort("tune must be off, on or force");
+        }
+        AMREX_ALWAYS_ASSERT(trial_steps >= 1 && trials >= 1);
+    }
+
+    bool enabled () const { return mode != "off"; }
+
+    static std::string key (amrex::Box const& domain, int order, std::string const& kernel)
+    {
+        std::ostringstream os;
+        os << CpuModel() << "|" << domain.length(0) << "x" << domain.length(1) << "x"
+           << domain.length(2) << "|o" << order << "|" << kernel;
+        return os.str();
+    }
+
+    // Set dims from the cache entry for key; false if there is none or it
+    // lacks one of the knobs.
+    bool load (std::string const& a_key, std::vector<TuneDim> const& dims) const
+    {
+        std::vector<int> values(dims.size());
+        int found = 0;
+        if (amrex::ParallelDescriptor::IOProcessor()) {
+            std::ifstream is(cache_file);
+            std::string line;
+            while (!found && std::getline(is, line)) {
+                auto const tab = line.find('\t');
+                if (line.empty() || line[0] == '#' || line.substr(0, tab) != a_key) { continue; }
+                std::istringstream ls(line.substr(tab + 1));
+                std::string item;
+                int nset = 0;
+                while (ls >> item) {
+                    auto const eq = item.find('=');
+                    for (std::size_t d = 0; d < dims.size(); ++d) {
+                        if (eq != std::string::npos && item.substr(0, eq) == dims[d].name) {
+                            values[d] = std::stoi(item.substr(eq + 1));
+                            ++nset;
+                        }
+                    }
+                }
+                found = (nset == int(dims.size()));
+            }
+        }
+        int const root = amrex::ParallelDescriptor::IOProcessorNumber();
+        amrex::ParallelDescriptor::Bcast(&found, 1, root);
+        if (!found) { return false; }
+        amrex::ParallelDescriptor::Bcast(values.data(), int(values.size()), root);
+        for (std::size_t d = 0; d < dims.size(); ++d) {
+            *dims[d].value = values[d];
+        }
+        return true;
+    }
+
+    // Replace or append the entry for key on the I/O processor.
+    void store (std::string const& a_key, std::vector<TuneDim> const& dims, double mpoints) const
+    {
+        if (!amrex::ParallelDescriptor::IOProcessor()) { return; }
+        std::vector<std::string> lines;
+        {
+            std::ifstream is(cache_file);
+            std::string line;
+            while (std::getline(is, line)) {
+                if (line.empty() || line.substr(0, line.find('\t')) == a_key) { continue; }
+                lines.push_back(line);
+            }
+        }
+        if (lines.empty()) {
+            lines.emplace_back("# cpu|grid|order|kernel\tknobs\tMpts/s");
+        }
+        std::ostringstream os;
+        os << a_key << "\t";
+        for (auto const& d : dims) {
+            os << d.name << "=" << *d.value << " ";
+        }
+        os << "\t" << mpoints;
+        lines.push_back(os.str());
+
+        std::ofstream out(cache_file);
+        for (auto const& line : lines) {
+            out << line << "\n";
+        }
+        std::cout << "Wrote tuned knobs to " << cache_file << std::endl;
+    }
+};
+
+// Tune knobs for the kernel selected by opt and the kernel flags of
+// Propagators.hpp, or load them from the cache.  The scratch fields are freed
+// before returning, so call this before allocating the real ones.
+template <int HL>
+void Autotune (TuneKnobs& knobs, amrex::BoxArray const& ba, amrex::DistributionMapping const& dm,
+               amrex::Box const& domain, int opt, amrex::Gpu::DeviceVector<float> const& coeffdv)
+{
+    BL_PROFILE("Autotune()");
+    Autotuner tuner;
+    if (!tuner.enabled()) { return; }
+
+    std::string const variant = use_simd ? "simd"
+        : (use_array4 ? (use_array4_hack ? "array4_hack" : "array4") : "raw");
+    std::string kernel = "tb";
+    std::vector<TuneDim> dims;
+    if (opt == 1) {
+        kernel = "opt";
+#ifndef AMREX_USE_GPU
+        dims.push_back({"n1_block", &knobs.block[0], {16, 32, 64, 128, domain.length(0)}});
+        dims.push_back({"n2_block", &knobs.block[1], {2, 4, 8, 16, 32}});
+#endif
+        dims.push_back({"n3_block", &knobs.block[2], {16, 32, 64, 128, 256}});
+    } else if (opt == 2) {
+        // Deeper fusion needs wider ghosts; keep them within half a box.
+        int min_len = std::numeric_limits<int>::max();
+        for (int i = 0; i < ba.size(); ++i) {
+            min_len = std::min({min_len, ba[i].length(0), ba[i].length(1), ba[i].length(2)});
+        }
+        std::vector<int> depths;
+        for (int f : {1, 2, 4, 8}) {
+            if (f == 1 || f == knobs.fused_steps || 2*HL*f <= min_len) { depths.push_back(f); }
+        }
+        dims.push_back({"fused_steps", &knobs.fused_steps, depths});
+        dims.push_back({"tile_x", &knobs.tb_tile[0], {0, 64, 128}});
+        dims.push_back({"tile_y", &knobs.tb_tile[1], {4, 8, 16, 32, 64}});
+    } else if (opt == 3) {
+        kernel = "persistent_" + variant;
+        dims.push_back({"slabs_per_thread", &knobs.slabs_per_thread, {1, 2, 4, 8}});
+    } else {
+        kernel = variant;
+#ifndef AMREX_USE_GPU
+        dims.push_back({"tile_y", &knobs.mfiter_tile[1], {1, 2, 4, 8, 16, 32}});
+        dims.push_back({"tile_z", &knobs.mfiter_tile[2], {1, 4, 8, 16, 32}});
+#endif
+    }
+#ifdef AMREX_USE_OMP
+    {
+        std::vector<int> counts;
+        for (int n = omp_get_max_threads(); n >= 1; n /= 2) { counts.push_back(n); }
+        dims.push_back({"threads", &knobs.threads, counts});
+    }
+#endif
+
+    std::string const key = Autotuner::key(domain, 2*HL, kernel);
+    if (tuner.mode == "on" && tuner.load(key, dims)) {
+        ApplyKnobs(knobs);
+        amrex::Print() << "Loaded tuned knobs for " << kernel << " from " << tuner.cache_file << ":";
+        for (auto const& d : dims) { amrex::Print() << " " << d.name << " " << *d.value; }
+        amrex::Print() << "\n";
+        return;
+    }
+
+    auto t_search = amrex::second();
+    int max_fused = knobs.fused_steps;
+    if (opt == 2) {
+        for (int f : dims[0].candidates) { max_fused = amrex::max(max_fused, f); }
+    }
+    amrex::IntVect ngrow((opt == 2) ? HL*max_fused : HL);
+    // Iso3dfd_tb fuses at most the steps left, so with opt = 2 every trial
+    // runs a whole number of chunks of the deepest fusion tried.
+    int const steps = (opt == 2) ? (tuner.trial_steps + max_fused - 1) / max_fused * max_fused
+                                 : tuner.trial_steps;
+    if (use_simd) {
+        ngrow[0] = SimdGhostX(ba, ngrow[0]);
+    }
+    amrex::MultiFab prev(ba, dm, 1, ngrow);
+    amrex::MultiFab next(ba, dm, 1, ngrow);
+    amrex::MultiFab vel(ba, dm, 1, ngrow);
+    Initialize<HL>(prev, next, vel, domain);
+    vel.FillBoundary();
+    amrex::Gpu::streamSynchronize();
+    VelocityModel vmodel(vel, domain, "field");
+    // Every candidate starts from the same wavefields, since the cost per
+    // step changes as the wave spreads.
+    amrex::MultiFab prev0(ba, dm, 1, ngrow);
+    amrex::MultiFab next0(ba, dm, 1, ngrow);
+    amrex::MultiFab::Copy(prev0, prev, 0, 0, 1, ngrow);
+    amrex::MultiFab::Copy(next0, next, 0, 0, 1, ngrow);
+
+    // Best-of-trials time of a run of steps steps with the current knobs.
+    int ntried = 0;
+    auto trial = [&] () {
+        ApplyKnobs(knobs);
+        amrex::MultiFab::Copy(prev, prev0, 0, 0, 1, ngrow);
+        amrex::MultiFab::Copy(next, next0, 0, 0, 1, ngrow);
+        TemporalBlocking tb;
+        tb.fused_steps = knobs.fused_steps;
+        tb.tile_size = knobs.tb_tile;
+        PersistentStepping ps;
+        ps.slabs_per_thread = knobs.slabs_per_thread;
+        ActiveRegion active(prev, next, domain, false);
+        auto advance = [&] () {
+            StepTimers timers;
+            if (opt == 1) {
+                Iso3dfd_opt<HL>(next, prev, vel, coeffdv, steps,
+                                knobs.block[0], knobs.block[1], knobs.block[2], active, timers);
+            } else if (opt == 2) {
+                Iso3dfd_tb<HL>(next, prev, vel, coeffdv, steps, tb, timers);
+            } else if (opt == 3) {
+                Iso3dfd_persistent<HL>(next, prev, vel, coeffdv, steps, ps, timers);
+            } else {
+                Iso3dfd<HL>(next, prev, vmodel, coeffdv, steps, active, timers);
+            }
+            amrex::Gpu::streamSynchronize();
+        };
+        advance();
+        double best = std::numeric_limits<double>::max();
+        for (int t = 0; t < tuner.trials; ++t) {
+            amrex::ParallelDescriptor::Barrier();
+            auto t0 = amrex::second();
+            advance();
+            double dt = amrex::second() - t0;
+            amrex::ParallelDescriptor::ReduceRealMax(dt);
+            best = amrex::min(best, dt);
+        }
+        ++ntried;
+        return best;
+    };
+
+    double best = trial();
+    for (auto& d : dims) {
+        int best_value = *d.value;
+        for (int c : d.candidates) {
+            if (c == best_value) { continue; }
+            *d.value = c;
+            double const t = trial();
+            if (t < best) {
+                best = t;
+                best_value = c;
+            }
+        }
+        *d.value = best_value;
+    }
+    ApplyKnobs(knobs);
+
+    double const mpoints = domain.d_numPts() * steps / best / 1.e6;
+    amrex::Print() << "Tuned " << kernel << " over " << ntried << " trials in "
+                   << amrex::second() - t_search << " secs:";
+    for (auto const& d : dims) { amrex::Print() << " " << d.name << " " << *d.value; }
+    amrex::Print() << " (" << mpoints << " Mpts/s)\n";
+    tuner.store(key, dims, mpoints);
+}
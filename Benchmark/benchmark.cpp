@@ -0,0 +1,394 @@
+#include <AMReX.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <vector>
+#include "BrickLayout.hpp"
+#include "FabArena.hpp"
+#include "Instrumentation.hpp"
+#include "PersistentStepping.hpp"
+#include "Propagators.hpp"
+#include "TemporalBlocking.hpp"
+
+using namespace amrex;
+
+// Kernel-variant benchmark suite.
+//
+// Sweeps bench.variants x bench.grids x bench.blocks x bench.threads x
+// bench.arenas.  Each configuration is warmed up for bench.warmup steps, then
+// timed over bench.samples samples of bench.steps steps each; the slowest rank
+// sets the time of a sample.  The results, with Mpts/s, GFlops, GB/s and the
+// fraction of a STREAM triad bandwidth measured at the same thread count, are
+// written to <bench.output>.json and <bench.output>.csv.  A huge-page arena
+// (see FabArena.hpp) is also reported as its speedup over the default arena,
+// per count of NUMA nodes (sockets) the threads span.
+//
+// The active region is disabled so that every step updates the full domain.
+
+struct BenchResult
+{
+    std::string variant;
+    std::array<int,3> grid;
+    std::array<int,3> block;
+    int threads;
+    int numa_nodes;
+    std::string arena;
+    double bytes_per_point;
+    std::vector<double> times;
+    double stream_gbs;
+};
+
+void SetThreads (int nthreads)
+{
+#ifdef AMREX_USE_OMP
+    omp_set_num_threads(nthreads);
+#else
+    amrex::ignore_unused(nthreads);
+#endif
+}
+
+void WriteResults (std::string const& prefix, std::vector<BenchResult> const& results, int order)
+{
+    if (!ParallelDescriptor::IOProcessor()) { return; }
+    int const HL = order / 2;
+    std::string const cpu = CpuModel();
+#ifdef AMREX_USE_GPU
+    bool const gpu = true;
+#else
+    bool const gpu = false;
+#endif
+
+    std::ofstream js(prefix + ".json");
+    js << std::setprecision(9);
+    js << "{\n"
+       << "  \"cpu\": \"" << cpu << "\",\n"
+       << "  \"gpu\": " << (gpu ? "true" : "false") << ",\n"
+       << "  \"ranks\": " << ParallelDescriptor::NProcs() << ",\n"
+       << "  \"order\": " << order << ",\n"
+       << "  \"results\": [\n";
+
+    std::ofstream csv(prefix + ".csv");
+    csv << std::setprecision(9);
+    csv << "variant,n1,n2,n3,n1_block,n2_block,n3_block,threads,numa_nodes,arena,ranks,order,samples,"
+        << "time_median,time_p10,time_p90,time_min,time_max,"
+        << "mpts_median,mpts_p10,mpts_p90,gflops,bytes_per_point,gbytes,stream_gbytes,stream_fraction,gain_vs_default\n";
+
+    // Median time of the default arena for the configuration of a result.
+    auto median = [] (BenchResult const& res) {
+        auto sorted = res.times;
+        std::sort(sorted.begin(), sorted.end());
+        return Percentile(sorted, 0.5);
+    };
+    auto gain = [&] (BenchResult const& res) {
+        for (auto const& other : results) {
+            if (other.arena == "default" && other.variant == res.variant && other.grid == res.grid
+                && other.block == res.block && other.threads == res.threads) {
+                return median(other) / median(res);
+            }
+        }
+        return 0.0;
+    };
+    // Geometric mean of the gains of each arena at each NUMA node count.
+    std::map<std::pair<std::string,int>, std::pair<double,int>> gains;
+
+    for (std::size_t r = 0; r < results.size(); ++r) {
+        auto const& res = results[r];
+        auto sorted = res.times;
+        std::sort(sorted.begin(), sorted.end());
+        double const points = double(res.grid[0]) * res.grid[1] * res.grid[2];
+        // Per-step times, so that the 10th time percentile is the 90th
+        // throughput percentile.
+        double const t50 = Percentile(sorted, 0.5);
+        double const t10 = Percentile(sorted, 0.1);
+        double const t90 = Percentile(sorted, 0.9);
+        double const mpts = points / t50 / 1.e6;
+        double const mpts_p10 = points / t90 / 1.e6;
+        double const mpts_p90 = points / t10 / 1.e6;
+        double const gflops = (7.0 * HL + 5.0) * mpts / 1.e3;
+        double const gbytes = res.bytes_per_point * mpts / 1.e3;
+        double const fraction = gbytes / res.stream_gbs;
+        double const g = gain(res);
+        if (res.arena != "default" && g > 0.0) {
+            auto& acc = gains[{res.arena, res.numa_nodes}];
+            acc.first += std::log(g);
+            ++acc.second;
+        }
+
+        js << "    {\"variant\": \"" << res.variant << "\""
+           << ", \"grid\": [" << res.grid[0] << ", " << res.grid[1] << ", " << res.grid[2] << "]"
+           << ", \"block\": [" << res.block[0] << ", " << res.block[1] << ", " << res.block[2] << "]"
+           << ", \"threads\": " << res.threads
+           << ", \"numa_nodes\": " << res.numa_nodes
+           << ", \"arena\": \"" << res.arena << "\""
+           << ", \"samples\": " << sorted.size()
+           << ", \"time\": {\"median\": " << t50 << ", \"p10\": " << t10 << ", \"p90\": " << t90
+           << ", \"min\": " << sorted.front() << ", \"max\": " << sorted.back() << "}"
+           << ", \"mpts\": {\"median\": " << mpts << ", \"p10\": " << mpts_p10
+           << ", \"p90\": " << mpts_p90 << "}"
+           << ", \"gflops\": " << gflops
+           << ", \"bytes_per_point\": " << res.bytes_per_point
+           << ", \"gbytes\": " << gbytes
+           << ", \"stream_gbytes\": " << res.stream_gbs
+           << ", \"stream_fraction\": " << fraction
+           << ", \"gain_vs_default\": " << g << "}"
+           << (r + 1 < results.size() ? "," : "") << "\n";
+
+        csv << res.variant << "," << res.grid[0] << "," << res.grid[1] << "," << res.grid[2] << ","
+            << res.block[0] << "," << res.block[1] << "," << res.block[2] << ","
+            << res.threads << "," << res.numa_nodes << "," << res.arena << ","
+            << ParallelDescriptor::NProcs() << "," << order << ","
+            << sorted.size() << "," << t50 << "," << t10 << "," << t90 << ","
+            << sorted.front() << "," << sorted.back() << ","
+            << mpts << "," << mpts_p10 << "," << mpts_p90 << "," << gflops << ","
+            << res.bytes_per_point << "," << gbytes << "," << res.stream_gbs << "," << fraction << "," << g << "\n";
+    }
+    js << "  ],\n"
+       << "  \"arena_gains\": [";
+    for (auto it = gains.begin(); it != gains.end(); ++it) {
+        double const mean = std::exp(it->second.first / it->second.second);
+        js << (it == gains.begin() ? "\n" : ",\n")
+           << "    {\"arena\": \"" << it->first.first << "\", \"numa_nodes\": " << it->first.second
+           << ", \"gain\": " << mean << ", \"configurations\": " << it->second.second << "}";
+        amrex::Print() << "Arena " << it->first.first << " on " << it->first.second
+                       << " NUMA node(s): " << mean << "x the default arena (geometric mean of "
+                       << it->second.second << ")\n";
+    }
+    js << (gains.empty() ? "]\n" : "\n  ]\n") << "}\n";
+    amrex::Print() << "Wrote " << prefix << ".json and " << prefix << ".csv\n";
+}
+
+template <int HL>
+void RunBenchmark ()
+{
+    std::vector<std::string> variants{"raw", "array4", "opt"};
+    std::vector<int> grids{256, 256, 256};
+    std::vector<int> blocks{32, 8, 64};
+    std::vector<int> threads;
+    std::vector<std::string> arenas{"default"};
+    int warmup = 20;
+    int steps = 10;
+    int samples = 10;
+    int max_grid_size = 128;
+    Long stream_size = Long(1) << 25;
+    int stream_trials = 10;
+    std::string output = "bench";
+    std::string simd_isa_name = "auto";
+    {
+        ParmParse pp;
+        pp.query("max_grid_size", max_grid_size);
+        pp.query("simd_isa", simd_isa_name);
+
+        ParmParse ppb("bench");
+        ppb.queryarr("variants", variants);
+        ppb.queryarr("grids", grids);
+        ppb.queryarr("blocks", blocks);
+        ppb.queryarr("threads", threads);
+        ppb.queryarr("arenas", arenas);
+        ppb.query("warmup", warmup);
+        ppb.query("steps", steps);
+        ppb.query("samples", samples);
+        ppb.query("stream_size", stream_size);
+        ppb.query("stream_trials", stream_trials);
+        ppb.query("output", output);
+    }
+    if (grids.size() % 3 != 0 || blocks.size() % 3 != 0) {
+        amrex::Abort("bench.grids and bench.blocks must be lists of triples");
+    }
+    AMREX_ALWAYS_ASSERT(samples >= 1 && steps >= 1);
+    if (threads.empty()) {
+#ifdef AMREX_USE_OMP
+        threads.push_back(omp_get_max_threads());
+#else
+        threads.push_back(1);
+#endif
+    }
+#ifndef AMREX_USE_GPU
+    simd_isa = SelectSimdIsa(simd_isa_name);
+#endif
+
+    auto coeff = StencilCoefficients<HL>();
+    Gpu::DeviceVector<float> coeff_dv(coeff.size());
+    Gpu::copyAsync(Gpu::hostToDevice, coeff.begin(), coeff.end(), coeff_dv.begin());
+    TemporalBlocking tb;
+    PersistentStepping ps;
+    BrickParams brick_params(HL);
+
+    std::vector<BenchResult> results;
+    for (int nthreads : threads) {
+#ifndef AMREX_USE_OMP
+        if (nthreads != 1) {
+            amrex::Print() << "Skipping threads = " << nthreads << " in a build without OpenMP\n";
+            continue;
+        }
+#endif
+        SetThreads(nthreads);
+        double const stream_gbs = StreamTriad(stream_size, stream_trials);
+        int const numa_nodes = int(ThreadNumaNodes().size());
+        amrex::Print() << "threads " << nthreads << " on " << numa_nodes << " NUMA node(s): STREAM triad "
+                       << stream_gbs << " GBytes/s\n";
+
+        for (std::size_t g = 0; g < grids.size(); g += 3) {
+            std::array<int,3> const grid{grids[g], grids[g+1], grids[g+2]};
+            Box domain(IntVect(0), IntVect(grid[0]-1, grid[1]-1, grid[2]-1));
+            BoxArray ba(domain);
+            ba.maxSize(max_grid_size);
+            DistributionMapping dm(ba);
+
+            for (auto const& variant : variants) {
+                int opt = 0;
+                use_array4 = (variant == "array4" || variant == "array4_hack");
+                use_array4_hack = (variant == "array4_hack");
+                use_simd = (variant == "simd");
+                bool const brick = (variant == "brick");
+                if (variant == "opt") {
+                    opt = 1;
+                } else if (variant == "tb") {
+                    opt = 2;
+                } else if (variant == "persistent") {
+                    opt = 3;
+                } else if (variant != "raw" && !use_array4 && !use_simd && !brick) {
+                    amrex::Abort("bench.variants must be raw, array4, array4_hack, simd, brick, opt, tb or persistent");
+                }
+#ifdef AMREX_USE_GPU
+                if (use_simd || opt >= 2) {
+                    amrex::Print() << "Skipping " << variant << " in a GPU build\n";
+                    continue;
+                }
+#endif
+
+                IntVect ngrow((opt == 2) ? tb.nGrow(HL) : HL);
+                if (use_simd) {
+                    ngrow[0] = SimdGhostX(ba, ngrow[0]);
+                }
+                double const bytes_per_point = (opt == 2)
+                    ? TemporalBlockingBytesPerPoint(ba, domain, tb.fused_steps, HL) : 12.0;
+
+                // Only opt = 1 is blocked; the others run once per grid.
+                std::size_t const nblocks = (opt == 1) ? blocks.size() : 3;
+                for (std::size_t b = 0; b < nblocks; b += 3) {
+                    std::array<int,3> const block = (opt == 1)
+                        ? std::array<int,3>{blocks[b], blocks[b+1], blocks[b+2]}
+                        : std::array<int,3>{0, 0, 0};
+                    for (auto const& arena : arenas) {
+                        // simd rows are 64-byte aligned in every arena.
+                        auto fab_arena = MakeFabArena(arena);
+                        AlignedArena simd_arena;
+                        MFInfo const fab_info = use_simd ? SimdFabInfo(fab_arena, simd_arena)
+                                                         : FabInfo(fab_arena);
+                        MultiFab prev(ba, dm, 1, ngrow, fab_info);
+                        MultiFab next(ba, dm, 1, ngrow, fab_info);
+                        MultiFab vel(ba, dm, 1, ngrow, fab_info);
+                        if (use_simd && !(SimdRowsAligned(prev) && SimdRowsAligned(next) && SimdRowsAligned(vel))) {
+                            amrex::Print() << "simd variant: rows are not padded to 64 bytes\n";
+                        }
+                        if (fab_arena) {
+                            MFItInfo const tiling = KernelTiling(opt, IntVect(block[0], block[1], block[2]));
+                            FirstTouch(prev, tiling);
+                            FirstTouch(next, tiling);
+                            FirstTouch(vel, tiling);
+                        }
+                        Initialize<HL>(prev, next, vel, domain);
+                        vel.FillBoundary();
+                        Gpu::streamSynchronize();
+                        VelocityModel vmodel(vel, domain, "field");
+                        ActiveRegion active(prev, next, domain, false);
+
+                        // The brick variant steps copies of the fields in bricks.
+                        std::unique_ptr<BrickArray> bprev, bnext, bvel;
+                        if (brick) {
+                            bprev = std::make_unique<BrickArray>(prev, HL, brick_params);
+                            bnext = std::make_unique<BrickArray>(prev, HL, brick_params);
+                            bvel = std::make_unique<BrickArray>(prev, HL, brick_params);
+                            bprev->setVal(0.0f);
+                            bnext->setVal(0.0f);
+                            bvel->setVal(0.0f);
+                            ToBricks(*bprev, prev);
+                            ToBricks(*bnext, next);
+                            ToBricks(*bvel, vel);
+                        }
+
+                        auto advance = [&] (int nsteps) {
+                            StepTimers timers;
+                            if (opt == 1) {
+                                Iso3dfd_opt<HL>(next, prev, vel, coeff_dv, nsteps,
+                                                block[0], block[1], block[2], active, timers);
+                            } else if (opt == 2) {
+                                Iso3dfd_tb<HL>(next, prev, vel, coeff_dv, nsteps, tb, timers);
+                            } else if (opt == 3) {
+                                Iso3dfd_persistent<HL>(next, prev, vel, coeff_dv, nsteps, ps, timers);
+                            } else if (brick) {
+                                Iso3dfd_brick<HL>(*bnext, *bprev, *bvel, coeff_dv, nsteps, timers);
+                            } else {
+                                Iso3dfd<HL>(next, prev, vmodel, coeff_dv, nsteps, active, timers);
+                            }
+                            Gpu::streamSynchronize();
+                        };
+
+                        advance(warmup);
+                        BenchResult res{variant, grid, block, nthreads, numa_nodes, arena,
+                                        bytes_per_point, {}, stream_gbs};
+                        for (int s = 0; s < samples; ++s) {
+                            ParallelDescriptor::Barrier();
+                            auto t0 = amrex::second();
+                            advance(steps);
+                            double dt = amrex::second() - t0;
+                            ParallelDescriptor::ReduceRealMax(dt);
+                            res.times.push_back(dt / steps);
+                        }
+
+                        auto sorted = res.times;
+                        std::sort(sorted.begin(), sorted.end());
+                        amrex::Print() << variant << " grid " << grid[0] << " " << grid[1] << " " << grid[2];
+                        if (opt == 1) {
+                            amrex::Print() << " blocks " << block[0] << " " << block[1] << " " << block[2];
+                        }
+                        amrex::Print() << " threads " << nthreads << " arena " << arena << ": "
+                                       << domain.d_numPts() / Percentile(sorted, 0.5) / 1.e6
+                                       << " Mpts/s (median of " << samples << ")\n";
+                        results.push_back(std::move(res));
+                    }
+                }
+            }
+        }
+    }
+
+    int const order = 2*HL;
+    WriteResults(output, results, order);
+}
+
+void main_main ()
+{
+    static_assert(std::is_same_v<float,Real>);
+
+    int order = 2*kHalfLength;
+    {
+        ParmParse pp;
+        pp.query("order", order);
+    }
+    amrex::Print() << "Stencil order: " << order << "\n";
+
+    switch (order) {
+    case 2:  RunBenchmark<1>(); break;
+    case 4:  RunBenchmark<2>(); break;
+    case 8:  RunBenchmark<4>(); break;
+    case 16: RunBenchmark<8>(); break;
+    default: amrex::Abort("order must be 2, 4, 8 or 16");
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    amrex::Initialize(argc,argv);
+    {
+        main_main();
+    }
+    amrex::Finalize();
+}
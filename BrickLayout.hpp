@@ -0,0 +1,405 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FArrayBox.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <vector>
+#include "Propagators.hpp"
+
+// Bricked field layout (layout = brick).
+//
+// In the lexicographic Array4 layout the z-neighbours of a point are kstride
+// apart, megabytes for large boxes, so the 2*HL+1 planes a point reads each
+// sit on their own pages and often in the same cache sets.  A BrickArray
+// stores each fab, ghost cells included, as bricks of brick.size^3 contiguous
+// floats, so the neighbours of a point lie in its own brick and the six around
+// it.  With brick.pad = 1 the strides between brick rows and brick planes are
+// made odd numbers of bricks, so bricks a row or a plane apart fall in
+// different cache sets.  Iso3dfd_brick sums in the order of Iso3dfdPoint, so
+// it matches opt = 1 and 2, and opt = 0 and 3 with the raw and array4_hack
+// kernels, bit for bit; the array4 and simd kernels sum in other orders and
+// match to rounding.
+struct BrickParams
+{
+    std::string layout = "lex";
+    int size = 8;
+    int pad = 1;
+
+    explicit BrickParams (int half_length)
+    {
+        amrex::ParmParse pp;
+        pp.query("layout", layout);
+        amrex::ParmParse ppb("brick");
+        ppb.query("size", size);
+        ppb.query("pad", pad);
+        if (layout != "lex" && layout != "brick") {
+            amrex::Abort("layout must be lex or brick");
+        }
+        if (size != 4 && size != 8 && size != 16) {
+            amrex::Abort("brick.size must be 4, 8 or 16");
+        }
+        if (size < half_length) {
+            amrex::Abort("brick.size must be at least the stencil half-length");
+        }
+    }
+
+    bool enabled () const { return layout == "brick"; }
+};
+
+constexpr int kMaxBrick = 16;
+
+// Cell (i,j,k) of one fab in bricks.
+struct BrickView
+{
+    float* p;
+    amrex::IntVect lo;   // first cell of brick 0
+    int shift;           // log2 of the brick size
+    amrex::Long rs;      // bricks between rows
+    amrex::Long ps;      // bricks between planes
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    amrex::Long brick (int bi, int bj, int bk) const noexcept { return bi + rs*bj + ps*bk; }
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    float& operator() (int i, int j, int k) const noexcept
+    {
+        int const m = (1 << shift) - 1;
+        i -= lo[0];
+        j -= lo[1];
+        k -= lo[2];
+        return p[(brick(i >> shift, j >> shift, k >> shift) << (3*shift))
+                 + (i & m) + ((j & m) << shift) + ((k & m) << (2*shift))];
+    }
+};
+
+// The fabs of a MultiFab, grown by ngrow, in bricks.  Ghost cells are filled
+// from the other boxes by fillBoundary, on a single rank.
+class BrickArray
+{
+public:
+    BrickArray (amrex::MultiFab const& mf, int ngrow, BrickParams const& params)
+    {
+        if (amrex::ParallelDescriptor::NProcs() > 1) {
+            amrex::Abort("layout = brick needs a single MPI rank");
+        }
+        int const B = params.size;
+        while ((1 << m_shift) < B) { ++m_shift; }
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+            Fab f;
+            f.valid = mfi.validbox();
+            f.box = amrex::grow(f.valid, ngrow);
+            amrex::IntVect nb;
+            for (int d = 0; d < 3; ++d) {
+                nb[d] = (f.box.length(d) + B - 1) / B;
+            }
+            f.rs = nb[0];
+            f.ps = f.rs * nb[1];
+            if (params.pad) {
+                if (f.rs % 2 == 0) { ++f.rs; }
+                f.ps = f.rs * nb[1];
+                if (f.ps % 2 == 0) { ++f.ps; }
+            }
+            f.data.resize(f.ps * nb[2] * B*B*B);
+            m_bytes += amrex::Long(f.data.size() * sizeof(float));
+            m_fabs.push_back(std::move(f));
+        }
+
+        // Copies of ghost cells from the valid cells of the other boxes.
+        amrex::BoxArray const& ba = mf.boxArray();
+        for (int d = 0; d < int(m_fabs.size()); ++d) {
+            for (int s = 0; s < int(m_fabs.size()); ++s) {
+                amrex::Box const& region = m_fabs[d].box & m_fabs[s].valid;
+                if (s != d && region.ok()) {
+                    m_pulls.push_back({region, d, s});
+                }
+            }
+        }
+        AMREX_ALWAYS_ASSERT(int(m_fabs.size()) == ba.size());
+    }
+
+    int size () const { return int(m_fabs.size()); }
+    int brickSize () const { return 1 << m_shift; }
+    amrex::Box const& box (int li) const { return m_fabs[li].box; }
+    amrex::Box const& validbox (int li) const { return m_fabs[li].valid; }
+    amrex::Long bytes () const { return m_bytes; }
+
+    BrickView view (int li) const
+    {
+        auto const& f = m_fabs[li];
+        return {const_cast<float*>(f.data.data()), f.box.smallEnd(), m_shift, f.rs, f.ps};
+    }
+
+    // Strides of the first fab, for the report.
+    amrex::Long rowStride () const { return m_fabs.empty() ? 0 : m_fabs[0].rs; }
+    amrex::Long planeStride () const { return m_fabs.empty() ? 0 : m_fabs[0].ps; }
+
+    void setVal (float v)
+    {
+        for (auto& f : m_fabs) {
+            float* p = f.data.data();
+            amrex::ParallelFor(amrex::Long(f.data.size()), [=] AMREX_GPU_DEVICE (amrex::Long n)
+            {
+                p[n] = v;
+            });
+        }
+    }
+
+    void fillBoundary ()
+    {
+        BL_PROFILE("BrickArray::fillBoundary()");
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (int n = 0; n < int(m_pulls.size()); ++n) {
+            auto const& pull = m_pulls[n];
+            BrickView const dst = view(pull.dst);
+            BrickView const src = view(pull.src);
+            amrex::ParallelFor(pull.region, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                dst(i,j,k) = src(i,j,k);
+            });
+        }
+    }
+
+private:
+    struct Fab
+    {
+        amrex::Box valid;
+        amrex::Box box;
+        amrex::Long rs = 0;
+        amrex::Long ps = 0;
+        amrex::Gpu::DeviceVector<float> data;
+    };
+
+    struct Pull
+    {
+        amrex::Box region;
+        int dst;
+        int src;
+    };
+
+    std::vector<Fab> m_fabs;
+    std::vector<Pull> m_pulls;
+    int m_shift = 0;
+    amrex::Long m_bytes = 0;
+};
+
+// dst = src on region, for one fab.
+inline void ToBricks (BrickView const& dst, amrex::FArrayBox const& src, amrex::Box const& region)
+{
+    auto const& s = src.const_array();
+    amrex::ParallelFor(region, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+    {
+        dst(i,j,k) = s(i,j,k);
+    });
+}
+
+inline void FromBricks (amrex::FArrayBox& dst, BrickView const& src, amrex::Box const& region)
+{
+    auto const& d = dst.array();
+    amrex::ParallelFor(region, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+    {
+        d(i,j,k) = src(i,j,k);
+    });
+}
+
+// dst = src on the bricked cells, ghost cells included.
+inline void ToBricks (BrickArray& dst, amrex::MultiFab const& src)
+{
+    for (amrex::MFIter mfi(src); mfi.isValid(); ++mfi) {
+        int const li = mfi.LocalIndex();
+        ToBricks(dst.view(li), src[mfi], dst.box(li) & mfi.fabbox());
+    }
+    amrex::Gpu::streamSynchronize();
+}
+
+// dst = src on the valid cells.
+inline void FromBricks (amrex::MultiFab& dst, BrickArray const& src)
+{
+    for (amrex::MFIter mfi(dst); mfi.isValid(); ++mfi) {
+        FromBricks(dst[mfi], src.view(mfi.LocalIndex()), mfi.validbox());
+    }
+    amrex::Gpu::streamSynchronize();
+}
+
+namespace detail {
+
+// Update the cells of row (jj, kk) of brick (bi, bj, bk) that lie in clip.
+// The x-neighbours are gathered into one padded row; the y- and z-neighbour
+// rows are whole rows of this brick or of the brick next to it.
+template <int HL>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+void BrickRow (BrickView const& next, BrickView const& prev, BrickView const& vel, float const* coeff,
+               int bi, int bj, int bk, int jj, int kk, amrex::Box const& clip)
+{
+    int const s = prev.shift;
+    int const B = 1 << s;
+    int const BB = B * B;
+    int const j = prev.lo[1] + bj * B + jj;
+    int const k = prev.lo[2] + bk * B + kk;
+    if (j < clip.smallEnd(1) || j > clip.bigEnd(1) || k < clip.smallEnd(2) || k > clip.bigEnd(2)) {
+        return;
+    }
+    int const x0 = prev.lo[0] + bi * B;
+    int const i0 = amrex::max(0, clip.smallEnd(0) - x0);
+    int const i1 = amrex::min(B, clip.bigEnd(0) + 1 - x0);
+    if (i0 >= i1) { return; }
+
+    amrex::Long const B3 = amrex::Long(BB) * B;
+    amrex::Long const b = prev.brick(bi, bj, bk);
+    int const row = jj * B + kk * BB;
+    float const* pb = prev.p + b * B3 + row;
+
+    float xrow[kMaxBrick + 2*HL];
+    for (int q = i0 - HL; q < i1 + HL; ++q) {
+        xrow[q + HL] = (q < 0) ? prev.p[(b - 1) * B3 + row + q + B]
+                     : (q >= B) ? prev.p[(b + 1) * B3 + row + q - B] : pb[q];
+    }
+    float value[kMaxBrick];
+    for (int ii = i0; ii < i1; ++ii) {
+        value[ii] = xrow[HL + ii] * coeff[0];
+    }
+    for (int r = 1; r <= HL; ++r) {
+        float const* yp = (jj + r < B) ? pb + r * B : prev.p + (b + prev.rs) * B3 + row + (r - B) * B;
+        float const* ym = (jj - r >= 0) ? pb - r * B : prev.p + (b - prev.rs) * B3 + row + (B - r) * B;
+        float const* zp = (kk + r < B) ? pb + r * BB : prev.p + (b + prev.ps) * B3 + row + (r - B) * BB;
+        float const* zm = (kk - r >= 0) ? pb - r * BB : prev.p + (b - prev.ps) * B3 + row + (B - r) * BB;
+        float const c = coeff[r];
+        AMREX_PRAGMA_SIMD
+        for (int ii = i0; ii < i1; ++ii) {
+            value[ii] += c * (xrow[HL + ii + r] + xrow[HL + ii - r] +
+                              yp[ii] + ym[ii] + zp[ii] + zm[ii]);
+        }
+    }
+    float* nb = next.p + b * B3 + row;
+    float const* vb = vel.p + b * B3 + row;
+    for (int ii = i0; ii < i1; ++ii) {
+        nb[ii] = 2.0f * xrow[HL + ii] - nb[ii] + value[ii] * vb[ii];
+    }
+}
+
+// One step on the valid cells of fab li.
+template <int HL>
+void BrickStep (BrickArray& nextba, BrickArray const& prevba, BrickArray const& velba, int li,
+                float const* coeff)
+{
+    BrickView const next = nextba.view(li);
+    BrickView const prev = prevba.view(li);
+    BrickView const vel = velba.view(li);
+    amrex::Box const& vbx = prevba.validbox(li);
+    int const s = prev.shift;
+    int const B = 1 << s;
+    int lo[3], nb[3];
+    for (int d = 0; d < 3; ++d) {
+        lo[d] = (vbx.smallEnd(d) - prev.lo[d]) >> s;
+        nb[d] = ((vbx.bigEnd(d) - prev.lo[d]) >> s) - lo[d] + 1;
+    }
+    int const nbricks = nb[0] * nb[1] * nb[2];
+#ifdef AMREX_USE_GPU
+    amrex::ParallelFor(amrex::Long(nbricks) * B * B, [=] AMREX_GPU_DEVICE (amrex::Long n)
+    {
+        int const jj = int(n % B);
+        int const kk = int((n / B) % B);
+        int const m = int(n / (B * B));
+        BrickRow<HL>(next, prev, vel, coeff, lo[0] + m % nb[0], lo[1] + (m / nb[0]) % nb[1],
+                     lo[2] + m / (nb[0] * nb[1]), jj, kk, vbx);
+    });
+#else
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for
+#endif
+    for (int m = 0; m < nbricks; ++m) {
+        int const bi = lo[0] + m % nb[0];
+        int const bj = lo[1] + (m / nb[0]) % nb[1];
+        int const bk = lo[2] + m / (nb[0] * nb[1]);
+        for (int kk = 0; kk < B; ++kk) {
+            for (int jj = 0; jj < B; ++jj) {
+                BrickRow<HL>(next, prev, vel, coeff, bi, bj, bk, jj, kk, vbx);
+            }
+        }
+    }
+#endif
+}
+
+}
+
+template <int HL>
+void Iso3dfd_brick (BrickArray& nextba, BrickArray& prevba, BrickArray const& velba,
+                    amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+                    StepTimers& timers)
+{
+    BL_PROFILE("Iso3dfd_brick()");
+    auto const* coeff = coeffdv.data();
+    for (int it = 0; it < num_iterations; ++it) {
+        bool const even = (it % 2 == 0);
+        auto& next = even ? nextba : prevba;
+        auto& prev = even ? prevba : nextba;
+
+        auto t0 = amrex::second();
+        prev.fillBoundary();
+        amrex::Gpu::streamSynchronize();
+        auto t1 = amrex::second();
+        for (int li = 0; li < prev.size(); ++li) {
+            detail::BrickStep<HL>(next, prev, velba, li, coeff);
+        }
+        amrex::Gpu::streamSynchronize();
+        auto t2 = amrex::second();
+        timers.record(t1 - t0, t2 - t1);
+    }
+}
+
+// Repeat the run in bricks and report the gain over the lexicographic run,
+// which took lex_time and left its newest wavefield in prev.  The results
+// must be equal if the lex kernel summed in the order of Iso3dfdPoint
+// (exact), and agree to a relative 1e-5 otherwise.  next is used as scratch.
+template <int HL>
+void RunBricked (BrickParams const& params, amrex::MultiFab const& prev, amrex::MultiFab& next,
+                 amrex::MultiFab const& vel, amrex::Box const& domain,
+                 amrex::Gpu::DeviceVector<float> const& coeff_dv, int num_iterations, double lex_time,
+                 bool exact)
+{
+    BL_PROFILE("RunBricked()");
+    Initialize<HL>(next, next, domain);
+    BrickArray bprev(next, HL, params);
+    BrickArray bnext(next, HL, params);
+    BrickArray bvel(next, HL, params);
+    bprev.setVal(0.0f);
+    bnext.setVal(0.0f);
+    bvel.setVal(0.0f);
+    ToBricks(bprev, next);
+    ToBricks(bvel, vel);
+
+    amrex::Long const B = bprev.brickSize();
+    amrex::Print() << "Bricks " << B << "^3, row stride " << bprev.rowStride()
+                   << " bricks, plane stride " << bprev.planeStride() << " bricks"
+                   << (params.pad ? " (padded)" : "") << ", "
+                   << 3 * bprev.bytes() / (1024 * 1024) << " MB\n";
+
+    StepTimers warmup_timers;
+    Iso3dfd_brick<HL>(bnext, bprev, bvel, coeff_dv, 20, warmup_timers); // warm up
+
+    StepTimers timers;
+    auto t0 = amrex::second();
+    Iso3dfd_brick<HL>(bnext, bprev, bvel, coeff_dv, num_iterations, timers);
+    auto t1 = amrex::second();
+    if (amrex::ParallelDescriptor::IOProcessor()) {
+        printStats(t1-t0, domain, num_iterations, HL);
+    }
+    printCommStats(timers, t1-t0, bprev.size(), "none");
+    amrex::Print() << "gain vs lex  : " << lex_time / (t1-t0) << "x\n";
+
+    // The newest wavefield is in bprev, as it is in prev.
+    FromBricks(next, bprev);
+    amrex::MultiFab::Subtract(next, prev, 0, 0, 1, 0);
+    double const diff = next.norm0();
+    double const rel = diff / std::max(double(prev.norm0()), std::numeric_limits<double>::min());
+    bool const passed = exact ? (diff == 0.0) : (rel <= 1.e-5);
+    amrex::Print() << "max difference vs the lex run: " << diff << ", relative " << rel
+                   << (exact ? " (bit for bit expected): " : " (1e-5 allowed): ")
+                   << (passed ? "Success" : "Failed") << "\n";
+}
@@ -0,0 +1,183 @@
+#pragma once
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <AMReX_Reduce.H>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// Wavefield diagnostics (diag.interval = N, opt = 0 and 1).
+//
+// Every N-th step is computed by a kernel that also reduces the statistics
+// of the new wavefield, so monitoring costs no extra pass over memory: min,
+// max, 1-, 2- and inf-norm and sum, the count of NaN/Inf values, and the
+// energy that leapfrog conserves,
+//   E = 1/2 sum[(p^{n+1} - p^n)^2 / (v dt)^2 - p^{n+1} lap p^n],
+// evaluated through the update as 1/2 sum[(p^n)^2 - p^{n+1} p^{n-1}] / (v dt)^2.
+// The reduction keeps one partial per thread (per block on GPU) and combines
+// them once per step.  The update keeps the summation order of the kernel it
+// stands in for (raw, array4, array4_hack or opt = 1), so results are
+// unchanged.  diag.abort_on_nan = 1 stops the run at the first NaN or Inf.
+
+struct FieldStats
+{
+    float min = 0.0f;
+    float max = 0.0f;
+    double norm1 = 0.0;
+    double norm2 = 0.0;
+    float norm0 = 0.0f;
+    double sum = 0.0;
+    amrex::Long nonfinite = 0;
+    double energy = 0.0;
+};
+
+using StatsReduceOps = amrex::ReduceOps<amrex::ReduceOpMin, amrex::ReduceOpMax, amrex::ReduceOpSum,
+                                        amrex::ReduceOpSum, amrex::ReduceOpMax, amrex::ReduceOpSum,
+                                        amrex::ReduceOpSum, amrex::ReduceOpSum>;
+using StatsReduceData = amrex::ReduceData<float, float, double, double, float, double,
+                                          amrex::Long, double>;
+using StatsTuple = StatsReduceData::Type;
+
+// Contribution of one cell of value v; energy is that of the cell.
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+StatsTuple CellStats (float v, double energy)
+{
+    float const av = std::abs(v);
+    if (!(av <= std::numeric_limits<float>::max())) {
+        return {std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest(),
+                0.0, 0.0, 0.0f, 0.0, amrex::Long(1), 0.0};
+    }
+    return {v, v, double(av), double(v)*double(v), av, double(v), amrex::Long(0), energy};
+}
+
+// Combine the partials over the ranks.  The cells outside the region the
+// kernel visited are zero and only count toward min and max.
+inline FieldStats FinishStats (StatsReduceData const& reduce_data, bool all_cells)
+{
+    auto const r = reduce_data.value();
+    FieldStats s;
+    s.min = amrex::get<0>(r);
+    s.max = amrex::get<1>(r);
+    s.norm1 = amrex::get<2>(r);
+    s.norm2 = amrex::get<3>(r);
+    s.norm0 = amrex::get<4>(r);
+    s.sum = amrex::get<5>(r);
+    s.nonfinite = amrex::get<6>(r);
+    s.energy = amrex::get<7>(r);
+    if (!all_cells) {
+        s.min = amrex::min(s.min, 0.0f);
+        s.max = amrex::max(s.max, 0.0f);
+    }
+    amrex::ParallelDescriptor::ReduceRealMin(s.min);
+    amrex::ParallelDescriptor::ReduceRealMax(s.max);
+    amrex::ParallelDescriptor::ReduceRealMax(s.norm0);
+    double sums[4] = {s.norm1, s.norm2, s.sum, s.energy};
+    amrex::ParallelDescriptor::ReduceRealSum(sums, 4);
+    amrex::ParallelDescriptor::ReduceLongSum(s.nonfinite);
+    s.norm1 = sums[0];
+    s.norm2 = std::sqrt(sums[1]);
+    s.sum = sums[2];
+    s.energy = sums[3];
+    return s;
+}
+
+// All statistics but the energy of the valid cells of mf in one pass.
+inline FieldStats Stats (amrex::MultiFab const& mf)
+{
+    BL_PROFILE("Stats()");
+    StatsReduceOps reduce_op;
+    StatsReduceData reduce_data(reduce_op);
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+    for (amrex::MFIter mfi(mf, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+        auto const& a = mf.const_array(mfi);
+        reduce_op.eval(mfi.tilebox(), reduce_data,
+        [=] AMREX_GPU_DEVICE (int i, int j, int k) -> StatsTuple
+        {
+            return CellStats(a(i,j,k), 0.0);
+        });
+    }
+    return FinishStats(reduce_data, true);
+}
+
+inline void PrintStats (char const* label, FieldStats const& s)
+{
+    amrex::Print() << label << " min, max, 1-norm, 2-norm, inf-norm, sum: "
+                   << s.min << ", " << s.max << ", " << s.norm1 << ", "
+                   << s.norm2 << ", " << s.norm0 << ", " << s.sum << "\n";
+}
+
+// Contribution of a cell updated from older (p^{n-1}) and p0 (p^n) to newer
+// (p^{n+1}) with v2dt2 = (v dt)^2.
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+StatsTuple UpdateStats (float older, float p0, float newer, float v2dt2)
+{
+    double const energy = (v2dt2 > 0.0f)
+        ? 0.5 * (double(p0)*double(p0) - double(newer)*double(older)) / double(v2dt2) : 0.0;
+    return CellStats(newer, energy);
+}
+
+struct Diagnostics
+{
+    int interval = 0;
+    int abort_on_nan = 1;
+    // Steps advanced so far, warm-up included.
+    long step = 0;
+    std::vector<long> steps;
+    std::vector<FieldStats> history;
+    double monitored_time = 0.0;
+    double plain_time = 0.0;
+    long plain_steps = 0;
+
+    Diagnostics ()
+    {
+        amrex::ParmParse pp("diag");
+        pp.query("interval", interval);
+        pp.query("abort_on_nan", abort_on_nan);
+        if (interval < 0) {
+            amrex::Abort("diag.interval must be >= 0");
+        }
+    }
+
+    bool enabled () const { return interval > 0; }
+
+    // Whether the step about to be taken is monitored.
+    bool due () const { return enabled() && (step + 1) % interval == 0; }
+
+    // Count a step that took compute seconds; stats is set if it was monitored.
+    void finishStep (double compute, FieldStats const* stats)
+    {
+        ++step;
+        if (!stats) {
+            plain_time += compute;
+            ++plain_steps;
+            return;
+        }
+        monitored_time += compute;
+        steps.push_back(step);
+        history.push_back(*stats);
+        amrex::Print() << "diag step " << step << ": min " << stats->min << ", max " << stats->max
+                       << ", 2-norm " << stats->norm2 << ", inf-norm " << stats->norm0
+                       << ", nonfinite " << stats->nonfinite << ", energy " << stats->energy << "\n";
+        if (stats->nonfinite > 0 && abort_on_nan) {
+            amrex::Abort("diag: NaN or Inf in the wavefield");
+        }
+    }
+
+    void printSummary () const
+    {
+        if (history.empty()) { return; }
+        double const e0 = history.front().energy;
+        double drift = 0.0;
+        for (auto const& s : history) {
+            drift = amrex::max(drift, std::abs(s.energy - e0));
+        }
+        amrex::Print() << "diag: " << history.size() << " checks every " << interval
+                       << " steps, max energy drift " << (e0 != 0.0 ? drift / std::abs(e0) : drift)
+                       << " relative, compute " << monitored_time / history.size()
+                       << " secs per monitored step vs "
+                       << (plain_steps > 0 ? plain_time / plain_steps : 0.0) << " secs per step\n";
+    }
+};
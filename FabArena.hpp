@@ -0,0 +1,264 @@
+#pragma once
+#include <AMReX_Arena.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_Print.H>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#if defined(__linux__) && !defined(AMREX_USE_GPU)
+#define ISO3DFD_HUGEPAGES 1
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Huge-page arena for the wavefield fabs (arena = default|thp|hugetlb).
+//
+// The default arena can hand out pages the allocator has already touched, so
+// on a multi-socket node all of them may sit on one NUMA node, and 4 KiB pages
+// cost TLB misses across multi-GB fields.  thp maps fresh 2 MiB-aligned memory
+// and asks for transparent huge pages; hugetlb takes explicit 2 MiB pages
+// from the hugetlbfs pool and falls back to thp when the pool runs short.
+// FirstTouch then writes each page from the thread that updates it, so with
+// OMP_PROC_BIND set the page lands on that thread's NUMA node.
+class HugePageArena : public amrex::Arena
+{
+public:
+    static constexpr std::size_t page_size = std::size_t(2) << 20;
+
+    explicit HugePageArena (bool explicit_pages) : m_explicit(explicit_pages) {}
+
+    HugePageArena (HugePageArena const&) = delete;
+    HugePageArena& operator= (HugePageArena const&) = delete;
+
+    ~HugePageArena () override
+    {
+#ifdef ISO3DFD_HUGEPAGES
+        for (auto const& m : m_maps) { munmap(m.second.base, m.second.length); }
+#endif
+    }
+
+    void* alloc (std::size_t nbytes) override
+    {
+#ifdef ISO3DFD_HUGEPAGES
+        std::size_t const length = (nbytes + page_size - 1) / page_size * page_size;
+        Mapping m{MAP_FAILED, length};
+        if (m_explicit) {
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+            flags |= MAP_HUGE_2MB;
+#endif
+            m.base = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        }
+        void* p = m.base;
+        bool const hugetlb = (p != MAP_FAILED);
+        if (!hugetlb) {
+            // Over-allocate by a page to align the start to 2 MiB.
+            m.length = length + page_size;
+            m.base = mmap(nullptr, m.length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m.base == MAP_FAILED) { amrex::Abort("HugePageArena: mmap failed"); }
+            auto const addr = reinterpret_cast<std::uintptr_t>(m.base);
+            p = reinterpret_cast<void*>((addr + page_size - 1) / page_size * page_size);
+            madvise(p, length, MADV_HUGEPAGE);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_explicit && !hugetlb && !m_warned) {
+            amrex::Print() << "HugePageArena: hugetlbfs pool exhausted, using transparent huge pages\n";
+            m_warned = true;
+        }
+        (hugetlb ? m_hugetlb_bytes : m_thp_bytes) += length;
+        m_maps[p] = m;
+        return p;
+#else
+        amrex::ignore_unused(nbytes);
+        amrex::Abort("arena = thp|hugetlb needs a Linux CPU build");
+        return nullptr;
+#endif
+    }
+
+    void free (void* p) override
+    {
+        if (p == nullptr) { return; }
+#ifdef ISO3DFD_HUGEPAGES
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_maps.find(p);
+        AMREX_ALWAYS_ASSERT(it != m_maps.end());
+        munmap(it->second.base, it->second.length);
+        m_maps.erase(it);
+#endif
+    }
+
+    // Bytes mapped from the hugetlbfs pool and with transparent huge pages.
+    std::size_t hugetlbBytes () const { return m_hugetlb_bytes; }
+    std::size_t thpBytes () const { return m_thp_bytes; }
+
+private:
+    struct Mapping
+    {
+        void* base;
+        std::size_t length;
+    };
+
+    bool m_explicit;
+    bool m_warned = false;
+    std::size_t m_hugetlb_bytes = 0;
+    std::size_t m_thp_bytes = 0;
+    std::mutex m_mutex;
+    std::map<void*, Mapping> m_maps;
+};
+
+// Heap arena that aligns every fab to 64 bytes, a cache line and an AVX-512
+// vector, without huge pages or first touch, so a kernel = simd run differs
+// from a default-arena run only in the alignment.
+class AlignedArena : public amrex::Arena
+{
+public:
+    static constexpr std::size_t alignment = 64;
+
+    void* alloc (std::size_t nbytes) override
+    {
+        std::size_t const length = (nbytes + alignment - 1) / alignment * alignment;
+        void* p = std::aligned_alloc(alignment, amrex::max(length, alignment));
+        if (p == nullptr) { amrex::Abort("AlignedArena: out of memory"); }
+        return p;
+    }
+
+    void free (void* p) override { std::free(p); }
+};
+
+// The arena named by kind, or nullptr for the default one.
+inline std::unique_ptr<HugePageArena> MakeFabArena (std::string const& kind)
+{
+    if (kind == "default") { return nullptr; }
+    if (kind != "thp" && kind != "hugetlb") {
+        amrex::Abort("arena must be default, thp or hugetlb");
+    }
+#ifdef AMREX_USE_GPU
+    amrex::Abort("arena = thp|hugetlb is only available for CPU builds");
+#endif
+    return std::make_unique<HugePageArena>(kind == "hugetlb");
+}
+
+inline amrex::MFInfo FabInfo (std::unique_ptr<HugePageArena> const& arena)
+{
+    amrex::MFInfo info;
+    if (arena) { info.SetArena(arena.get()); }
+    return info;
+}
+
+// The fabs of kernel = simd: from arena if one was made, else 64-byte aligned.
+inline amrex::MFInfo SimdFabInfo (std::unique_ptr<HugePageArena> const& arena, AlignedArena& aligned)
+{
+    amrex::MFInfo info = FabInfo(arena);
+    if (!arena) { info.SetArena(&aligned); }
+    return info;
+}
+
+// Zero mf, ghost cells included, in an MFIter loop with the tiling of the
+// kernel that will update it, before anything else writes it.
+inline void FirstTouch (amrex::MultiFab& mf, amrex::MFItInfo const& info)
+{
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+    for (amrex::MFIter mfi(mf, info); mfi.isValid(); ++mfi) {
+        amrex::Box const& bx = mfi.growntilebox();
+        auto const& a = mf.array(mfi);
+        amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            a(i,j,k) = 0.0f;
+        });
+    }
+}
+
+// The NUMA node of cpu, or 0 if it cannot be told.
+inline int CpuNumaNode (int cpu)
+{
+#ifdef ISO3DFD_HUGEPAGES
+    std::string const dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            std::string const name = entry->d_name;
+            if (name.rfind("node", 0) == 0 && name.size() > 4) {
+                closedir(d);
+                return std::atoi(name.c_str() + 4);
+            }
+        }
+        closedir(d);
+    }
+#endif
+    amrex::ignore_unused(cpu);
+    return 0;
+}
+
+// The NUMA nodes the OpenMP threads of this rank run on.
+inline std::set<int> ThreadNumaNodes ()
+{
+    std::set<int> nodes;
+#ifdef ISO3DFD_HUGEPAGES
+#ifdef AMREX_USE_OMP
+#pragma omp parallel
+#endif
+    {
+        int const node = CpuNumaNode(sched_getcpu());
+#ifdef AMREX_USE_OMP
+#pragma omp critical (iso3dfd_numa_nodes)
+#endif
+        nodes.insert(node);
+    }
+#endif
+    if (nodes.empty()) { nodes.insert(0); }
+    return nodes;
+}
+
+// Print the binding of the OpenMP threads, the NUMA nodes they span and
+// where a sample of the pages of the local fabs of mf ended up.
+inline void ReportPlacement (amrex::MultiFab const& mf, HugePageArena const& arena)
+{
+    auto const nodes = ThreadNumaNodes();
+    amrex::Print() << "Fab arena: " << arena.hugetlbBytes() / (1024*1024) << " MB hugetlb, "
+                   << arena.thpBytes() / (1024*1024) << " MB transparent huge pages; threads on "
+                   << nodes.size() << " NUMA node(s)\n";
+#ifdef AMREX_USE_OMP
+    if (omp_get_proc_bind() == omp_proc_bind_false && omp_get_max_threads() > 1) {
+        amrex::Print() << "OpenMP threads are not bound; set OMP_PROC_BIND=spread and OMP_PLACES=cores "
+                       << "so that each page stays on the node of the thread that touched it\n";
+    }
+#endif
+#ifdef ISO3DFD_HUGEPAGES
+    // Query the node of up to 1024 pages of each fab with move_pages.
+    std::map<int,long> count;
+    long total = 0;
+    for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+        auto const& fab = mf[mfi];
+        auto* begin = reinterpret_cast<char*>(const_cast<float*>(fab.dataPtr()));
+        std::size_t const nbytes = fab.nBytes();
+        std::size_t const stride = std::max<std::size_t>(4096, nbytes / 1024 / 4096 * 4096);
+        std::vector<void*> pages;
+        for (std::size_t off = 0; off < nbytes; off += stride) { pages.push_back(begin + off); }
+        std::vector<int> status(pages.size(), -1);
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) {
+            return;
+        }
+        for (int s : status) {
+            if (s >= 0) { ++count[s]; ++total; }
+        }
+    }
+    if (total > 0) {
+        amrex::Print() << "Pages per NUMA node:";
+        for (auto const& c : count) {
+            amrex::Print() << " " << c.first << ": " << 100.0 * c.second / total << "%";
+        }
+        amrex::Print() << "\n";
+    }
+#endif
+}
@@ -0,0 +1,408 @@
+#pragma once
+#include <AMReX_GpuContainers.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <AMReX_Print.H>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__linux__) && !defined(AMREX_USE_GPU)
+#define ISO3DFD_PERF 1
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "Utils.hpp"
+
+// Hot-path instrumentation (instrument = 1).
+//
+// Prints histograms of the per-step halo-exchange and update times and, where
+// perf_event_open is permitted, reads hardware counters over the timed steps:
+// cycles, instructions and LLC misses of every OpenMP thread, the
+// single-precision FP_ARITH_INST_RETIRED events on Intel, and the DRAM CAS
+// counts of the uncore memory controllers.  The measured flops and bytes per
+// point are printed next to the model numbers of printStats, with a STREAM
+// triad for scale.  The profiling regions are marked with BL_PROFILE and are
+// reported by builds with TINY_PROFILE = TRUE.
+struct Instrumentation
+{
+    int enabled = 0;
+    int counters = 1;
+    int stream = 1;
+    int nbins = 10;
+    amrex::Long stream_size = amrex::Long(1) << 25;
+
+    Instrumentation ()
+    {
+        amrex::ParmParse pp;
+        pp.query("instrument", enabled);
+        amrex::ParmParse ppi("instrument");
+        ppi.query("counters", counters);
+        ppi.query("stream", stream);
+        ppi.query("nbins", nbins);
+        ppi.query("stream_size", stream_size);
+        AMREX_ALWAYS_ASSERT(nbins >= 1);
+    }
+};
+
+// Linear interpolation between the order statistics of sorted.
+inline double Percentile (std::vector<double> const& sorted, double p)
+{
+    double const x = p * double(sorted.size() - 1);
+    auto const lo = std::size_t(x);
+    auto const hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (x - double(lo)) * (sorted[hi] - sorted[lo]);
+}
+
+// Percentiles and an nbins-bin histogram of the samples of this rank.
+inline void PrintHistogram (std::string const& name, std::vector<double> samples, int nbins)
+{
+    if (samples.empty()) { return; }
+    std::sort(samples.begin(), samples.end());
+    double const lo = samples.front();
+    double const hi = samples.back();
+    amrex::Print() << name << " : " << samples.size() << " samples, min " << lo
+                   << ", median " << Percentile(samples, 0.5)
+                   << ", p90 " << Percentile(samples, 0.9)
+                   << ", p99 " << Percentile(samples, 0.99)
+                   << ", max " << hi << " secs\n";
+    std::vector<int> counts(nbins, 0);
+    double const width = (hi - lo) / nbins;
+    for (double s : samples) {
+        int const b = (width > 0.0) ? std::min(int((s - lo) / width), nbins - 1) : 0;
+        ++counts[b];
+    }
+    int const peak = *std::max_element(counts.begin(), counts.end());
+    for (int b = 0; b < nbins; ++b) {
+        amrex::Print() << "  " << lo + b*width << " - " << lo + (b+1)*width << " : "
+                       << counts[b] << " " << std::string(40 * counts[b] / peak, '#') << "\n";
+    }
+}
+
+// Best-of-ntrials STREAM triad a = b + s*c over n floats per rank, in GB/s
+// summed over the ranks.  The arrays are first touched by the threads that
+// later stream them.
+inline double StreamTriad (amrex::Long n, int ntrials)
+{
+    amrex::Gpu::DeviceVector<float> av(n), bv(n), cv(n);
+    float* a = av.data();
+    float* b = bv.data();
+    float* c = cv.data();
+    float const s = 3.0f;
+    auto triad = [&] (float x, float y, float z, bool init) {
+#ifdef AMREX_USE_GPU
+        amrex::ParallelFor(n, [=] AMREX_GPU_DEVICE (amrex::Long i)
+        {
+            if (init) { a[i] = x; b[i] = y; c[i] = z; }
+            else      { a[i] = b[i] + s*c[i]; }
+        });
+        amrex::Gpu::streamSynchronize();
+#else
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for
+#endif
+        for (amrex::Long i = 0; i < n; ++i) {
+            if (init) { a[i] = x; b[i] = y; c[i] = z; }
+            else      { a[i] = b[i] + s*c[i]; }
+        }
+#endif
+    };
+    triad(1.0f, 2.0f, 0.5f, true);
+    triad(0.0f, 0.0f, 0.0f, false);
+
+    double best = std::numeric_limits<double>::max();
+    for (int t = 0; t < ntrials; ++t) {
+        amrex::ParallelDescriptor::Barrier();
+        auto t0 = amrex::second();
+        triad(0.0f, 0.0f, 0.0f, false);
+        double dt = amrex::second() - t0;
+        amrex::ParallelDescriptor::ReduceRealMax(dt);
+        best = std::min(best, dt);
+    }
+    return 3.0 * sizeof(float) * double(n) * amrex::ParallelDescriptor::NProcs() / best / 1.e9;
+}
+
+// Hardware counters of this process, summed over its OpenMP threads, and
+// the DRAM traffic of the whole node.  Counters that cannot be opened read as
+// negative.
+class PerfCounters
+{
+public:
+    enum Event { Cycles, Instructions, LLCMisses, FpScalar, Fp128, Fp256, Fp512, NEvents };
+
+    PerfCounters ()
+    {
+        m_count.fill(-1.0);
+#ifdef ISO3DFD_PERF
+        int nthreads = 1;
+#ifdef AMREX_USE_OMP
+        nthreads = omp_get_max_threads();
+#endif
+        m_fd.assign(nthreads, {});
+        for (auto& fds : m_fd) { fds.fill(-1); }
+        bool const intel = CpuVendor() == "GenuineIntel";
+#ifdef AMREX_USE_OMP
+#pragma omp parallel num_threads(nthreads)
+#endif
+        {
+            int tid = 0;
+#ifdef AMREX_USE_OMP
+            tid = omp_get_thread_num();
+#endif
+            auto& fds = m_fd[tid];
+            fds[Cycles] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0, -1, true);
+            fds[Instructions] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0, -1, true);
+            fds[LLCMisses] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0, -1, true);
+            if (intel) {
+                // FP_ARITH_INST_RETIRED (event 0xc7), single-precision umasks.
+                std::uint64_t const umask[4] = {0x02, 0x08, 0x20, 0x80};
+                for (int e = 0; e < 4; ++e) {
+                    fds[FpScalar+e] = Open(PERF_TYPE_RAW, 0xc7 | (umask[e] << 8), 0, -1, true);
+                }
+            }
+        }
+        if (m_fd[0][Cycles] < 0) {
+            m_error = std::string("perf_event_open: ") + std::strerror(m_errno);
+        }
+        // The memory controllers count for the node, so only a single rank
+        // can attribute their traffic to itself.
+        if (amrex::ParallelDescriptor::NProcs() == 1) { OpenImc(); }
+#else
+        m_error = "perf_event_open is not available in this build";
+#endif
+    }
+
+    ~PerfCounters ()
+    {
+#ifdef ISO3DFD_PERF
+        for (auto const& fds : m_fd) {
+            for (int fd : fds) { if (fd >= 0) { close(fd); } }
+        }
+        for (int fd : m_imc_fd) { close(fd); }
+#endif
+    }
+
+    PerfCounters (PerfCounters const&) = delete;
+    PerfCounters& operator= (PerfCounters const&) = delete;
+
+    bool ok () const { return m_error.empty(); }
+    std::string const& error () const { return m_error; }
+
+    void start ()
+    {
+#ifdef ISO3DFD_PERF
+        ForEach([] (int fd) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        });
+#endif
+    }
+
+    void stop ()
+    {
+#ifdef ISO3DFD_PERF
+        ForEach([] (int fd) { ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); });
+        for (int e = 0; e < NEvents; ++e) {
+            double sum = 0.0;
+            bool any = false;
+            for (auto const& fds : m_fd) {
+                if (fds[e] >= 0) {
+                    sum += Read(fds[e]);
+                    any = true;
+                }
+            }
+            m_count[e] = any ? sum : -1.0;
+        }
+        m_dram_bytes = -1.0;
+        if (!m_imc_fd.empty()) {
+            m_dram_bytes = 0.0;
+            for (int fd : m_imc_fd) { m_dram_bytes += 64.0 * Read(fd); }
+        }
+#endif
+    }
+
+    double count (Event e) const { return m_count[e]; }
+
+    // Single-precision flops; FP_ARITH counts an FMA twice.
+    double flops () const
+    {
+        if (m_count[FpScalar] < 0.0 || m_count[Fp128] < 0.0 || m_count[Fp256] < 0.0) { return -1.0; }
+        return m_count[FpScalar] + 4.0*m_count[Fp128] + 8.0*m_count[Fp256]
+            + 16.0*std::max(m_count[Fp512], 0.0);
+    }
+
+    // DRAM bytes read and written by the node, from the memory controllers.
+    double dramBytes () const { return m_dram_bytes; }
+
+private:
+#ifdef ISO3DFD_PERF
+    int Open (std::uint32_t type, std::uint64_t config, pid_t pid, int cpu, bool user_only)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = user_only;
+        attr.exclude_hv = user_only;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int const fd = int(syscall(SYS_perf_event_open, &attr, pid, cpu, -1, 0));
+        if (fd < 0) {
+#ifdef AMREX_USE_OMP
+#pragma omp critical (iso3dfd_perf_errno)
+#endif
+            m_errno = errno;
+        }
+        return fd;
+    }
+
+    // The count scaled up for the time the event was multiplexed out.
+    static double Read (int fd)
+    {
+        std::uint64_t v[3] = {0, 0, 0};
+        if (read(fd, v, sizeof(v)) != ssize_t(sizeof(v)) || v[2] == 0) { return 0.0; }
+        return double(v[0]) * double(v[1]) / double(v[2]);
+    }
+
+    template <typename F>
+    void ForEach (F&& f)
+    {
+        for (auto const& fds : m_fd) {
+            for (int fd : fds) { if (fd >= 0) { f(fd); } }
+        }
+        for (int fd : m_imc_fd) { f(fd); }
+    }
+
+    static std::string ReadLine (std::string const& name)
+    {
+        std::ifstream is(name);
+        std::string line;
+        std::getline(is, line);
+        return line;
+    }
+
+    // cas_count_read and cas_count_write of every uncore_imc PMU, on the
+    // first CPU of its cpumask.  These are system-wide and usually need
+    // perf_event_paranoid <= 0.
+    void OpenImc ()
+    {
+        std::string const root = "/sys/bus/event_source/devices/";
+        DIR* dir = opendir(root.c_str());
+        if (!dir) { return; }
+        while (dirent* entry = readdir(dir)) {
+            std::string const pmu = entry->d_name;
+            if (pmu.rfind("uncore_imc", 0) != 0) { continue; }
+            std::string const type = ReadLine(root + pmu + "/type");
+            int const cpu = std::atoi(ReadLine(root + pmu + "/cpumask").c_str());
+            if (type.empty()) { continue; }
+            for (char const* event : {"cas_count_read", "cas_count_write"}) {
+                // "event=0x04,umask=0x03", with each field placed at the bits
+                // given by format/<field>, e.g. "config:8-15".
+                std::istringstream spec(ReadLine(root + pmu + "/events/" + event));
+                std::string field;
+                std::uint64_t config = 0;
+                bool valid = !spec.str().empty();
+                while (valid && std::getline(spec, field, ',')) {
+                    auto const eq = field.find('=');
+                    std::string const format = ReadLine(root + pmu + "/format/" + field.substr(0, eq));
+                    if (eq == std::string::npos || format.rfind("config:", 0) != 0) {
+                        valid = false;
+                        break;
+                    }
+                    config |= std::stoull(field.substr(eq + 1), nullptr, 0) << std::stoi(format.substr(7));
+                }
+                int const fd = valid ? Open(std::stoul(type), config, -1, cpu, false) : -1;
+                if (fd >= 0) { m_imc_fd.push_back(fd); }
+            }
+        }
+        closedir(dir);
+    }
+
+    static std::string CpuVendor ()
+    {
+        std::ifstream is("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(is, line)) {
+            if (line.rfind("vendor_id", 0) == 0) {
+                auto const pos = line.find_first_not_of(" \t:", line.find(':'));
+                return pos == std::string::npos ? std::string() : line.substr(pos);
+            }
+        }
+        return std::string();
+    }
+
+    std::vector<std::array<int,NEvents>> m_fd;
+    std::vector<int> m_imc_fd;
+    int m_errno = 0;
+#endif
+    std::array<double,NEvents> m_count;
+    double m_dram_bytes = -1.0;
+    std::string m_error;
+};
+
+// Measured against model flops and bytes per point for npoints cell updates
+// in time seconds, and whether the run looks bandwidth-, latency- or
+// compute-bound.  stream_gbs is skipped if it is not positive.
+inline void PrintCounterReport (PerfCounters const& pc, double npoints, double time,
+                                double model_flops, double model_bytes, double stream_gbs)
+{
+    using PC = PerfCounters;
+    std::array<double,PC::NEvents> count;
+    for (int e = 0; e < PC::NEvents; ++e) { count[e] = pc.count(PC::Event(e)); }
+    double flops = pc.flops();
+    amrex::ParallelDescriptor::ReduceRealSum(count.data(), int(count.size()));
+    amrex::ParallelDescriptor::ReduceRealSum(flops);
+
+    double bytes = model_bytes;
+    std::string bytes_source = "model";
+    if (pc.dramBytes() >= 0.0) {
+        bytes = pc.dramBytes() / npoints;
+        bytes_source = "DRAM CAS";
+    } else if (count[PC::LLCMisses] >= 0.0) {
+        bytes = 64.0 * count[PC::LLCMisses] / npoints;
+        bytes_source = "LLC misses x 64";
+    }
+    double const ipc = count[PC::Instructions] / count[PC::Cycles];
+
+    if (!pc.ok()) {
+        amrex::Print() << "hardware counters unavailable (" << pc.error() << ")\n";
+    } else {
+        amrex::Print() << "counters     : cycles " << count[PC::Cycles]
+                       << ", instructions " << count[PC::Instructions]
+                       << ", IPC " << ipc
+                       << ", LLC misses " << count[PC::LLCMisses] << "\n";
+        amrex::Print() << "per point    : flops ";
+        if (flops >= 0.0) { amrex::Print() << flops / npoints; } else { amrex::Print() << "n/a"; }
+        amrex::Print() << " (model " << model_flops << "), bytes " << bytes
+                       << " (model " << model_bytes << ", from " << bytes_source << ")"
+                       << ", instructions " << count[PC::Instructions] / npoints << "\n";
+    }
+    double const gbs = bytes * npoints / time / 1.e9;
+    amrex::Print() << "bandwidth    : " << gbs << " GBytes/s (" << bytes_source << ")";
+    if (stream_gbs > 0.0) {
+        amrex::Print() << ", " << 100.0 * gbs / stream_gbs << "% of STREAM triad "
+                       << stream_gbs << " GBytes/s";
+    }
+    amrex::Print() << "\n";
+
+    if (stream_gbs > 0.0 && gbs >= 0.7 * stream_gbs) {
+        amrex::Print() << "bound        : bandwidth (at least 70% of STREAM)\n";
+    } else if (pc.ok() && ipc < 1.0) {
+        amrex::Print() << "bound        : latency (below 70% of STREAM, IPC below 1)\n";
+    } else if (pc.ok()) {
+        amrex::Print() << "bound        : compute (below 70% of STREAM, IPC at least 1)\n";
+    } else if (stream_gbs > 0.0) {
+        amrex::Print() << "bound        : not bandwidth (below 70% of STREAM)\n";
+    }
+}
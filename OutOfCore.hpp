@@ -0,0 +1,430 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "iso3dfd.hpp"
+#include "Utils.hpp"
+#include "VelocityFile.hpp"
+
+// Out-of-core stepping (ooc = 1).
+//
+// prev, next and vel live in files in ooc.dir, as nx*ny planes in z order, and
+// each pass of ooc.fused_steps steps T streams them through memory once.  The
+// pass reads plane p of prev, next and vel, then computes plane p - HL of step
+// 1, plane p - 2*HL of step 2, and so on, and writes plane p - T*HL of steps T
+// and T-1 back in place as the new prev and next.  A step reads 2*HL+1 planes
+// of the step before and one of the step before that, so each step keeps a
+// ring of 2*HL+1 zero-padded planes, and vel one of T*HL+1.  An I/O thread
+// reads ooc.prefetch slabs of ooc.slab_planes planes ahead and writes finished
+// slabs behind, so disk traffic is 20/T bytes per point and step and overlaps
+// the stencil.  The kernel computes what Iso3dfd does, bit for bit.
+struct OutOfCore
+{
+    int enabled = 0;
+    std::string dir = ".";
+    int fused_steps = 4;
+    int slab_planes = 8;
+    int prefetch = 2;
+    int check = 0;
+    int keep = 0;
+
+    OutOfCore ()
+    {
+        amrex::ParmParse pp;
+        pp.query("ooc", enabled);
+        amrex::ParmParse ppo("ooc");
+        ppo.query("dir", dir);
+        ppo.query("fused_steps", fused_steps);
+        ppo.query("slab_planes", slab_planes);
+        ppo.query("prefetch", prefetch);
+        ppo.query("check", check);
+        ppo.query("keep", keep);
+        AMREX_ALWAYS_ASSERT(fused_steps >= 1 && slab_planes >= 1 && prefetch >= 1);
+    }
+};
+
+namespace detail {
+
+// Whole-buffer reads and writes of files, done in submission order by one
+// thread.  wait(t) returns once request t and all before it are done.
+class SlabIO
+{
+public:
+    SlabIO ()
+        : m_thread([this] () { run(); })
+    {}
+
+    ~SlabIO ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+    }
+
+    SlabIO (SlabIO const&) = delete;
+    SlabIO& operator= (SlabIO const&) = delete;
+
+    std::size_t read (int fd, float* buf, std::size_t n, std::size_t offset)
+    {
+        return submit({fd, false, buf, n, offset});
+    }
+
+    std::size_t write (int fd, float const* buf, std::size_t n, std::size_t offset)
+    {
+        return submit({fd, true, const_cast<float*>(buf), n, offset});
+    }
+
+    void wait (std::size_t ticket)
+    {
+        if (m_done.load(std::memory_order_acquire) >= ticket) { return; }
+        auto const t0 = amrex::second();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] () { return m_done.load() >= ticket; });
+        m_wait += amrex::second() - t0;
+    }
+
+    double waitTime () const { return m_wait; }
+    double busyTime () const { return m_busy; }
+    double bytesRead () const { return m_read; }
+    double bytesWritten () const { return m_written; }
+
+private:
+    struct Request
+    {
+        int fd;
+        bool write;
+        float* buf;
+        std::size_t n;       // floats
+        std::size_t offset;  // in floats
+    };
+
+    std::size_t submit (Request const& r)
+    {
+        std::size_t ticket;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.push_back(r);
+            ticket = ++m_submitted;
+        }
+        m_cv.notify_all();
+        return ticket;
+    }
+
+    void run ()
+    {
+        for (;;) {
+            Request r;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [&] () { return !m_queue.empty() || m_stop; });
+                if (m_queue.empty()) { return; }
+                r = m_queue.front();
+                m_queue.pop_front();
+            }
+            auto const t0 = amrex::second();
+            char* p = reinterpret_cast<char*>(r.buf);
+            std::size_t left = r.n * sizeof(float);
+            off_t pos = off_t(r.offset * sizeof(float));
+            while (left > 0) {
+                ssize_t const got = r.write ? ::pwrite(r.fd, p, left, pos) : ::pread(r.fd, p, left, pos);
+                if (got <= 0) {
+                    amrex::Abort("out-of-core I/O failed");
+                }
+                p += got;
+                pos += got;
+                left -= std::size_t(got);
+            }
+            m_busy += amrex::second() - t0;
+            (r.write ? m_written : m_read) += double(r.n * sizeof(float));
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.store(m_done.load() + 1, std::memory_order_release);
+            }
+            m_cv.notify_all();
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Request> m_queue;
+    std::size_t m_submitted = 0;
+    std::atomic<std::size_t> m_done{0};
+    bool m_stop = false;
+    double m_wait = 0.0;
+    double m_busy = 0.0;    // I/O thread only, read after it joined or idle
+    double m_read = 0.0;
+    double m_written = 0.0;
+    std::thread m_thread;
+};
+
+// One plane of a step: out = 2*cur - old + vel*L(cur), where up[r] and dn[r]
+// are the planes r above and below cur.  The planes are padded by HL in x and
+// y, and the sums are ordered as in Iso3dfdPoint.
+template <int HL>
+void PlaneStep (float* AMREX_RESTRICT out, float const* cur, float const* const* up, float const* const* dn,
+                float const* old, float const* vel, float const* coeff,
+                int nx, int ny, amrex::Long jstride)
+{
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for
+#endif
+    for (int j = 0; j < ny; ++j) {
+        amrex::Long const row = (j + HL) * jstride + HL;
+        AMREX_PRAGMA_SIMD
+        for (int i = 0; i < nx; ++i) {
+            amrex::Long const o = row + i;
+            float const p0 = cur[o];
+            float value = p0 * coeff[0];
+#pragma unroll(HL)
+            for (int ir = 1; ir <= HL; ++ir) {
+                value += coeff[ir] * (cur[o+ir] + cur[o-ir] +
+                                      cur[o+ir*jstride] + cur[o-ir*jstride] +
+                                      up[ir][o] + dn[ir][o]);
+            }
+            out[o] = 2.0f * p0 - old[o] + value*vel[o];
+        }
+    }
+}
+
+}
+
+template <int HL>
+void RunOutOfCore (OutOfCore const& params, amrex::Box const& domain, float const* coeff,
+                   int num_iterations)
+{
+    BL_PROFILE("RunOutOfCore()");
+    if (amrex::ParallelDescriptor::NProcs() > 1) {
+        amrex::Abort("ooc = 1 runs on a single rank");
+    }
+    int const nx = domain.length(0);
+    int const ny = domain.length(1);
+    int const nz = domain.length(2);
+    std::size_t const plane = std::size_t(nx) * ny;
+    amrex::Long const jstride = nx + 2*HL;
+    std::size_t const padded = std::size_t(jstride) * (ny + 2*HL);
+    int const S = std::min(params.slab_planes, nz);
+    int const nslabs = (nz + S - 1) / S;
+    int const T = std::min(params.fused_steps, num_iterations);
+
+    // Field files, in the order prev, next, vel.
+    char const* names[3] = {"prev", "next", "vel"};
+    int fd[3];
+    for (int f = 0; f < 3; ++f) {
+        std::string const name = params.dir + "/ooc_" + names[f] + ".bin";
+        fd[f] = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd[f] < 0 || ::ftruncate(fd[f], off_t(plane * nz * sizeof(float))) != 0) {
+            amrex::Abort("could not create " + name);
+        }
+    }
+    detail::SlabIO io;
+
+    // Write the initial fields, with the source of Initialize and the constant
+    // velocity or the model of vel.file.
+    {
+        VelocityFile vfile(domain);
+        std::unique_ptr<detail::MappedFile> map;
+        detail::SampleLayout layout;
+        if (vfile.enabled()) {
+            map = std::make_unique<detail::MappedFile>(vfile.file);
+            layout = detail::MakeSampleLayout(vfile, *map);
+        }
+        std::vector<float> buf[2];
+        std::size_t tickets[2] = {0, 0};
+        auto const nxp = nx + 2*HL, nyp = ny + 2*HL, nzp = nz + 2*HL;
+        for (int n = 0; n < nslabs; ++n) {
+            int const k0 = n * S;
+            int const np = std::min(S, nz - k0);
+            auto& b = buf[n % 2];
+            io.wait(tickets[n % 2]);
+            b.assign(3 * S * plane, 0.0f);
+            float* vel = b.data() + 2 * S * plane;
+            amrex::Box const slab(amrex::IntVect(domain.smallEnd(0), domain.smallEnd(1), domain.smallEnd(2) + k0),
+                                  amrex::IntVect(domain.bigEnd(0), domain.bigEnd(1), domain.smallEnd(2) + k0 + np - 1));
+            if (map) {
+                detail::ConvertSlab(*map, layout, slab, slab, domain.smallEnd() - amrex::IntVect(vfile.pad),
+                                    vfile.units == "velocity", vel);
+            } else {
+                std::fill(vel, vel + np * plane, 2250000.0f * dt * dt);
+            }
+            float val = 1.f;
+            for (int s = 5; s >= 0; s--) {
+                for (int k = std::max(nzp/2 - s - HL, k0); k < std::min(nzp/2 + s - HL, k0 + np); ++k) {
+                for (int j = nyp/4 - s - HL; j < nyp/4 + s - HL; ++j) {
+                for (int i = nxp/4 - s - HL; i < nxp/4 + s - HL; ++i) {
+                    if (i >= 0 && i < nx && j >= 0 && j < ny) {
+                        b[(k - k0) * plane + std::size_t(j) * nx + i] = val;
+                    }
+                }}}
+                val *= 10.f;
+            }
+            for (int f = 0; f < 3; ++f) {
+                tickets[n % 2] = io.write(fd[f], b.data() + f * S * plane, np * plane, k0 * plane);
+            }
+        }
+        io.wait(std::max(tickets[0], tickets[1]));
+    }
+
+    // Buffers: prefetched slabs of the three fields, slabs of the new prev and
+    // next being written, and the planes of steps -1 (next) to T and of vel.
+    int const W = 2*HL + 1;
+    int const VW = T*HL + 1;
+    int const nin = params.prefetch + 1;
+    std::vector<std::vector<float>> in(nin, std::vector<float>(3 * S * plane));
+    std::vector<std::size_t> in_ticket(nin, 0);
+    std::vector<float> out[2] = {std::vector<float>(2 * S * plane), std::vector<float>(2 * S * plane)};
+    std::size_t out_ticket[2] = {0, 0};
+    std::vector<std::vector<float>> ring((T + 2) * W, std::vector<float>(padded, 0.0f));
+    std::vector<std::vector<float>> vring(VW, std::vector<float>(padded, 0.0f));
+    auto level = [&] (int l, int k) -> float* {  // l = -1 .. T
+        return ring[(l + 1) * W + ((k % W) + W) % W].data();
+    };
+    auto velp = [&] (int k) -> float* { return vring[k % VW].data(); };
+    auto to_padded = [&] (float* dst, float const* src) {
+        for (int j = 0; j < ny; ++j) {
+            std::memcpy(dst + (j + HL) * jstride + HL, src + std::size_t(j) * nx, nx * sizeof(float));
+        }
+    };
+    auto from_padded = [&] (float* dst, float const* src) {
+        for (int j = 0; j < ny; ++j) {
+            std::memcpy(dst + std::size_t(j) * nx, src + (j + HL) * jstride + HL, nx * sizeof(float));
+        }
+    };
+    auto read_slab = [&] (int n) {
+        int const k0 = n * S;
+        int const np = std::min(S, nz - k0);
+        for (int f = 0; f < 3; ++f) {
+            in_ticket[n % nin] = io.read(fd[f], in[n % nin].data() + f * S * plane, np * plane, k0 * plane);
+        }
+    };
+
+    double const window_mb = double((T + 2) * W + VW) * padded * sizeof(float) / (1024 * 1024)
+        + double(nin * 3 + 2 * 2) * S * plane * sizeof(float) / (1024 * 1024);
+    amrex::Print() << "Out-of-core: " << 3.0 * plane * nz * sizeof(float) / (1024 * 1024) << " MB of fields in "
+                   << params.dir << ", window " << window_mb << " MB (fused_steps " << T << ", slab_planes "
+                   << S << ", prefetch " << params.prefetch << ")\n";
+
+    double compute = 0.0;
+    double const io_wait0 = io.waitTime();
+    double const io_busy0 = io.busyTime();
+    double const read0 = io.bytesRead();
+    double const written0 = io.bytesWritten();
+    auto const t0 = amrex::second();
+    for (int done = 0; done < num_iterations; ) {
+        int const t = std::min(T, num_iterations - done);
+        for (int n = 0; n < std::min(params.prefetch, nslabs); ++n) { read_slab(n); }
+
+        for (int p = -HL; p < nz + t*HL; ++p) {
+            // Plane p of steps -1 and 0 and of vel, zero outside the domain.
+            if (p >= 0 && p < nz) {
+                int const n = p / S;
+                auto const& b = in[n % nin];
+                if (p % S == 0) {
+                    io.wait(in_ticket[n % nin]);
+                    if (n + params.prefetch < nslabs) { read_slab(n + params.prefetch); }
+                }
+                std::size_t const at = std::size_t(p % S) * plane;
+                to_padded(level(0, p), b.data() + at);
+                to_padded(level(-1, p), b.data() + S * plane + at);
+                to_padded(velp(p), b.data() + 2 * S * plane + at);
+            } else if (p < nz + HL) {
+                std::fill_n(level(0, p), padded, 0.0f);
+                std::fill_n(level(-1, p), padded, 0.0f);
+            }
+
+            // Plane p - l*HL of step l.
+            auto const tc = amrex::second();
+            for (int l = 1; l <= t; ++l) {
+                int const k = p - l*HL;
+                if (k >= 0 && k < nz) {
+                    float const* up[HL+1];
+                    float const* dn[HL+1];
+                    for (int r = 1; r <= HL; ++r) {
+                        up[r] = level(l-1, k+r);
+                        dn[r] = level(l-1, k-r);
+                    }
+                    detail::PlaneStep<HL>(level(l, k), level(l-1, k), up, dn, level(l-2, k), velp(k),
+                                          coeff, nx, ny, jstride);
+                } else if (k >= -HL && k < nz + HL) {
+                    std::fill_n(level(l, k), padded, 0.0f);
+                }
+            }
+            compute += amrex::second() - tc;
+
+            // Plane p - t*HL of steps t and t-1 is final: the new prev and next.
+            int const k = p - t*HL;
+            if (k >= 0 && k < nz) {
+                int const m = k / S;
+                auto& b = out[m % 2];
+                if (k % S == 0) { io.wait(out_ticket[m % 2]); }
+                std::size_t const at = std::size_t(k % S) * plane;
+                from_padded(b.data() + at, level(t, k));
+                from_padded(b.data() + S * plane + at, level(t-1, k));
+                if (k % S == S - 1 || k == nz - 1) {
+                    int const np = k % S + 1;
+                    io.write(fd[0], b.data(), np * plane, std::size_t(m) * S * plane);
+                    out_ticket[m % 2] = io.write(fd[1], b.data() + S * plane, np * plane,
+                                                 std::size_t(m) * S * plane);
+                }
+            }
+        }
+        done += t;
+    }
+    io.wait(std::max(out_ticket[0], out_ticket[1]));
+    auto const t1 = amrex::second();
+
+    double const npts = domain.d_numPts() * num_iterations;
+    double const read = io.bytesRead() - read0;
+    double const written = io.bytesWritten() - written0;
+    double const disk = read + written;
+    printStats(t1-t0, domain, num_iterations, HL, disk / npts);
+    amrex::Print() << "disk         : " << read / 1.e9 << " GB read, " << written / 1.e9
+                   << " GB written, " << disk / npts << " bytes/pt per step (" << 20.0 / T
+                   << " for fused_steps " << T << ")\n";
+    amrex::Print() << "overlap      : stencil " << compute << " secs, waiting for I/O "
+                   << io.waitTime() - io_wait0 << " secs, I/O thread busy " << io.busyTime() - io_busy0
+                   << " secs\n";
+
+    if (params.check) {
+        // The host reference on the whole padded grid, for grids that fit.
+        std::size_t const n1 = nx + 2*HL, n2 = ny + 2*HL, n3 = nz + 2*HL;
+        std::vector<float> host[3];
+        for (int f = 0; f < 3; ++f) {
+            std::vector<float> field(plane * nz);
+            io.wait(io.read(fd[f], field.data(), field.size(), 0));
+            host[f].assign(n1 * n2 * n3, 0.0f);
+            for (int k = 0; k < nz; ++k) {
+                to_padded(host[f].data() + (k + HL) * padded, field.data() + k * plane);
+            }
+        }
+        std::vector<float> const model = host[2];
+        std::vector<float> coeff_host(coeff, coeff + HL + 1);
+        // VerifyResult compares the buffer that was prev when the step count was even.
+        bool const even = (num_iterations % 2 == 0);
+        VerifyResult<HL>(host[even ? 0 : 1].data(), host[even ? 1 : 0].data(), host[2].data(),
+                         coeff_host.data(), n1, n2, n3, num_iterations, 1.0f, false, model.data());
+    }
+
+    for (int f = 0; f < 3; ++f) {
+        ::close(fd[f]);
+        if (!params.keep) {
+            ::unlink((params.dir + "/ooc_" + names[f] + ".bin").c_str());
+        }
+    }
+}
@@ -0,0 +1,645 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Asynchronous wavefield output (output = 1, opt = 0 and 1).
+//
+// Every output.snapshot_interval steps the newest wavefield is copied into one
+// of two pinned host buffers, and every step the receiver line along x at
+// (output.receiver_y, output.receiver_z) is copied into one of two trace
+// buffers.  A writer thread compresses and appends the staged data, so a step
+// only pays for its copies, and waits only if both buffers of a kind are still
+// being written.  Values are rounded to multiples of 2*output.error_bound, or
+// kept bit for bit if it is 0, and coded as varint differences along x.
+//
+// Each rank writes <output.prefix>_snapshots.bin and _traces.bin, with the
+// rank appended for several ranks.  A chunk holds output.chunk_planes z-planes
+// of one box at one step, or output.trace_flush steps of the line in one box,
+// and the index at the end of the file locates every chunk.
+struct OutputParams
+{
+    int enabled = 0;
+    int snapshot_interval = 50;
+    int traces = 1;
+    int receiver_y = 0;
+    int receiver_z = 0;
+    double error_bound = 0.0;
+    int chunk_planes = 8;
+    int trace_flush = 64;
+    std::string prefix = "iso3dfd";
+    int check = 1;
+
+    OutputParams (amrex::Box const& domain, int half_length)
+    {
+        amrex::ParmParse pp;
+        pp.query("output", enabled);
+        amrex::ParmParse ppo("output");
+        ppo.query("snapshot_interval", snapshot_interval);
+        ppo.query("traces", traces);
+        // By default the line runs through the source of Initialize.
+        receiver_y = (domain.length(1) + 2*half_length) / 2 - half_length;
+        receiver_z = (domain.length(2) + 2*half_length) / 2 - half_length;
+        ppo.query("receiver_y", receiver_y);
+        ppo.query("receiver_z", receiver_z);
+        ppo.query("error_bound", error_bound);
+        ppo.query("chunk_planes", chunk_planes);
+        ppo.query("trace_flush", trace_flush);
+        ppo.query("prefix", prefix);
+        ppo.query("check", check);
+        if (enabled) {
+            AMREX_ALWAYS_ASSERT(snapshot_interval >= 0 && error_bound >= 0.0);
+            AMREX_ALWAYS_ASSERT(chunk_planes >= 1 && trace_flush >= 1);
+            if (receiver_y < domain.smallEnd(1) || receiver_y > domain.bigEnd(1) ||
+                receiver_z < domain.smallEnd(2) || receiver_z > domain.bigEnd(2)) {
+                amrex::Abort("output.receiver_y and output.receiver_z must lie in the domain");
+            }
+        }
+    }
+
+    std::string fileName (char const* kind) const
+    {
+        std::string name = prefix + "_" + kind + ".bin";
+        if (amrex::ParallelDescriptor::NProcs() > 1) {
+            name += "." + std::to_string(amrex::ParallelDescriptor::MyProc());
+        }
+        return name;
+    }
+};
+
+// File layout, native byte order:
+//
+//   header   "ISO3DFD\0", int32 kind (0 snapshots, 1 traces), int32 0,
+//            float64 error bound, int32 domain lo[3], hi[3]
+//   chunks   ChunkEntry, then the rows of box along x, z-major, for nsteps steps
+//   index    one ChunkEntry per chunk
+//   trailer  int64 chunk count, int64 index offset, "ISO3DIDX"
+struct ChunkEntry
+{
+    std::int32_t step;
+    std::int32_t nsteps;
+    std::int32_t lo[3];
+    std::int32_t hi[3];
+    std::int64_t offset;  // of the coded rows
+    std::int64_t nbytes;
+
+    amrex::Box box () const
+    {
+        return amrex::Box(amrex::IntVect(lo[0], lo[1], lo[2]), amrex::IntVect(hi[0], hi[1], hi[2]));
+    }
+};
+static_assert(sizeof(ChunkEntry) == 48, "ChunkEntry is written as is");
+
+namespace detail {
+
+inline void PutVarint (std::vector<unsigned char>& out, std::uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<unsigned char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(v));
+}
+
+inline std::uint64_t GetVarint (unsigned char const*& p)
+{
+    std::uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char const b = *p++;
+        v |= std::uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) { return v; }
+    }
+}
+
+// Code a row of n values.  With an error bound each value becomes the nearest
+// multiple q of 2*error_bound; without one, its bit pattern mapped to an
+// integer in the order of the values.  The zigzagged difference of consecutive
+// integers is stored, so zeros and smooth stretches take few bytes.
+inline void EncodeRow (float const* v, int n, double error_bound, std::vector<unsigned char>& out)
+{
+    if (error_bound > 0.0) {
+        double const scale = 0.5 / error_bound;
+        std::int64_t last = 0;
+        for (int i = 0; i < n; ++i) {
+            std::int64_t const q = std::llround(v[i] * scale);
+            std::uint64_t const d = std::uint64_t(q) - std::uint64_t(last);
+            PutVarint(out, (d << 1) ^ (0 - (d >> 63)));
+            last = q;
+        }
+    } else {
+        std::uint32_t last = 0;
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t bits;
+            std::memcpy(&bits, v + i, sizeof(bits));
+            // Order the bit patterns as the values, so close values differ little.
+            bits ^= (0 - (bits >> 31)) >> 1;
+            std::uint32_t const d = bits - last;
+            PutVarint(out, (d << 1) ^ (0 - (d >> 31)));
+            last = bits;
+        }
+    }
+}
+
+inline unsigned char const* DecodeRow (unsigned char const* p, int n, double error_bound, float* v)
+{
+    if (error_bound > 0.0) {
+        double const step = 2.0 * error_bound;
+        std::uint64_t last = 0;
+        for (int i = 0; i < n; ++i) {
+            std::uint64_t const z = GetVarint(p);
+            last += (z >> 1) ^ (0 - (z & 1));
+            v[i] = float(double(std::int64_t(last)) * step);
+        }
+    } else {
+        std::uint32_t last = 0;
+        for (int i = 0; i < n; ++i) {
+            std::uint32_t const z = std::uint32_t(GetVarint(p));
+            last += (z >> 1) ^ (0 - (z & 1));
+            std::uint32_t const bits = last ^ ((0 - (last >> 31)) >> 1);
+            std::memcpy(v + i, &bits, sizeof(bits));
+        }
+    }
+    return p;
+}
+
+inline char const* const kChunkMagic = "ISO3DFD";
+inline char const* const kIndexMagic = "ISO3DIDX";
+
+}
+
+// Appends chunks to an output file and writes its index on close.
+class ChunkFileWriter
+{
+public:
+    void open (std::string const& name, int kind, double error_bound, amrex::Box const& domain)
+    {
+        m_os.open(name, std::ios::binary | std::ios::trunc);
+        if (!m_os) {
+            amrex::Abort("could not open " + name);
+        }
+        m_os.write(detail::kChunkMagic, 8);
+        std::int32_t const head[2] = {kind, 0};
+        m_os.write(reinterpret_cast<char const*>(head), sizeof(head));
+        m_os.write(reinterpret_cast<char const*>(&error_bound), sizeof(error_bound));
+        std::int32_t const box[6] = {domain.smallEnd(0), domain.smallEnd(1), domain.smallEnd(2),
+                                     domain.bigEnd(0), domain.bigEnd(1), domain.bigEnd(2)};
+        m_os.write(reinterpret_cast<char const*>(box), sizeof(box));
+        m_index.clear();
+    }
+
+    void append (amrex::Box const& box, int step, int nsteps, std::vector<unsigned char> const& rows)
+    {
+        ChunkEntry e{step, nsteps, {box.smallEnd(0), box.smallEnd(1), box.smallEnd(2)},
+                     {box.bigEnd(0), box.bigEnd(1), box.bigEnd(2)}, 0, std::int64_t(rows.size())};
+        e.offset = std::int64_t(m_os.tellp()) + std::int64_t(sizeof(ChunkEntry));
+        m_os.write(reinterpret_cast<char const*>(&e), sizeof(e));
+        m_os.write(reinterpret_cast<char const*>(rows.data()), std::streamsize(rows.size()));
+        m_index.push_back(e);
+    }
+
+    void close ()
+    {
+        std::int64_t const trailer[2] = {std::int64_t(m_index.size()), std::int64_t(m_os.tellp())};
+        m_os.write(reinterpret_cast<char const*>(m_index.data()),
+                   std::streamsize(m_index.size() * sizeof(ChunkEntry)));
+        m_os.write(reinterpret_cast<char const*>(trailer), sizeof(trailer));
+        m_os.write(detail::kIndexMagic, 8);
+        m_os.close();
+    }
+
+private:
+    std::ofstream m_os;
+    std::vector<ChunkEntry> m_index;
+};
+
+// Reads the index of an output file and any chunk in it.
+class ChunkFileReader
+{
+public:
+    explicit ChunkFileReader (std::string const& name)
+        : m_is(name, std::ios::binary)
+    {
+        char magic[8];
+        std::int32_t head[2];
+        m_is.read(magic, 8);
+        m_is.read(reinterpret_cast<char*>(head), sizeof(head));
+        m_is.read(reinterpret_cast<char*>(&m_error_bound), sizeof(m_error_bound));
+        if (!m_is || std::memcmp(magic, detail::kChunkMagic, 8) != 0) {
+            amrex::Abort(name + " is not an iso3dfd output file");
+        }
+        m_kind = head[0];
+
+        std::int64_t trailer[2];
+        m_is.seekg(-std::streamoff(sizeof(trailer) + 8), std::ios::end);
+        m_is.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+        m_is.read(magic, 8);
+        if (!m_is || std::memcmp(magic, detail::kIndexMagic, 8) != 0) {
+            amrex::Abort(name + " has no index; the run did not finish writing it");
+        }
+        m_index.resize(trailer[0]);
+        m_is.seekg(trailer[1]);
+        m_is.read(reinterpret_cast<char*>(m_index.data()),
+                  std::streamsize(m_index.size() * sizeof(ChunkEntry)));
+    }
+
+    int kind () const { return m_kind; }
+    double errorBound () const { return m_error_bound; }
+    std::vector<ChunkEntry> const& index () const { return m_index; }
+
+    // The values of a chunk, x fastest, then y, z and step.
+    void read (ChunkEntry const& e, std::vector<float>& values)
+    {
+        std::vector<unsigned char> rows(e.nbytes);
+        m_is.seekg(e.offset);
+        m_is.read(reinterpret_cast<char*>(rows.data()), std::streamsize(rows.size()));
+        amrex::Box const& bx = e.box();
+        int const nx = bx.length(0);
+        amrex::Long const nrows = amrex::Long(e.nsteps) * bx.length(1) * bx.length(2);
+        values.resize(nrows * nx);
+        unsigned char const* p = rows.data();
+        for (amrex::Long r = 0; r < nrows; ++r) {
+            p = detail::DecodeRow(p, nx, m_error_bound, values.data() + r * nx);
+        }
+    }
+
+private:
+    std::ifstream m_is;
+    int m_kind = 0;
+    double m_error_bound = 0.0;
+    std::vector<ChunkEntry> m_index;
+};
+
+class OutputWriter
+{
+public:
+    // mf gives the boxes and ghost cells of the wavefields passed to step.
+    OutputWriter (OutputParams const& params, amrex::MultiFab const& mf, amrex::Box const& domain)
+        : m_params(params)
+    {
+        if (!m_params.enabled) { return; }
+        amrex::Long snap_size = 0;
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+            amrex::Box const& vbx = mfi.validbox();
+            FabSlot slot{mfi.fabbox(), vbx, snap_size, -1};
+            snap_size += mf[mfi].size();
+            if (vbx.contains(amrex::IntVect(vbx.smallEnd(0), m_params.receiver_y, m_params.receiver_z))) {
+                slot.trace_offset = m_trace_row;
+                m_trace_row += vbx.length(0);
+            }
+            m_fabs.push_back(slot);
+        }
+        for (int b = 0; b < 2; ++b) {
+            if (m_params.snapshot_interval > 0) { m_snap[b].resize(snap_size); }
+            if (m_params.traces) { m_trace[b].resize(amrex::Long(m_trace_row) * m_params.trace_flush); }
+        }
+        m_snap_file.open(m_params.fileName("snapshots"), 0, m_params.error_bound, domain);
+        m_trace_file.open(m_params.fileName("traces"), 1, m_params.error_bound, domain);
+        m_thread = std::thread([this] () { run(); });
+    }
+
+    ~OutputWriter ()
+    {
+        stop();
+    }
+
+    OutputWriter (OutputWriter const&) = delete;
+    OutputWriter& operator= (OutputWriter const&) = delete;
+
+    bool enabled () const { return m_params.enabled; }
+
+    void begin ()
+    {
+        m_last = amrex::second();
+    }
+
+    // Stage the output of step, with mf its newest wavefield.  The previous
+    // step synchronized the stream, so the copies staged then are complete.
+    void step (amrex::MultiFab const& mf, int step)
+    {
+        BL_PROFILE("OutputWriter::step()");
+        auto const t0 = amrex::second();
+        m_step_time[m_writing_at_last] += t0 - m_last;
+        m_step_count[m_writing_at_last] += 1;
+        handOff();
+
+        if (m_params.snapshot_interval > 0 && step % m_params.snapshot_interval == 0) {
+            int const b = acquire(m_snap_state);
+            int li = 0;
+            for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi, ++li) {
+                auto const& fab = mf[mfi];
+                amrex::Gpu::copyAsync(amrex::Gpu::deviceToHost, fab.dataPtr(), fab.dataPtr() + fab.size(),
+                                      m_snap[b].data() + m_fabs[li].offset);
+            }
+            m_snap_state[b] = Staged;
+            m_snap_step[b] = step;
+            m_last_snapshot = step;
+            ++m_snapshots;
+        }
+
+        if (m_params.traces) {
+            if (m_trace_count == 0) {
+                m_trace_buf = acquire(m_trace_state);
+                m_trace_step[m_trace_buf] = step;
+            }
+            float* dst = m_trace[m_trace_buf].data() + amrex::Long(m_trace_count) * m_trace_row;
+            int li = 0;
+            for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi, ++li) {
+                if (m_fabs[li].trace_offset < 0) { continue; }
+                amrex::Box const& vbx = mfi.validbox();
+                float const* row = mf.const_array(mfi).ptr(vbx.smallEnd(0), m_params.receiver_y, m_params.receiver_z);
+                amrex::Gpu::copyAsync(amrex::Gpu::deviceToHost, row, row + vbx.length(0),
+                                      dst + m_fabs[li].trace_offset);
+            }
+            if (++m_trace_count == m_params.trace_flush) {
+                stageTraces();
+            }
+            ++m_trace_steps;
+        }
+
+        m_last = amrex::second();
+        m_staging += m_last - t0;
+        m_writing_at_last = m_writing.load() ? 1 : 0;
+    }
+
+    // Write out everything staged, close the files, report, and check the
+    // snapshot of last_step, if there is one, against newest.
+    void finish (amrex::MultiFab const& newest, int last_step)
+    {
+        BL_PROFILE("OutputWriter::finish()");
+        auto const t0 = amrex::second();
+        amrex::Gpu::streamSynchronize();
+        if (m_trace_count > 0) {
+            stageTraces();
+        }
+        handOff();
+        stop();
+        m_snap_file.close();
+        m_trace_file.close();
+        double drain = amrex::second() - t0;
+        report(drain);
+
+        if (m_params.check && m_last_snapshot == last_step) {
+            double const err = checkSnapshot(newest, last_step);
+            amrex::Print() << "output: snapshot of step " << last_step << " read back with max error "
+                           << err << " (bound " << m_params.error_bound << ")\n";
+        }
+    }
+
+private:
+    enum : int { Free = 0, Staged, Queued };
+
+    struct FabSlot
+    {
+        amrex::Box fabbox;
+        amrex::Box validbox;
+        amrex::Long offset;  // in a snapshot buffer
+        int trace_offset;    // in a trace row, -1 if the line misses the box
+    };
+
+    struct Job
+    {
+        bool snapshot;
+        int buffer;
+        int step;
+        int nsteps;
+    };
+
+    // A free buffer of a kind, waiting for the writer if there is none.
+    int acquire (int (&state)[2])
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (state[0] != Free && state[1] != Free) {
+            auto const t0 = amrex::second();
+            m_cv.wait(lock, [&] () { return state[0] == Free || state[1] == Free; });
+            m_stall_time += amrex::second() - t0;
+            ++m_stalls;
+        }
+        return (state[0] == Free) ? 0 : 1;
+    }
+
+    void stageTraces ()
+    {
+        m_trace_state[m_trace_buf] = Staged;
+        m_trace_nsteps[m_trace_buf] = m_trace_count;
+        m_trace_count = 0;
+    }
+
+    // Queue the buffers whose copies are complete.
+    void handOff ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (int b = 0; b < 2; ++b) {
+                if (m_snap_state[b] == Staged) {
+                    m_snap_state[b] = Queued;
+                    m_jobs.push_back({true, b, m_snap_step[b], 1});
+                }
+                if (m_trace_state[b] == Staged) {
+                    m_trace_state[b] = Queued;
+                    m_jobs.push_back({false, b, m_trace_step[b], m_trace_nsteps[b]});
+                }
+            }
+        }
+        m_cv.notify_all();
+    }
+
+    void stop ()
+    {
+        if (!m_thread.joinable()) { return; }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+    }
+
+    // The writer thread.
+    void run ()
+    {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [&] () { return !m_jobs.empty() || m_stop; });
+                if (m_jobs.empty()) { return; }
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+            m_writing.store(true);
+            auto const t0 = amrex::second();
+            if (job.snapshot) {
+                writeSnapshot(job);
+            } else {
+                writeTraces(job);
+            }
+            m_busy += amrex::second() - t0;
+            m_writing.store(false);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                (job.snapshot ? m_snap_state : m_trace_state)[job.buffer] = Free;
+            }
+            m_cv.notify_all();
+        }
+    }
+
+    void writeSnapshot (Job const& job)
+    {
+        for (auto const& f : m_fabs) {
+            float const* base = m_snap[job.buffer].data() + f.offset;
+            amrex::Long const nx = f.fabbox.length(0);
+            amrex::Long const nxy = nx * f.fabbox.length(1);
+            amrex::IntVect const& flo = f.fabbox.smallEnd();
+            amrex::Box const& vbx = f.validbox;
+            for (int z0 = vbx.smallEnd(2); z0 <= vbx.bigEnd(2); z0 += m_params.chunk_planes) {
+                amrex::Box chunk = vbx;
+                chunk.setSmall(2, z0);
+                chunk.setBig(2, std::min(z0 + m_params.chunk_planes - 1, vbx.bigEnd(2)));
+                m_rows.clear();
+                for (int k = chunk.smallEnd(2); k <= chunk.bigEnd(2); ++k) {
+                    for (int j = chunk.smallEnd(1); j <= chunk.bigEnd(1); ++j) {
+                        float const* row = base + (vbx.smallEnd(0) - flo[0]) + (j - flo[1]) * nx + (k - flo[2]) * nxy;
+                        detail::EncodeRow(row, vbx.length(0), m_params.error_bound, m_rows);
+                    }
+                }
+                m_snap_file.append(chunk, job.step, 1, m_rows);
+                m_raw_bytes += chunk.d_numPts() * sizeof(float);
+                m_coded_bytes += double(m_rows.size());
+            }
+        }
+    }
+
+    void writeTraces (Job const& job)
+    {
+        for (auto const& f : m_fabs) {
+            if (f.trace_offset < 0) { continue; }
+            amrex::Box line = f.validbox;
+            line.setSmall(1, m_params.receiver_y);
+            line.setBig(1, m_params.receiver_y);
+            line.setSmall(2, m_params.receiver_z);
+            line.setBig(2, m_params.receiver_z);
+            m_rows.clear();
+            for (int s = 0; s < job.nsteps; ++s) {
+                float const* row = m_trace[job.buffer].data() + amrex::Long(s) * m_trace_row + f.trace_offset;
+                detail::EncodeRow(row, line.length(0), m_params.error_bound, m_rows);
+            }
+            m_trace_file.append(line, job.step, job.nsteps, m_rows);
+            m_raw_bytes += double(job.nsteps) * line.length(0) * sizeof(float);
+            m_coded_bytes += double(m_rows.size());
+        }
+    }
+
+    void report (double drain)
+    {
+        double bytes[2] = {m_raw_bytes, m_coded_bytes};
+        double times[4] = {m_busy, drain, m_stall_time, m_staging};
+        amrex::Long stalls = m_stalls;
+        amrex::ParallelDescriptor::ReduceRealSum(bytes, 2);
+        amrex::ParallelDescriptor::ReduceRealMax(times, 4);
+        amrex::ParallelDescriptor::ReduceLongSum(stalls);
+        auto const mean = [&] (int w) {
+            return m_step_count[w] > 0 ? 1.e3 * m_step_time[w] / m_step_count[w] : 0.0;
+        };
+        amrex::Print() << "output: " << m_snapshots << " snapshots, " << m_trace_steps << " trace steps, "
+                       << bytes[0] / (1024 * 1024) << " MB coded to " << bytes[1] / (1024 * 1024)
+                       << " MB (" << (bytes[1] > 0.0 ? bytes[0] / bytes[1] : 0.0) << "x, error bound "
+                       << m_params.error_bound << ")\n";
+        amrex::Print() << "output: step " << mean(0) << " ms with the writer idle (" << m_step_count[0]
+                       << " steps), " << mean(1) << " ms while it writes (" << m_step_count[1] << " steps)\n";
+        amrex::Print() << "output: staging " << times[3] << " s, " << stalls << " waits for a buffer ("
+                       << times[2] << " s), writer busy " << times[0] << " s, drain after stepping "
+                       << times[1] << " s\n";
+    }
+
+    // Max error of the snapshot of step read back from the file against mf.
+    double checkSnapshot (amrex::MultiFab const& mf, int step)
+    {
+        int li = 0;
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi, ++li) {
+            auto const& fab = mf[mfi];
+            amrex::Gpu::copyAsync(amrex::Gpu::deviceToHost, fab.dataPtr(), fab.dataPtr() + fab.size(),
+                                  m_snap[0].data() + m_fabs[li].offset);
+        }
+        amrex::Gpu::streamSynchronize();
+
+        double err = 0.0;
+        ChunkFileReader reader(m_params.fileName("snapshots"));
+        std::vector<float> values;
+        for (auto const& e : reader.index()) {
+            if (e.step != step) { continue; }
+            amrex::Box const& chunk = e.box();
+            auto const it = std::find_if(m_fabs.begin(), m_fabs.end(),
+                                         [&] (FabSlot const& f) { return f.validbox.contains(chunk); });
+            AMREX_ALWAYS_ASSERT(it != m_fabs.end());
+            reader.read(e, values);
+            float const* base = m_snap[0].data() + it->offset;
+            amrex::Long const nx = it->fabbox.length(0);
+            amrex::Long const nxy = nx * it->fabbox.length(1);
+            amrex::IntVect const& flo = it->fabbox.smallEnd();
+            amrex::Long n = 0;
+            for (int k = chunk.smallEnd(2); k <= chunk.bigEnd(2); ++k) {
+            for (int j = chunk.smallEnd(1); j <= chunk.bigEnd(1); ++j) {
+            for (int i = chunk.smallEnd(0); i <= chunk.bigEnd(0); ++i) {
+                float const v = base[(i - flo[0]) + (j - flo[1]) * nx + (k - flo[2]) * nxy];
+                err = std::max(err, double(std::abs(values[n++] - v)));
+            }}}
+        }
+        amrex::ParallelDescriptor::ReduceRealMax(err);
+        return err;
+    }
+
+    OutputParams m_params;
+    std::vector<FabSlot> m_fabs;
+    int m_trace_row = 0;
+    amrex::Gpu::PinnedVector<float> m_snap[2];
+    amrex::Gpu::PinnedVector<float> m_trace[2];
+
+    // Buffer states and jobs, shared with the writer thread under m_mutex.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Job> m_jobs;
+    bool m_stop = false;
+    int m_snap_state[2] = {Free, Free};
+    int m_trace_state[2] = {Free, Free};
+    std::atomic<bool> m_writing{false};
+    std::thread m_thread;
+
+    // Main thread only.
+    int m_snap_step[2] = {0, 0};
+    int m_trace_step[2] = {0, 0};
+    int m_trace_nsteps[2] = {0, 0};
+    int m_trace_buf = 0;
+    int m_trace_count = 0;
+    int m_last_snapshot = -1;
+    int m_snapshots = 0;
+    int m_trace_steps = 0;
+    double m_last = 0.0;
+    int m_writing_at_last = 0;
+    double m_step_time[2] = {0.0, 0.0};
+    amrex::Long m_step_count[2] = {0, 0};
+    double m_staging = 0.0;
+    double m_stall_time = 0.0;
+    amrex::Long m_stalls = 0;
+
+    // Writer thread only, read after it has joined.
+    ChunkFileWriter m_snap_file;
+    ChunkFileWriter m_trace_file;
+    std::vector<unsigned char> m_rows;
+    double m_raw_bytes = 0.0;
+    double m_coded_bytes = 0.0;
+    double m_busy = 0.0;
+};
@@ -0,0 +1,247 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+#include "Propagators.hpp"
+
+// Persistent stepping (opt = 3): run the whole time loop in one thread team.
+//
+// The opt = 0 loop forks and joins an OpenMP team, exchanges halos and
+// synchronizes the stream every step, which dominates for small grids.  Here
+// every box is cut into z-slabs, each owned by one thread for the whole run,
+// and each thread flips the buffers itself.  A slab's ghost cells that lie in
+// other boxes are copied from their owning slabs instead of FillBoundary, and
+// a slab waits only on the slabs it reads from or that read from it, through
+// two step counters per slab:
+//
+//   pulled  its ghost cells of the current prev have been copied, and
+//   done    its valid cells of the current next have been written.
+//
+// Step it of slab s copies its ghosts once the source slabs have done step
+// it-1, then updates its cells once its neighbours in the box have done step
+// it-1 and copied their ghosts for step it, and the slabs that copy from it
+// have copied for step it-1 (their source is the buffer s now overwrites).
+// The kernel is StencilStep, so the result matches opt = 0 bit for bit.
+struct PersistentStepping
+{
+    int slabs_per_thread = 1;
+
+    PersistentStepping ()
+    {
+        amrex::ParmParse pp("persist");
+        pp.query("slabs_per_thread", slabs_per_thread);
+        AMREX_ALWAYS_ASSERT(slabs_per_thread >= 1);
+    }
+};
+
+namespace detail {
+
+// Step counters of a slab, one per cache line.
+struct alignas(64) SlabCounters
+{
+    std::atomic<int> pulled{0};
+    std::atomic<int> done{0};
+};
+
+inline void WaitFor (std::atomic<int> const& counter, int value)
+{
+    for (int spin = 0; counter.load(std::memory_order_acquire) < value; ++spin) {
+        if (spin >= 256) {
+            std::this_thread::yield();
+            spin = 0;
+        }
+    }
+}
+
+// A copy of ghost cells of box dst from the valid cells of slab src.
+struct GhostPull
+{
+    amrex::Box region;
+    int dst_box;
+    int src_box;
+    int src_slab;
+};
+
+struct Slab
+{
+    int box;
+    amrex::Box region;
+    std::vector<GhostPull> pulls;
+    std::vector<int> sources;    // slabs copied from
+    std::vector<int> consumers;  // slabs that copy from this one
+    std::vector<int> neighbors;  // slabs of the same box within HL
+    std::vector<int> ghost_deps; // slabs of the same box whose copies are read
+};
+
+// Cut the boxes of ba into about nslabs z-slabs and work out their copies and
+// dependencies.
+inline std::vector<Slab> MakeSlabs (amrex::BoxArray const& ba, amrex::Box const& domain,
+                                    int nslabs, int half_length)
+{
+    std::vector<Slab> slabs;
+    std::vector<int> first(ba.size() + 1, 0);
+    double const npts = domain.d_numPts();
+    for (int b = 0; b < ba.size(); ++b) {
+        amrex::Box const& vbx = ba[b];
+        int const nz = vbx.length(2);
+        int n = int(std::ceil(nslabs * vbx.d_numPts() / npts));
+        n = std::max(1, std::min(n, nz));
+        first[b] = int(slabs.size());
+        for (int m = 0; m < n; ++m) {
+            amrex::Box r = vbx;
+            r.setSmall(2, vbx.smallEnd(2) + (m*nz)/n);
+            r.setBig(2, vbx.smallEnd(2) + ((m+1)*nz)/n - 1);
+            slabs.push_back({b, r, {}, {}, {}, {}, {}});
+        }
+    }
+    first[ba.size()] = int(slabs.size());
+
+    // Each slab copies the ghost cells of its box in its own z-range, and the
+    // first and last slabs also those below and above the box.
+    for (int s = 0; s < int(slabs.size()); ++s) {
+        Slab& slab = slabs[s];
+        amrex::Box const& vbx = ba[slab.box];
+        amrex::Box ghost = amrex::grow(vbx, half_length) & domain;
+        if (slab.region.smallEnd(2) > vbx.smallEnd(2)) { ghost.setSmall(2, slab.region.smallEnd(2)); }
+        if (slab.region.bigEnd(2) < vbx.bigEnd(2)) { ghost.setBig(2, slab.region.bigEnd(2)); }
+        for (int b = 0; b < ba.size(); ++b) {
+            if (b == slab.box || !(ghost & ba[b]).ok()) { continue; }
+            for (int t = first[b]; t < first[b+1]; ++t) {
+                amrex::Box const& piece = ghost & slabs[t].region;
+                if (piece.ok()) {
+                    slab.pulls.push_back({piece, slab.box, b, t});
+                    slab.sources.push_back(t);
+                    slabs[t].consumers.push_back(s);
+                }
+            }
+        }
+    }
+
+    for (int s = 0; s < int(slabs.size()); ++s) {
+        Slab& slab = slabs[s];
+        amrex::Box const& reads = amrex::grow(slab.region, half_length);
+        for (int t = first[slab.box]; t < first[slab.box+1]; ++t) {
+            if (t != s && (reads & slabs[t].region).ok()) { slab.neighbors.push_back(t); }
+            for (auto const& p : slabs[t].pulls) {
+                if ((reads & p.region).ok()) {
+                    slab.ghost_deps.push_back(t);
+                    break;
+                }
+            }
+        }
+        for (auto* v : {&slab.sources, &slab.consumers}) {
+            std::sort(v->begin(), v->end());
+            v->erase(std::unique(v->begin(), v->end()), v->end());
+        }
+    }
+    return slabs;
+}
+
+}
+
+template <int HL>
+void Iso3dfd_persistent (amrex::MultiFab& nextmf, amrex::MultiFab& prevmf, amrex::MultiFab const& velmf,
+                         amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+                         PersistentStepping const& ps, StepTimers& timers)
+{
+    BL_PROFILE("Iso3dfd_persistent()");
+#ifdef AMREX_USE_GPU
+    amrex::Abort("opt = 3 (persistent stepping) is only available for CPU builds");
+#endif
+    if (amrex::ParallelDescriptor::NProcs() > 1) {
+        amrex::Abort("opt = 3 (persistent stepping) needs a single MPI rank");
+    }
+    AMREX_ALWAYS_ASSERT(prevmf.nGrowVect().min() >= HL);
+
+    int nthreads = 1;
+#ifdef AMREX_USE_OMP
+    nthreads = omp_get_max_threads();
+#endif
+    amrex::BoxArray const& ba = prevmf.boxArray();
+    amrex::Box const& domain = ba.minimalBox();
+    auto const slabs = detail::MakeSlabs(ba, domain, nthreads * ps.slabs_per_thread, HL);
+    std::vector<detail::SlabCounters> counters(slabs.size());
+
+    // The two buffers of each box, indexed by box.
+    std::vector<amrex::Array4<float>> abuf(ba.size()), bbuf(ba.size());
+    std::vector<amrex::Array4<float const>> vel(ba.size());
+    for (amrex::MFIter mfi(prevmf); mfi.isValid(); ++mfi) {
+        abuf[mfi.index()] = nextmf.array(mfi);
+        bbuf[mfi.index()] = prevmf.array(mfi);
+        vel[mfi.index()] = velmf.const_array(mfi);
+    }
+    amrex::IntVect const tile = amrex::FabArrayBase::mfiter_tile_size;
+    auto const* coeff = coeffdv.data();
+    int const nslabs = int(slabs.size());
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel
+#endif
+    {
+        int tid = 0;
+        int nteam = 1;
+#ifdef AMREX_USE_OMP
+        tid = omp_get_thread_num();
+        nteam = omp_get_num_threads();
+#endif
+        // Contiguous slabs per thread, so most neighbours are its own.
+        int const s_begin = (tid * nslabs) / nteam;
+        int const s_end = ((tid + 1) * nslabs) / nteam;
+
+        for (int it = 0; it < num_iterations; ++it) {
+            bool const even = (it % 2 == 0);
+            auto const& next = even ? abuf : bbuf;
+            auto const& prev = even ? bbuf : abuf;
+
+            auto t0 = amrex::second();
+            for (int s = s_begin; s < s_end; ++s) {
+                auto const& slab = slabs[s];
+                for (int t : slab.sources) { detail::WaitFor(counters[t].done, it); }
+                for (auto const& p : slab.pulls) {
+                    auto const& dst = prev[p.dst_box];
+                    auto const& src = prev[p.src_box];
+                    amrex::LoopOnCpu(p.region, [&] (int i, int j, int k)
+                    {
+                        dst(i,j,k) = src(i,j,k);
+                    });
+                }
+                counters[s].pulled.store(it + 1, std::memory_order_release);
+            }
+
+            auto t1 = amrex::second();
+            double wait = 0.0;
+            for (int s = s_begin; s < s_end; ++s) {
+                auto const& slab = slabs[s];
+                auto tw = amrex::second();
+                for (int t : slab.neighbors) { detail::WaitFor(counters[t].done, it); }
+                for (int t : slab.ghost_deps) { detail::WaitFor(counters[t].pulled, it + 1); }
+                for (int t : slab.consumers) { detail::WaitFor(counters[t].pulled, it); }
+                wait += amrex::second() - tw;
+
+                // Tile the slab as MFIter tiles opt = 0, keeping whole rows.
+                amrex::Box const& r = slab.region;
+                for (int k0 = r.smallEnd(2); k0 <= r.bigEnd(2); k0 += tile[2]) {
+                for (int j0 = r.smallEnd(1); j0 <= r.bigEnd(1); j0 += tile[1]) {
+                    amrex::Box bx = r;
+                    bx.setSmall(1, j0);
+                    bx.setBig(1, std::min(j0 + tile[1] - 1, r.bigEnd(1)));
+                    bx.setSmall(2, k0);
+                    bx.setBig(2, std::min(k0 + tile[2] - 1, r.bigEnd(2)));
+                    StencilStep<HL>(bx, next[slab.box], prev[slab.box], vel[slab.box], coeff);
+                }}
+                counters[s].done.store(it + 1, std::memory_order_release);
+            }
+            auto t2 = amrex::second();
+
+            if (tid == 0) {
+                timers.record((t1 - t0) + wait, (t2 - t1) - wait);
+            }
+        }
+    }
+}
@@ -0,0 +1,516 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FArrayBox.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "iso3dfd.hpp"
+#include "Utils.hpp"
+#include "SimdKernel.hpp"
+#include "VelocityModel.hpp"
+#include "ActiveRegion.hpp"
+#include "Diagnostics.hpp"
+
+// The opt = 0 and opt = 1 propagators and their setup, shared by the
+// iso3dfd driver and the benchmark suite.
+
+// Kernel selection for StencilStep, set from the inputs.
+inline int use_array4 = true;
+inline int use_array4_hack = false;
+inline int use_simd = false;
+inline SimdIsa simd_isa = SimdIsa::Scalar;
+
+inline std::string KernelName ()
+{
+    if (use_simd) { return std::string("simd (") + SimdIsaName(simd_isa) + ")"; }
+    if (use_array4) { return use_array4_hack ? "array4 hack" : "array4"; }
+    return "raw pointer";
+}
+
+// The MFIter tiling with which the propagator selected by opt updates the
+// fields; opt = 2 works on whole boxes.  opt = 3 owns z-slabs, which the
+// z-major order of the opt = 0 tiles approximates.
+inline amrex::MFItInfo KernelTiling (int opt, amrex::IntVect const& block)
+{
+    amrex::MFItInfo info;
+    if (opt == 1) {
+        info.EnableTiling(block);
+    } else if (opt == 0 || opt == 3) {
+        info.EnableTiling(amrex::FabArrayBase::mfiter_tile_size);
+    }
+    return info;
+}
+
+// Zero both wavefields and add the source, keeping the velocity model.
+template <int HL>
+void Initialize (amrex::MultiFab& prev, amrex::MultiFab& next, amrex::Box const& domain)
+{
+    amrex::Print() << "Initializing ... \n";
+
+    prev.setVal(0.0f);
+    next.setVal(0.0f);
+
+    // Add a source to initial wavefield as an initial condition.  The source
+    // is placed at the same padded-array location as initialize() in Utils.hpp
+    // so that VerifyResult compares like with like.
+    auto nx = domain.length(0) + 2*HL;
+    auto ny = domain.length(1) + 2*HL;
+    auto nz = domain.length(2) + 2*HL;
+    amrex::Print() << "nx" << nx << "\n"
+                   << "ny" << ny << "\n"
+                   << "nz" << nz << "\n";
+    float val = 1.f;
+    for (int s = 5; s >= 0; s--)
+    {
+        amrex::Box b(amrex::IntVect((nx / 4) - s, (ny / 4) - s, (nz / 2) - s),
+              amrex::IntVect((nx / 4) + s - 1, (ny / 4) + s - 1, (nz / 2) + s - 1));
+        b.shift(amrex::IntVect(-HL));
+        for (amrex::MFIter mfi(prev); mfi.isValid(); ++mfi) {
+            amrex::Box const& sb = b & mfi.validbox();
+            if (sb.ok()) {
+                prev[mfi].template setVal<amrex::RunOn::Device>(val, sb);
+            }
+        }
+        val *= 10.f;
+    }
+
+    PrintStats("Initial", Stats(prev));
+}
+
+// As above, with the constant velocity of the host reference in vel.
+template <int HL>
+void Initialize (amrex::MultiFab& prev, amrex::MultiFab& next, amrex::MultiFab& vel, amrex::Box const& domain)
+{
+    vel.setVal(2250000.0f * dt * dt);
+    Initialize<HL>(prev, next, domain);
+}
+
+// Update the cells of the tile bx, one x-row at a time, marching along z.  The
+// 2*HL+1 z-planes of the current row live in a rotating window, so each value
+// of prev is loaded from memory once per z-column instead of 2*HL+1 times.
+// The arithmetic matches Iso3dfdPoint exactly.
+template <int HL>
+void Iso3dfdStreamZ (amrex::Box const& bx, float* pn, float const* pp, float const* pv,
+                     float const* coeff, amrex::Dim3 const& lo, amrex::Long jstride, amrex::Long kstride,
+                     float* window)
+{
+    constexpr int R = HL;
+    constexpr int W = 2*R + 1;
+    int const nx = bx.length(0);
+    auto slot = [=] (int k) { return window + ((k % W + W) % W) * nx; };
+    auto row = [=] (int j, int k) { return (bx.smallEnd(0)-lo.x) + (j-lo.y)*jstride + (k-lo.z)*kstride; };
+
+    for (int j = bx.smallEnd(1); j <= bx.bigEnd(1); ++j) {
+        // Prime the window with the planes below k0+R.
+        for (int k = bx.smallEnd(2) - R; k < bx.smallEnd(2) + R; ++k) {
+            std::memcpy(slot(k), pp + row(j,k), nx*sizeof(float));
+        }
+        for (int k = bx.smallEnd(2); k <= bx.bigEnd(2); ++k) {
+            // Only one new row enters the window per step in z.
+            std::memcpy(slot(k+R), pp + row(j,k+R), nx*sizeof(float));
+
+            float const* zrow[W];
+            for (int d = -R; d <= R; ++d) {
+                zrow[d+R] = slot(k+d);
+            }
+            auto off = row(j,k);
+            float* AMREX_RESTRICT n = pn + off;
+            float const* AMREX_RESTRICT p = pp + off;
+            float const* AMREX_RESTRICT v = pv + off;
+            for (int i = 0; i < nx; ++i) {
+                float value = zrow[R][i] * coeff[0];
+#pragma unroll(HL)
+                for (int ir = 1; ir <= R; ++ir) {
+                    value += coeff[ir] * (p[i+ir] +
+                                          p[i-ir] +
+                                          p[i+ir*jstride] +
+                                          p[i-ir*jstride] +
+                                          zrow[R+ir][i] +
+                                          zrow[R-ir][i]);
+                }
+                n[i] = 2.0f * zrow[R][i] - n[i] + value*v[i];
+            }
+        }
+    }
+}
+
+// Advance the cells of bx by one step with Iso3dfdPoint, as the raw kernel
+// and opt = 1 do, and reduce the statistics of the new values into
+// reduce_data.
+template <int HL, typename Vel>
+void PointStepStats (amrex::Box const& bx, amrex::Array4<float> const& next,
+                     amrex::Array4<float const> const& prev, Vel const& vel, float const* coeff,
+                     StatsReduceOps& reduce_op, StatsReduceData& reduce_data)
+{
+    auto* pn = next.dataPtr();
+    auto const* pp = prev.dataPtr();
+    auto jstride = next.jstride;
+    auto kstride = next.kstride;
+    auto const lo = next.begin;
+    reduce_op.eval(bx, reduce_data,
+    [=] AMREX_GPU_DEVICE (int i, int j, int k) -> StatsTuple
+    {
+        auto offset = (i-lo.x) + (j-lo.y)*jstride + (k-lo.z)*kstride;
+        float const older = pn[offset];
+        float const v2dt2 = vel(i,j,k);
+        Iso3dfdPoint<HL>(pn, pp, v2dt2, coeff, offset, jstride, kstride);
+        return UpdateStats(older, pp[offset], pn[offset], v2dt2);
+    });
+}
+
+// As StencilStep with the scalar kernel selected by use_array4 and
+// use_array4_hack, also reducing the statistics of the new values.
+template <int HL, typename Vel>
+void StencilStepStats (amrex::Box const& bx, amrex::Array4<float> const& next,
+                       amrex::Array4<float const> const& prev, Vel const& vel, float const* coeff,
+                       StatsReduceOps& reduce_op, StatsReduceData& reduce_data)
+{
+    if (use_array4) {
+        if (use_array4_hack) {
+            reduce_op.eval(bx, reduce_data,
+            [=] AMREX_GPU_DEVICE (int i, int j, int k) -> StatsTuple
+            {
+                auto *pn = next.ptr(i,j,k);
+                auto const* pp = prev.ptr(i,j,k);
+                float const older = *pn;
+                float value = (*pp) * coeff[0];
+#pragma unroll(HL)
+                for (int ir = 1; ir <= HL; ++ir) {
+                    value += coeff[ir] * (pp[ ir] +
+                                          pp[-ir] +
+                                          pp[ ir*prev.jstride] +
+                                          pp[-ir*prev.jstride] +
+                                          pp[ ir*prev.kstride] +
+                                          pp[-ir*prev.kstride]);
+                }
+                float const v2dt2 = vel(i,j,k);
+                *pn = 2.0f * (*pp) - older + value*v2dt2;
+                return UpdateStats(older, *pp, *pn, v2dt2);
+            });
+        } else {
+            reduce_op.eval(bx, reduce_data,
+            [=] AMREX_GPU_DEVICE (int i, int j, int k) -> StatsTuple
+            {
+                float const older = next(i,j,k);
+                float value = prev(i,j,k) * coeff[0];
+#pragma unroll(HL)
+                for (int ir = 1; ir <= HL; ++ir) {
+                    value += coeff[ir] * (prev(i-ir,j   ,k   ) +
+                                          prev(i+ir,j   ,k   ) +
+                                          prev(i   ,j-ir,k   ) +
+                                          prev(i   ,j+ir,k   ) +
+                                          prev(i   ,j   ,k-ir) +
+                                          prev(i   ,j   ,k+ir));
+                }
+                float const v2dt2 = vel(i,j,k);
+                next(i,j,k) = 2.0f * prev(i,j,k) - older + value*v2dt2;
+                return UpdateStats(older, prev(i,j,k), next(i,j,k), v2dt2);
+            });
+        }
+    } else {
+        PointStepStats<HL>(bx, next, prev, vel, coeff, reduce_op, reduce_data);
+    }
+}
+
+// 2.5D streaming kernel (opt = 1).  Work is split into (x,y) column blocks of
+// n1_block x n2_block cells and z-chunks of n3_block planes; each work item
+// owns one block and marches along z.  On CPU the blocks are amrex::MFIter tiles
+// shared out by OpenMP.  On GPU every thread owns one (x,y) column of a z-chunk
+// and keeps its z-neighbours in registers, as in the oneAPI sample.
+template <int HL>
+void Iso3dfd_opt (amrex::MultiFab& nextmf, amrex::MultiFab& prevmf, amrex::MultiFab const& velmf,
+                  amrex::Gpu::DeviceVector<float> const& coeffdv, int nIterations,
+                  int n1_block, int n2_block, int n3_block, ActiveRegion& active,
+                  StepTimers& timers, Diagnostics* diag = nullptr)
+{
+    BL_PROFILE("Iso3dfd_opt()");
+    auto const* coeff = coeffdv.data();
+    for (auto it = 0; it < nIterations; it += 1) 
+    {
+        amrex::MultiFab& next = (it % 2 == 0) ? nextmf : prevmf;
+        amrex::MultiFab& prev = (it % 2 == 0) ? prevmf : nextmf;
+        amrex::Box const region = active.step(HL);
+
+        auto t0 = amrex::second();
+        prev.FillBoundary();
+        auto t1 = amrex::second();
+
+        if (diag && diag->due()) {
+            // The monitored step runs the point kernel, which also reduces the statistics.
+            StatsReduceOps reduce_op;
+            StatsReduceData reduce_data(reduce_op);
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+            for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+                amrex::Box const& tbx = mfi.tilebox() & region;
+                if (tbx.ok()) {
+                    PointStepStats<HL>(tbx, next.array(mfi), prev.const_array(mfi),
+                                       velmf.const_array(mfi), coeff, reduce_op, reduce_data);
+                }
+            }
+            amrex::Gpu::streamSynchronize();
+            auto t2 = amrex::second();
+            FieldStats const stats = FinishStats(reduce_data, region.contains(active.domain));
+            timers.record(t1 - t0, t2 - t1);
+            diag->finishStep(t2 - t1, &stats);
+            continue;
+        }
+
+#ifdef AMREX_USE_GPU
+        for (amrex::MFIter mfi(next); mfi.isValid(); ++mfi)
+        {
+            amrex::Box const& vbx = mfi.validbox() & region;
+            if (!vbx.ok()) { continue; }
+            auto const& nexta = next.array(mfi);
+            auto const* pp = prev.const_array(mfi).dataPtr();
+            auto const* pv = velmf.const_array(mfi).dataPtr();
+            auto* pn = nexta.dataPtr();
+            auto const lo = nexta.begin;
+            auto jstride = nexta.jstride;
+            auto kstride = nexta.kstride;
+            int const zlo = vbx.smallEnd(2);
+            int const zhi = vbx.bigEnd(2);
+            int const nchunks = (vbx.length(2) + n3_block - 1) / n3_block;
+            amrex::Box cols(amrex::IntVect(vbx.smallEnd(0), vbx.smallEnd(1), 0),
+                     amrex::IntVect(vbx.bigEnd(0), vbx.bigEnd(1), nchunks-1));
+            amrex::ParallelFor(cols, [=] AMREX_GPU_DEVICE (int i, int j, int c)
+            {
+                int begin_z = zlo + c*n3_block;
+                int end_z = amrex::min(begin_z + n3_block - 1, zhi);
+                amrex::Long gid = (i-lo.x) + (j-lo.y)*jstride + (begin_z-lo.z)*kstride;
+
+                float front[HL + 1];
+                float back[HL];
+                for (int iter = 0; iter <= HL; iter++) {
+                    front[iter] = pp[gid + iter*kstride];
+                }
+                for (int iter = 1; iter <= HL; iter++) {
+                    back[iter-1] = pp[gid - iter*kstride];
+                }
+
+                for (int k = begin_z; k <= end_z; ++k) {
+                    float value = front[0] * coeff[0];
+#pragma unroll(HL)
+                    for (int ir = 1; ir <= HL; ++ir) {
+                        value += coeff[ir] * (pp[gid+ir] +
+                                              pp[gid-ir] +
+                                              pp[gid+ir*jstride] +
+                                              pp[gid-ir*jstride] +
+                                              front[ir] +
+                                              back[ir-1]);
+                    }
+                    pn[gid] = 2.0f * front[0] - pn[gid] + value*pv[gid];
+
+                    if (k < end_z) {
+                        // Shift the window to discard the oldest value and
+                        // read one new value along z.
+                        for (int iter = HL - 1; iter > 0; iter--) {
+                            back[iter] = back[iter - 1];
+                        }
+                        back[0] = front[0];
+                        for (int iter = 0; iter < HL; iter++) {
+                            front[iter] = front[iter + 1];
+                        }
+                        gid += kstride;
+                        front[HL] = pp[gid + HL*kstride];
+                    }
+                }
+            });
+        }
+        amrex::Gpu::streamSynchronize();
+#else
+        amrex::MFItInfo info;
+        info.EnableTiling(amrex::IntVect(n1_block, n2_block, n3_block));
+#ifdef AMREX_USE_OMP
+#pragma omp parallel
+#endif
+        {
+            std::vector<float> window((2*HL+1) * n1_block);
+            for (amrex::MFIter mfi(next, info); mfi.isValid(); ++mfi)
+            {
+                amrex::Box const& tbx = mfi.tilebox() & region;
+                if (!tbx.ok()) { continue; }
+                auto const& nexta = next.array(mfi);
+                Iso3dfdStreamZ<HL>(tbx, nexta.dataPtr(), prev.const_array(mfi).dataPtr(),
+                               velmf.const_array(mfi).dataPtr(), coeff, nexta.begin,
+                               nexta.jstride, nexta.kstride, window.data());
+            }
+        }
+#endif
+        auto t2 = amrex::second();
+
+        timers.record(t1 - t0, t2 - t1);
+        if (diag) {
+            diag->finishStep(t2 - t1, nullptr);
+        }
+    }
+
+}
+
+// Advance the cells of bx by one time step.
+// vel is an amrex::Array4 or one of the accessors of VelocityModel.hpp.
+template <int HL, typename Vel>
+void StencilStep (amrex::Box const& bx, amrex::Array4<float> const& next, amrex::Array4<float const> const& prev,
+                  Vel const& vel, float const* coeff)
+{
+    if constexpr (std::is_same_v<Vel, amrex::Array4<float const>>) {
+        if (use_simd) {
+            Iso3dfdSimd<HL>(bx, next, prev, vel, coeff, simd_isa);
+            return;
+        }
+    }
+    if (use_array4) {
+        if (use_array4_hack) {
+            amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                auto *pn = next.ptr(i,j,k);
+                auto const* pp = prev.ptr(i,j,k);
+                float value = (*pp) * coeff[0];
+#pragma unroll(HL)
+                for (int ir = 1; ir <= HL; ++ir) {
+                    value += coeff[ir] * (pp[ ir] +
+                                          pp[-ir] +
+                                          pp[ ir*prev.jstride] +
+                                          pp[-ir*prev.jstride] +
+                                          pp[ ir*prev.kstride] +
+                                          pp[-ir*prev.kstride]);
+                }
+                *pn = 2.0f * (*pp) - (*pn) + value*vel(i,j,k);
+            });
+        } else {
+            amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                float value = prev(i,j,k) * coeff[0];
+#pragma unroll(HL)
+                for (int ir = 1; ir <= HL; ++ir) {
+                    value += coeff[ir] * (prev(i-ir,j   ,k   ) +
+                                          prev(i+ir,j   ,k   ) +
+                                          prev(i   ,j-ir,k   ) +
+                                          prev(i   ,j+ir,k   ) +
+                                          prev(i   ,j   ,k-ir) +
+                                          prev(i   ,j   ,k+ir));
+                }
+                next(i,j,k) = 2.0f * prev(i,j,k) - next(i,j,k) + value*vel(i,j,k);
+            });
+        }
+    } else {
+        // Both wavefield fabs share the same box, so one offset indexes both.
+        auto* pn = next.dataPtr();
+        auto const* pp = prev.dataPtr();
+        auto jstride = next.jstride;
+        auto kstride = next.kstride;
+        auto const lo = next.begin;
+        amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            auto offset = (i-lo.x) + (j-lo.y)*jstride + (k-lo.z)*kstride;
+            Iso3dfdPoint<HL>(pn, pp, vel(i,j,k), coeff, offset, jstride, kstride);
+        });
+    }
+}
+
+// Each time step posts the halo exchange of prev, updates the cells whose
+// stencil lies entirely inside the valid box while the messages are in flight,
+// then finishes the exchange and updates the remaining rim of width HL.
+template <int HL>
+void Iso3dfd (amrex::MultiFab& nextmf, amrex::MultiFab& prevmf, VelocityModel const& vmodel,
+              amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+              ActiveRegion& active, StepTimers& timers, Diagnostics* diag = nullptr)
+{
+    BL_PROFILE("Iso3dfd()");
+    auto const* coeff = coeffdv.data();
+    for (int it = 0; it < num_iterations; ++it) {
+        amrex::MultiFab& next = (it % 2 == 0) ? nextmf : prevmf;
+        amrex::MultiFab& prev = (it % 2 == 0) ? prevmf : nextmf;
+        // simd keeps whole rows so that the split of a row into vectors and
+        // a scalar tail, which round differently, does not depend on it.
+        amrex::Box const region = active.step(HL, use_simd);
+
+        if (diag && diag->due()) {
+            // The monitored step runs one pass that also reduces the statistics.
+            auto t0 = amrex::second();
+            prev.FillBoundary();
+            auto t1 = amrex::second();
+            StatsReduceOps reduce_op;
+            StatsReduceData reduce_data(reduce_op);
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+            for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+                amrex::Box const& tbx = mfi.tilebox() & region;
+                if (tbx.ok()) {
+                    vmodel.apply(mfi, [&] (auto const& vel) {
+                        StencilStepStats<HL>(tbx, next.array(mfi), prev.const_array(mfi), vel, coeff,
+                                             reduce_op, reduce_data);
+                    });
+                }
+            }
+            amrex::Gpu::streamSynchronize();
+            auto t2 = amrex::second();
+            FieldStats const stats = FinishStats(reduce_data, region.contains(active.domain));
+            timers.record(t1 - t0, t2 - t1);
+            diag->finishStep(t2 - t1, &stats);
+            continue;
+        }
+
+        auto t0 = amrex::second();
+        prev.FillBoundary_nowait();
+        auto t1 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& inner = mfi.tilebox() & region & amrex::grow(mfi.validbox(), -HL);
+            if (inner.ok()) {
+                vmodel.apply(mfi, [&] (auto const& vel) {
+                    StencilStep<HL>(inner, next.array(mfi), prev.const_array(mfi), vel, coeff);
+                });
+            }
+        }
+        amrex::Gpu::streamSynchronize();
+        auto t2 = amrex::second();
+
+        prev.FillBoundary_finish();
+        auto t3 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& tbx = mfi.tilebox() & region;
+            if (!tbx.ok()) { continue; }
+            amrex::Box const& inner = tbx & amrex::grow(mfi.validbox(), -HL);
+            for (amrex::Box const& rim : amrex::boxDiff(tbx, inner)) {
+                vmodel.apply(mfi, [&] (auto const& vel) {
+                    StencilStep<HL>(rim, next.array(mfi), prev.const_array(mfi), vel, coeff);
+                });
+            }
+        }
+        amrex::Gpu::streamSynchronize();
+        auto t4 = amrex::second();
+
+        timers.record((t1 - t0) + (t3 - t2), (t2 - t1) + (t4 - t3));
+        if (diag) {
+            diag->finishStep((t2 - t1) + (t4 - t3), nullptr);
+        }
+    }
+
+}
+
+// Copy the valid region of mf, with a zero halo of width ngrow, into hostfab
+// on the I/O processor.
+inline void GatherToHost (amrex::MultiFab const& mf, amrex::Box const& domain, amrex::FArrayBox& hostfab, int ngrow)
+{
+    amrex::BoxArray ba(domain);
+    amrex::DistributionMapping dm(amrex::Vector<int>{amrex::ParallelDescriptor::IOProcessorNumber()});
+    amrex::MultiFab gathered(ba, dm, 1, ngrow);
+    gathered.setVal(0.0f);
+    gathered.ParallelCopy(mf, 0, 0, 1);
+    for (amrex::MFIter mfi(gathered); mfi.isValid(); ++mfi) {
+        auto const& fab = gathered[mfi];
+        amrex::Gpu::copy(amrex::Gpu::deviceToHost, fab.dataPtr(), fab.dataPtr() + fab.size(), hostfab.dataPtr());
+    }
+}
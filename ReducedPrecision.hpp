@@ -0,0 +1,163 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FabArray.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParmParse.H>
+#include <cmath>
+#include <string>
+#include <type_traits>
+#include "iso3dfd.hpp"
+#include "Utils.hpp"
+#include "ActiveRegion.hpp"
+
+// Reduced-precision wavefield storage (storage = bf16|fp16).
+//
+// prev and next are kept in 16 bits and widened to fp32 for the update, which
+// cuts the bytes streamed per point from 12 to 8; storage.vel = 1 stores the
+// velocity in 16 bits too, for 6.  The fp16 range cannot hold the source
+// amplitude, so the wavefields are scaled by a power of two, which commutes
+// exactly with the linear update.  It runs with the raw-pointer kernel of
+// opt = 0 after the fp32 run, against which it is timed and compared.
+struct ReducedPrecision
+{
+    std::string storage = "fp32";
+    int store_vel = 0;
+
+    ReducedPrecision ()
+    {
+        amrex::ParmParse pp;
+        pp.query("storage", storage);
+        amrex::ParmParse pps("storage");
+        pps.query("vel", store_vel);
+        if (storage != "fp32" && storage != "bf16" && storage != "fp16") {
+            amrex::Abort("storage must be fp32, bf16 or fp16");
+        }
+    }
+
+    bool enabled () const { return storage != "fp32"; }
+
+    double bytesPerPoint () const { return store_vel ? 6.0 : 8.0; }
+};
+
+// Power-of-two scale that brings peak down to at most 2^12, which leaves the
+// wavefield room to grow below the fp16 maximum of 65504.
+template <typename T>
+float StorageScale (float peak)
+{
+    if (std::is_same_v<T, fp16> && peak > 0x1p12f) {
+        return std::ldexp(1.0f, 11 - std::ilogb(peak));
+    }
+    return 1.0f;
+}
+
+// dst = src*scale rounded to T, ghost cells included.
+template <typename T>
+void ToStorage (amrex::FabArray<amrex::BaseFab<T>>& dst, amrex::MultiFab const& src, float scale)
+{
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+    for (amrex::MFIter mfi(dst, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+        amrex::Box const& bx = mfi.growntilebox();
+        auto const& d = dst.array(mfi);
+        auto const& s = src.const_array(mfi);
+        amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            d(i,j,k) = FromFloat<T>(s(i,j,k) * scale);
+        });
+    }
+}
+
+// dst = src/scale on the valid cells.
+template <typename T>
+void FromStorage (amrex::MultiFab& dst, amrex::FabArray<amrex::BaseFab<T>> const& src, float scale)
+{
+    float const inv_scale = 1.0f / scale;
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+    for (amrex::MFIter mfi(dst, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+        amrex::Box const& bx = mfi.tilebox();
+        auto const& d = dst.array(mfi);
+        auto const& s = src.const_array(mfi);
+        amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            d(i,j,k) = ToFloat(s(i,j,k)) * inv_scale;
+        });
+    }
+}
+
+namespace detail {
+
+template <int HL, typename T, typename V>
+void StorageStep (amrex::Box const& bx, amrex::Array4<T> const& next,
+                  amrex::Array4<T const> const& prev, amrex::Array4<V const> const& vel,
+                  float const* coeff)
+{
+    auto* pn = next.dataPtr();
+    auto const* pp = prev.dataPtr();
+    auto const* pv = vel.dataPtr();
+    auto jstride = next.jstride;
+    auto kstride = next.kstride;
+    auto const lo = next.begin;
+    amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+    {
+        auto offset = (i-lo.x) + (j-lo.y)*jstride + (k-lo.z)*kstride;
+        Iso3dfdPoint<HL>(pn, pp, pv, coeff, offset, jstride, kstride);
+    });
+}
+
+}
+
+// Iso3dfd with the wavefields stored as T and the velocity as VelFA's type.
+template <int HL, typename T, typename VelFA>
+void Iso3dfd_storage (amrex::FabArray<amrex::BaseFab<T>>& nextfa,
+                      amrex::FabArray<amrex::BaseFab<T>>& prevfa, VelFA const& velfa,
+                      amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+                      ActiveRegion& active, StepTimers& timers)
+{
+    BL_PROFILE("Iso3dfd_storage()");
+    auto const* coeff = coeffdv.data();
+    for (int it = 0; it < num_iterations; ++it) {
+        auto& next = (it % 2 == 0) ? nextfa : prevfa;
+        auto& prev = (it % 2 == 0) ? prevfa : nextfa;
+        amrex::Box const region = active.step(HL);
+
+        auto t0 = amrex::second();
+        prev.FillBoundary_nowait();
+        auto t1 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& inner = mfi.tilebox() & region & amrex::grow(mfi.validbox(), -HL);
+            if (inner.ok()) {
+                detail::StorageStep<HL>(inner, next.array(mfi), prev.const_array(mfi),
+                                        velfa.const_array(mfi), coeff);
+            }
+        }
+        amrex::Gpu::streamSynchronize();
+        auto t2 = amrex::second();
+
+        prev.FillBoundary_finish();
+        auto t3 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(next, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& tbx = mfi.tilebox() & region;
+            if (!tbx.ok()) { continue; }
+            amrex::Box const& inner = tbx & amrex::grow(mfi.validbox(), -HL);
+            for (amrex::Box const& rim : amrex::boxDiff(tbx, inner)) {
+                detail::StorageStep<HL>(rim, next.array(mfi), prev.const_array(mfi),
+                                        velfa.const_array(mfi), coeff);
+            }
+        }
+        amrex::Gpu::streamSynchronize();
+        auto t4 = amrex::second();
+
+        timers.record((t1 - t0) + (t3 - t2), (t2 - t1) + (t4 - t3));
+    }
+}
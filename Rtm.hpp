@@ -0,0 +1,413 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FArrayBox.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Propagators.hpp"
+
+// Reverse-time migration (rtm = 1).
+//
+// Synthetic data are first modelled at a plane of receivers, as the
+// difference between a model with a flat reflector and the background model,
+// which removes the direct wave.  Migration then back-propagates the data
+// through the background model from the last step to the first and
+// correlates the receiver wavefield R with the source wavefield S at every
+// step, image += S*R.  S is needed in reverse order, so it is recomputed from
+// checkpoints with the binomial (revolve) schedule, which needs the fewest
+// forward steps for the number of checkpoints the memory budget rtm.memory_mb
+// holds.  Every step is an Iso3dfd step.
+struct RtmParams
+{
+    int enabled = 0;
+    int steps = 0;
+    double memory_mb = 1024.0;
+    int receiver_depth = -1;
+    int receiver_stride = 4;
+    int reflector_depth = -1;
+    float reflector_contrast = 1.5f;
+    std::string image_file;
+
+    RtmParams (amrex::Box const& domain, int half_length, int num_iterations)
+    {
+        amrex::ParmParse pp;
+        pp.query("rtm", enabled);
+        amrex::ParmParse ppr("rtm");
+        steps = num_iterations;
+        ppr.query("steps", steps);
+        ppr.query("memory_mb", memory_mb);
+        // By default the receivers are at the depth of the source of Initialize.
+        receiver_depth = (domain.length(2) + 2*half_length) / 2 - half_length;
+        ppr.query("receiver_depth", receiver_depth);
+        ppr.query("receiver_stride", receiver_stride);
+        reflector_depth = domain.smallEnd(2) + 3 * domain.length(2) / 4;
+        ppr.query("reflector_depth", reflector_depth);
+        ppr.query("reflector_contrast", reflector_contrast);
+        ppr.query("image_file", image_file);
+        if (enabled) {
+            AMREX_ALWAYS_ASSERT(steps >= 1 && receiver_stride >= 1);
+            if (receiver_depth < domain.smallEnd(2) || receiver_depth > domain.bigEnd(2)) {
+                amrex::Abort("rtm.receiver_depth must lie in the domain");
+            }
+        }
+    }
+};
+
+// Number of steps that can be reversed with s free checkpoints when no step
+// is advanced more than r times, C(s+r, s+1); saturates above the step counts.
+inline amrex::Long BinomialSteps (int s, int r)
+{
+    if (r <= 0) { return 0; }
+    double b = 1.0;
+    for (int i = 1; i <= s + 1; ++i) {
+        b = b * (r - 1 + i) / i;
+    }
+    return amrex::Long(std::min(b, 1.e18));
+}
+
+// Fewest repetitions r with BinomialSteps(s, r) >= l.
+inline int BinomialRepetitions (amrex::Long l, int s)
+{
+    int r = 1;
+    while (BinomialSteps(s, r) < l) { ++r; }
+    return r;
+}
+
+// Forward steps to reverse l steps with s free checkpoints, revisits included.
+inline amrex::Long BinomialCost (amrex::Long l, int s)
+{
+    int const r = BinomialRepetitions(l, s);
+    return r * l - BinomialSteps(s + 1, r - 1);
+}
+
+// First advance of the optimal schedule for l steps and s free checkpoints:
+// the left part then takes r-1 repetitions and the right part, with one
+// checkpoint fewer, r.
+inline int BinomialSplit (int l, int s)
+{
+    int const r = BinomialRepetitions(l, s);
+    amrex::Long const j = std::max(BinomialSteps(s, r - 2) + 1, l - BinomialSteps(s - 1, r));
+    return int(std::max(amrex::Long(1), std::min(j, amrex::Long(l - 1))));
+}
+
+// Visit the states b, b-1, ..., a+1 in that order, given state a in a
+// checkpoint and s free ones.  ops provides advance(k), store(t), restore(t),
+// drop(t) and visit(t).
+template <typename Ops>
+void ReverseSteps (Ops& ops, int a, int b, int s)
+{
+    int const l = b - a;
+    if (s == 0 || l == 1) {
+        for (int t = b; t > a; --t) {
+            ops.restore(a);
+            ops.advance(t - a);
+            ops.visit(t);
+        }
+        return;
+    }
+    int const j = BinomialSplit(l, s);
+    ops.restore(a);
+    ops.advance(j);
+    ops.store(a + j);
+    ReverseSteps(ops, a + j, b, s - 1);
+    ops.drop(a + j);
+    ReverseSteps(ops, a, a + j, s);
+}
+
+// The receivers, every stride-th cell in x and y of the plane z = depth, and
+// their traces, one value per receiver and step.
+class ReceiverPlane
+{
+public:
+    ReceiverPlane (amrex::MultiFab const& mf, amrex::Box const& domain, int depth, int stride, int nsteps)
+        : m_depth(depth), m_stride(stride), m_origin(domain.smallEnd())
+    {
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+            amrex::Box const& vbx = mfi.validbox();
+            amrex::Box lattice;
+            if (depth >= vbx.smallEnd(2) && depth <= vbx.bigEnd(2)) {
+                amrex::IntVect lo(0), hi(-1, -1, 0);
+                for (int d = 0; d < 2; ++d) {
+                    lo[d] = (vbx.smallEnd(d) - m_origin[d] + stride - 1) / stride;
+                    hi[d] = (vbx.bigEnd(d) - m_origin[d]) / stride;
+                }
+                lattice = amrex::Box(lo, hi);
+            }
+            m_lattice.push_back(lattice);
+            m_offset.push_back(m_count);
+            if (lattice.ok()) { m_count += lattice.numPts(); }
+        }
+        m_traces.resize(m_count * nsteps, 0.0f);
+        amrex::Long total = m_count;
+        amrex::ParallelDescriptor::ReduceLongSum(total);
+        m_total = total;
+    }
+
+    amrex::Long count () const { return m_total; }
+    amrex::Long bytes () const { return amrex::Long(m_traces.size() * sizeof(float)); }
+
+    // trace(step) += sign * mf at the receivers.
+    void record (amrex::MultiFab const& mf, int step, float sign)
+    {
+        forEach(mf, step, [=] AMREX_GPU_DEVICE (float& trace, float const& value) { trace += sign * value; });
+    }
+
+    // mf += trace(step) at the receivers.
+    void inject (amrex::MultiFab& mf, int step)
+    {
+        forEach(mf, step, [=] AMREX_GPU_DEVICE (float const& trace, float& value) { value += trace; });
+    }
+
+private:
+    template <typename MF, typename F>
+    void forEach (MF& mf, int step, F const& f)
+    {
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+            int const li = mfi.LocalIndex();
+            amrex::Box const& lattice = m_lattice[li];
+            if (!lattice.ok()) { continue; }
+            float* tr = m_traces.data() + step * m_count + m_offset[li];
+            auto const& a = mf.array(mfi);
+            int const stride = m_stride;
+            int const x0 = m_origin[0];
+            int const y0 = m_origin[1];
+            int const z = m_depth;
+            int const mlo = lattice.smallEnd(0);
+            int const nlo = lattice.smallEnd(1);
+            int const mlen = lattice.length(0);
+            amrex::ParallelFor(lattice, [=] AMREX_GPU_DEVICE (int m, int n, int)
+            {
+                f(tr[(m - mlo) + (n - nlo) * mlen], a(x0 + m*stride, y0 + n*stride, z));
+            });
+        }
+    }
+
+    int m_depth;
+    int m_stride;
+    amrex::IntVect m_origin;
+    std::vector<amrex::Box> m_lattice;
+    std::vector<amrex::Long> m_offset;
+    amrex::Long m_count = 0;
+    amrex::Long m_total = 0;
+    amrex::Gpu::DeviceVector<float> m_traces;
+};
+
+template <int HL>
+void RunRtm (RtmParams const& params, amrex::MultiFab& prev, amrex::MultiFab& next,
+             amrex::MultiFab const& vel, amrex::Box const& domain,
+             amrex::Gpu::DeviceVector<float> const& coeffdv)
+{
+    BL_PROFILE("RunRtm()");
+    amrex::BoxArray const& ba = prev.boxArray();
+    amrex::DistributionMapping const& dm = prev.DistributionMap();
+    int const nsteps = params.steps;
+    Initialize<HL>(prev, next, domain);
+
+    // Bytes of one checkpoint, the two time levels of the source wavefield,
+    // on the most loaded rank.
+    amrex::Long local_points = 0;
+    for (amrex::MFIter mfi(prev); mfi.isValid(); ++mfi) { local_points += mfi.validbox().numPts(); }
+    amrex::Long ckpt_local = 2 * local_points * amrex::Long(sizeof(float));
+    amrex::ParallelDescriptor::ReduceLongMax(ckpt_local);
+    int const slots = int(std::min(params.memory_mb * 1024.0 * 1024.0 / double(ckpt_local), double(nsteps)));
+    if (slots < 1) {
+        amrex::Abort("rtm.memory_mb does not hold one checkpoint");
+    }
+    int const free_slots = slots - 1;
+
+    ReceiverPlane receivers(prev, domain, params.receiver_depth, params.receiver_stride, nsteps);
+    std::map<int, std::unique_ptr<amrex::MultiFab>> ckpts;
+    auto take = [&] (int t, amrex::MultiFab const& u, amrex::MultiFab const& uold) {
+        auto mf = std::make_unique<amrex::MultiFab>(ba, dm, 2, 0);
+        amrex::MultiFab::Copy(*mf, u, 0, 0, 1, 0);
+        amrex::MultiFab::Copy(*mf, uold, 0, 1, 1, 0);
+        ckpts[t] = std::move(mf);
+    };
+    take(0, prev, next);
+
+    amrex::Print() << "RTM: " << nsteps << " steps, " << receivers.count() << " receivers at z = "
+                   << params.receiver_depth << ", reflector at z = " << params.reflector_depth
+                   << ", " << free_slots + 1 << " checkpoints of " << ckpt_local / (1024.0*1024.0)
+                   << " MB in " << params.memory_mb << " MB\n";
+
+    ActiveRegion active(prev, next, domain, false);
+    StepTimers timers;
+    // Source wavefield: *sp holds the newest step, *sn the one before.
+    amrex::MultiFab* sp = &prev;
+    amrex::MultiFab* sn = &next;
+    auto step = [&] (amrex::MultiFab*& u, amrex::MultiFab*& uold, VelocityModel const& vm, int k) {
+        Iso3dfd<HL>(*uold, *u, vm, coeffdv, k, active, timers);
+        if (k % 2 == 1) { std::swap(u, uold); }
+    };
+    auto restore = [&] (int t) {
+        auto const& mf = *ckpts.at(t);
+        amrex::MultiFab::Copy(*sp, mf, 0, 0, 1, 0);
+        amrex::MultiFab::Copy(*sn, mf, 1, 0, 1, 0);
+    };
+
+    // Synthetic data: the reflector model minus the background model.
+    auto tm0 = amrex::second();
+    {
+        amrex::MultiFab vel_true(ba, dm, 1, vel.nGrowVect());
+        amrex::MultiFab::Copy(vel_true, vel, 0, 0, 1, vel.nGrowVect());
+        float const scale = params.reflector_contrast * params.reflector_contrast;
+        int const zr = params.reflector_depth;
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(vel_true, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& bx = mfi.growntilebox();
+            auto const& v = vel_true.array(mfi);
+            amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                if (k >= zr) { v(i,j,k) *= scale; }
+            });
+        }
+        VelocityModel vm_true(vel_true, domain, "field");
+        VelocityModel vm_bg(vel, domain, "field");
+        for (auto [vm, sign] : {std::make_pair(&vm_true, 1.0f), std::make_pair(&vm_bg, -1.0f)}) {
+            restore(0);
+            for (int t = 1; t <= nsteps; ++t) {
+                step(sp, sn, *vm, 1);
+                receivers.record(*sp, t - 1, sign);
+            }
+        }
+    }
+    amrex::Gpu::streamSynchronize();
+    double const model_time = amrex::second() - tm0;
+
+    // Migration.
+    amrex::MultiFab r0(ba, dm, 1, prev.nGrowVect());
+    amrex::MultiFab r1(ba, dm, 1, prev.nGrowVect());
+    r0.setVal(0.0f);
+    r1.setVal(0.0f);
+    amrex::MultiFab* rp = &r0;
+    amrex::MultiFab* rn = &r1;
+    amrex::MultiFab image(ba, dm, 1, 0);
+    image.setVal(0.0f);
+    VelocityModel vm_bg(vel, domain, "field");
+
+    struct Ops
+    {
+        std::function<void(int)> advance, store, restore, drop, visit;
+    };
+    int current = 0;
+    amrex::Long forward_steps = 0;
+    std::size_t peak_ckpts = ckpts.size();
+    double t_forward = 0.0, t_backward = 0.0, t_image = 0.0, t_ckpt = 0.0;
+    Ops ops;
+    ops.advance = [&] (int k) {
+        auto t0 = amrex::second();
+        step(sp, sn, vm_bg, k);
+        current += k;
+        forward_steps += k;
+        t_forward += amrex::second() - t0;
+    };
+    ops.store = [&] (int t) {
+        auto t0 = amrex::second();
+        take(t, *sp, *sn);
+        peak_ckpts = std::max(peak_ckpts, ckpts.size());
+        t_ckpt += amrex::second() - t0;
+    };
+    ops.restore = [&] (int t) {
+        if (current == t) { return; }
+        auto t0 = amrex::second();
+        restore(t);
+        current = t;
+        t_ckpt += amrex::second() - t0;
+    };
+    ops.drop = [&] (int t) { ckpts.erase(t); };
+    ops.visit = [&] (int t) {
+        auto t0 = amrex::second();
+        step(rp, rn, vm_bg, 1);
+        receivers.inject(*rp, t - 1);
+        auto t1 = amrex::second();
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (amrex::Gpu::notInLaunchRegion())
+#endif
+        for (amrex::MFIter mfi(image, amrex::TilingIfNotGPU()); mfi.isValid(); ++mfi) {
+            amrex::Box const& bx = mfi.tilebox();
+            auto const& img = image.array(mfi);
+            auto const& s = sp->const_array(mfi);
+            auto const& r = rp->const_array(mfi);
+            amrex::ParallelFor(bx, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                img(i,j,k) += s(i,j,k) * r(i,j,k);
+            });
+        }
+        t_backward += t1 - t0;
+        t_image += amrex::second() - t1;
+    };
+
+    restore(0);
+    amrex::ParallelDescriptor::Barrier();
+    auto t0 = amrex::second();
+    ReverseSteps(ops, 0, nsteps, free_slots);
+    amrex::Gpu::streamSynchronize();
+    double migration_time = amrex::second() - t0;
+    amrex::ParallelDescriptor::ReduceRealMax(migration_time);
+
+    // Everything this rank held at the peak of the migration.
+    amrex::Long field_bytes = 0;
+    for (amrex::MultiFab const* mf : std::initializer_list<amrex::MultiFab const*>{&prev, &next, &r0, &r1, &vel, &image}) {
+        for (amrex::MFIter mfi(*mf); mfi.isValid(); ++mfi) {
+            field_bytes += (*mf)[mfi].nBytes();
+        }
+    }
+    amrex::Long peak_bytes = field_bytes + amrex::Long(peak_ckpts) * ckpt_local + receivers.bytes();
+    amrex::ParallelDescriptor::ReduceLongMax(peak_bytes);
+
+    double const npoints = domain.d_numPts() * nsteps;
+    amrex::Print() << "modelling time    : " << model_time << " secs (" << 2*nsteps << " steps)\n";
+    amrex::Print() << "migration time    : " << migration_time << " secs, forward " << t_forward
+                   << ", backward " << t_backward << ", imaging " << t_image << ", checkpoints " << t_ckpt << "\n";
+    amrex::Print() << "forward steps     : " << forward_steps << " (binomial optimum "
+                   << BinomialCost(nsteps, free_slots) << "), recompute ratio "
+                   << double(forward_steps) / nsteps << "\n";
+    amrex::Print() << "peak memory       : " << peak_bytes / (1024*1024) << " MB per rank, "
+                   << peak_ckpts << " checkpoints held\n";
+    amrex::Print() << "imaging throughput: " << npoints / migration_time / 1.e6 << " Mpts/s\n";
+
+    // The image on the I/O processor, with its energy per depth.
+    amrex::FArrayBox image_host;
+    if (amrex::ParallelDescriptor::IOProcessor()) {
+        image_host.resize(domain, 1, amrex::The_Pinned_Arena());
+    }
+    GatherToHost(image, domain, image_host, 0);
+    if (amrex::ParallelDescriptor::IOProcessor()) {
+        auto const& img = image_host.const_array();
+        std::vector<double> energy(domain.length(2), 0.0);
+        amrex::LoopOnCpu(domain, [&] (int i, int j, int k)
+        {
+            energy[k - domain.smallEnd(2)] += double(img(i,j,k)) * img(i,j,k);
+        });
+        // The strongest depth below the receivers, where reflections image.
+        int const zlo = params.receiver_depth + HL + 1 - domain.smallEnd(2);
+        int peak = -1;
+        for (int k = std::max(zlo, 0); k < int(energy.size()); ++k) {
+            if (peak < 0 || energy[k] > energy[peak]) { peak = k; }
+        }
+        if (peak >= 0) {
+            std::cout << "image peak depth  : z = " << peak + domain.smallEnd(2)
+                      << " below the receivers (reflector at z = " << params.reflector_depth << ")\n";
+        }
+        if (!params.image_file.empty()) {
+            std::ofstream os(params.image_file, std::ios::binary);
+            os.write(reinterpret_cast<char const*>(image_host.dataPtr()),
+                     std::streamsize(image_host.nBytes()));
+            std::cout << "Wrote the image to " << params.image_file << " (fp32, x fastest, "
+                      << domain.length(0) << " x " << domain.length(1) << " x " << domain.length(2) << ")\n";
+        }
+    }
+}
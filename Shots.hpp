@@ -0,0 +1,340 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_FabArray.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "iso3dfd.hpp"
+#include "Utils.hpp"
+#include "SimdKernel.hpp"
+#include "Propagators.hpp"
+
+// Batched multi-shot propagation (shots = N).
+//
+// N independent sources are propagated through the same velocity model in
+// batches of W shots.  The wavefields of a batch are stored shot-innermost,
+// W floats per cell, so each velocity value loaded serves all W shots and the
+// lanes of a vector run across shots with unit stride and no row tail.  W is
+// the vector width of simd_isa (16 for avx512, 8 for avx2, 4 otherwise), or
+// less for few shots, unless shots.lanes sets it.  shots.positions lists the
+// source centre of each shot as domain indices; by default the shots are
+// spread along x at the y and z of the single-shot source.  Each shot is
+// updated with the arithmetic of Iso3dfdPoint, and with verify != none the
+// first and last shots are checked against one-at-a-time runs with the
+// opt = 0 kernel.
+struct ShotBatch
+{
+    int count = 0;
+    int lanes = 0;
+    double rtol = 1.e-4;
+    std::vector<amrex::IntVect> positions;
+
+    ShotBatch (amrex::Box const& domain, int half_length)
+    {
+        amrex::ParmParse pp;
+        pp.query("shots", count);
+        amrex::ParmParse pps("shots");
+        pps.query("lanes", lanes);
+        pps.query("rtol", rtol);
+        if (count <= 0) { return; }
+        if (lanes != 0 && lanes != 4 && lanes != 8 && lanes != 16) {
+            amrex::Abort("shots.lanes must be 4, 8 or 16");
+        }
+        std::vector<int> xyz;
+        pps.queryarr("positions", xyz);
+        if (xyz.empty()) {
+            // The single-shot source of Initialize, moved along x.
+            int const y = (domain.length(1) + 2*half_length) / 4 - half_length;
+            int const z = (domain.length(2) + 2*half_length) / 2 - half_length;
+            for (int s = 0; s < count; ++s) {
+                positions.emplace_back(domain.smallEnd(0) + (s+1) * domain.length(0) / (count+1), y, z);
+            }
+        } else {
+            if (int(xyz.size()) != 3*count) {
+                amrex::Abort("shots.positions needs 3 indices per shot");
+            }
+            for (int s = 0; s < count; ++s) {
+                amrex::IntVect const p(xyz[3*s], xyz[3*s+1], xyz[3*s+2]);
+                if (!domain.contains(p)) { amrex::Abort("shots.positions must lie in the domain"); }
+                positions.push_back(p);
+            }
+        }
+    }
+
+    bool enabled () const { return count > 0; }
+};
+
+// The wavefields of W shots at one cell.
+template <int W>
+struct ShotPack
+{
+    float v[W];
+};
+
+// The nested cubes of the single-shot source around centre, inner ones last.
+template <typename F>
+void ForEachSourceBox (amrex::IntVect const& centre, F&& f)
+{
+    float val = 1.f;
+    for (int s = 5; s >= 0; s--) {
+        f(amrex::Box(centre - s, centre + (s - 1)), val);
+        val *= 10.f;
+    }
+}
+
+namespace detail {
+
+template <int HL, int W>
+AMREX_FORCE_INLINE
+void ShotRow (float* AMREX_RESTRICT pn, float const* AMREX_RESTRICT pp,
+              float const* AMREX_RESTRICT pv, float const* coeff,
+              int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    for (int i = 0; i < nx; ++i) {
+        float* n = pn + i*W;
+        float const* p = pp + i*W;
+        float const vel = pv[i];
+        float value[W];
+        AMREX_PRAGMA_SIMD
+        for (int l = 0; l < W; ++l) {
+            value[l] = p[l] * coeff[0];
+        }
+        for (int ir = 1; ir <= HL; ++ir) {
+            AMREX_PRAGMA_SIMD
+            for (int l = 0; l < W; ++l) {
+                value[l] += coeff[ir] * (p[l + ir*W] +
+                                         p[l - ir*W] +
+                                         p[l + ir*jstride] +
+                                         p[l - ir*jstride] +
+                                         p[l + ir*kstride] +
+                                         p[l - ir*kstride]);
+            }
+        }
+        AMREX_PRAGMA_SIMD
+        for (int l = 0; l < W; ++l) {
+            n[l] = 2.0f * p[l] - n[l] + value[l]*vel;
+        }
+    }
+}
+
+#ifdef ISO3DFD_X86_SIMD
+template <int HL, int W>
+ISO3DFD_TARGET_AVX512
+void ShotRowAVX512 (float* pn, float const* pp, float const* pv, float const* coeff,
+                    int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    ShotRow<HL,W>(pn, pp, pv, coeff, nx, jstride, kstride);
+}
+
+template <int HL, int W>
+ISO3DFD_TARGET_AVX2
+void ShotRowAVX2 (float* pn, float const* pp, float const* pv, float const* coeff,
+                  int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    ShotRow<HL,W>(pn, pp, pv, coeff, nx, jstride, kstride);
+}
+#endif
+
+template <int HL, int W>
+void ShotStep (amrex::Box const& bx, amrex::Array4<ShotPack<W>> const& next,
+               amrex::Array4<ShotPack<W> const> const& prev,
+               amrex::Array4<float const> const& vel, float const* coeff)
+{
+    int const nx = bx.length(0);
+    // Strides in floats.
+    auto const jstride = next.jstride * W;
+    auto const kstride = next.kstride * W;
+    for (int k = bx.smallEnd(2); k <= bx.bigEnd(2); ++k) {
+        for (int j = bx.smallEnd(1); j <= bx.bigEnd(1); ++j) {
+            int const i = bx.smallEnd(0);
+            auto* pn = next.ptr(i,j,k)->v;
+            auto const* pp = prev.ptr(i,j,k)->v;
+            auto const* pv = vel.ptr(i,j,k);
+            switch (simd_isa) {
+#ifdef ISO3DFD_X86_SIMD
+            case SimdIsa::AVX512:
+                ShotRowAVX512<HL,W>(pn, pp, pv, coeff, nx, jstride, kstride);
+                break;
+            case SimdIsa::AVX2:
+                ShotRowAVX2<HL,W>(pn, pp, pv, coeff, nx, jstride, kstride);
+                break;
+#endif
+            default:
+                ShotRow<HL,W>(pn, pp, pv, coeff, nx, jstride, kstride);
+            }
+        }
+    }
+}
+
+}
+
+// Advance a batch of shots; the wavefields swap as in Iso3dfd.
+template <int HL, int W>
+void Iso3dfd_shots (amrex::FabArray<amrex::BaseFab<ShotPack<W>>>& nextfa,
+                    amrex::FabArray<amrex::BaseFab<ShotPack<W>>>& prevfa, amrex::MultiFab const& velmf,
+                    amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations, StepTimers& timers)
+{
+    BL_PROFILE("Iso3dfd_shots()");
+    auto const* coeff = coeffdv.data();
+    for (int it = 0; it < num_iterations; ++it) {
+        auto& next = (it % 2 == 0) ? nextfa : prevfa;
+        auto& prev = (it % 2 == 0) ? prevfa : nextfa;
+
+        auto t0 = amrex::second();
+        prev.FillBoundary_nowait();
+        auto t1 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel
+#endif
+        for (amrex::MFIter mfi(next, true); mfi.isValid(); ++mfi) {
+            amrex::Box const& inner = mfi.tilebox() & amrex::grow(mfi.validbox(), -HL);
+            if (inner.ok()) {
+                detail::ShotStep<HL,W>(inner, next.array(mfi), prev.const_array(mfi),
+                                       velmf.const_array(mfi), coeff);
+            }
+        }
+        auto t2 = amrex::second();
+
+        prev.FillBoundary_finish();
+        auto t3 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel
+#endif
+        for (amrex::MFIter mfi(next, true); mfi.isValid(); ++mfi) {
+            amrex::Box const& tbx = mfi.tilebox();
+            amrex::Box const& inner = tbx & amrex::grow(mfi.validbox(), -HL);
+            for (amrex::Box const& rim : amrex::boxDiff(tbx, inner)) {
+                detail::ShotStep<HL,W>(rim, next.array(mfi), prev.const_array(mfi),
+                                       velmf.const_array(mfi), coeff);
+            }
+        }
+        auto t4 = amrex::second();
+
+        timers.record((t1 - t0) + (t3 - t2), (t2 - t1) + (t4 - t3));
+    }
+}
+
+// Run every shot of batch in groups of W, then report shots per hour and the
+// gain over running them one at a time in single_time each.  prev and next are
+// scratch for the verification runs.
+template <int HL, int W>
+void RunShotBatches (ShotBatch const& batch, amrex::MultiFab& prev, amrex::MultiFab& next,
+                     amrex::MultiFab const& vel, amrex::Box const& domain,
+                     amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+                     double single_time, bool verify)
+{
+    using PackFab = amrex::FabArray<amrex::BaseFab<ShotPack<W>>>;
+    amrex::BoxArray const& ba = prev.boxArray();
+    amrex::DistributionMapping const& dm = prev.DistributionMap();
+    PackFab prev_s(ba, dm, 1, HL);
+    PackFab next_s(ba, dm, 1, HL);
+    int const nbatches = (batch.count + W - 1) / W;
+    amrex::Print() << "Shots: " << batch.count << " in " << nbatches << " batches of " << W << " lanes\n";
+
+    // The newest wavefield of every shot, by global index, for verification.
+    std::vector<int> checked{0};
+    if (batch.count > 1) { checked.push_back(batch.count - 1); }
+    std::vector<amrex::MultiFab> results(checked.size());
+
+    double time = 0.0;
+    StepTimers timers;
+    for (int b = 0; b < nbatches; ++b) {
+        ShotPack<W> zero{};
+        prev_s.setVal(zero);
+        next_s.setVal(zero);
+        for (int l = 0; l < W && b*W + l < batch.count; ++l) {
+            ForEachSourceBox(batch.positions[b*W + l], [&] (amrex::Box const& sbx, float val) {
+                for (amrex::MFIter mfi(prev_s); mfi.isValid(); ++mfi) {
+                    auto const& a = prev_s.array(mfi);
+                    amrex::LoopOnCpu(sbx & mfi.validbox(), [&] (int i, int j, int k)
+                    {
+                        a(i,j,k).v[l] = val;
+                    });
+                }
+            });
+        }
+
+        amrex::ParallelDescriptor::Barrier();
+        auto t0 = amrex::second();
+        Iso3dfd_shots<HL,W>(next_s, prev_s, vel, coeffdv, num_iterations, timers);
+        double dt = amrex::second() - t0;
+        amrex::ParallelDescriptor::ReduceRealMax(dt);
+        time += dt;
+
+        auto const& newest = (num_iterations % 2 == 1) ? next_s : prev_s;
+        for (std::size_t c = 0; c < checked.size(); ++c) {
+            int const s = checked[c];
+            if (!verify || s / W != b) { continue; }
+            results[c].define(ba, dm, 1, 0);
+            for (amrex::MFIter mfi(newest); mfi.isValid(); ++mfi) {
+                auto const& src = newest.const_array(mfi);
+                auto const& dst = results[c].array(mfi);
+                amrex::LoopOnCpu(mfi.validbox(), [&] (int i, int j, int k)
+                {
+                    dst(i,j,k) = src(i,j,k).v[s % W];
+                });
+            }
+        }
+    }
+
+    double const npoints = domain.d_numPts() * num_iterations * batch.count;
+    amrex::Print() << "shots time   : " << time << " secs, " << batch.count * 3600.0 / time << " shots/hour\n";
+    amrex::Print() << "throughput   : " << npoints / time / 1.e6 << " Mpts/s over all shots\n";
+    amrex::Print() << "bytes/pt     : " << (8.0*W + 4.0) / W << " per shot (12 one at a time)\n";
+    amrex::Print() << "gain vs one shot at a time: " << batch.count * single_time / time << "x\n";
+
+    if (!verify) { return; }
+    ActiveRegion active(prev, next, domain, false);
+    VelocityModel vmodel(vel, domain, "field");
+    for (std::size_t c = 0; c < checked.size(); ++c) {
+        int const s = checked[c];
+        prev.setVal(0.0f);
+        next.setVal(0.0f);
+        ForEachSourceBox(batch.positions[s], [&] (amrex::Box const& sbx, float val) {
+            for (amrex::MFIter mfi(prev); mfi.isValid(); ++mfi) {
+                amrex::Box const& b = sbx & mfi.validbox();
+                if (b.ok()) { prev[mfi].template setVal<amrex::RunOn::Device>(val, b); }
+            }
+        });
+        StepTimers ref_timers;
+        Iso3dfd<HL>(next, prev, vmodel, coeffdv, num_iterations, active, ref_timers);
+        amrex::Gpu::streamSynchronize();
+        auto const& ref = (num_iterations % 2 == 1) ? next : prev;
+
+        amrex::MultiFab diff(ba, dm, 1, 0);
+        amrex::MultiFab::Copy(diff, ref, 0, 0, 1, 0);
+        amrex::MultiFab::Subtract(diff, results[c], 0, 0, 1, 0);
+        double const err = diff.norm0();
+        double const scale = std::max(double(ref.norm0()), 1.e-30);
+        bool const ok = err <= batch.rtol * scale;
+        amrex::Print() << "shot " << s << " at " << batch.positions[s] << " vs single shot: max error "
+                       << err / scale << " relative: " << (ok ? "Success" : "Failure") << "\n";
+    }
+}
+
+template <int HL>
+void RunShots (ShotBatch const& batch, amrex::MultiFab& prev, amrex::MultiFab& next,
+               amrex::MultiFab const& vel, amrex::Box const& domain,
+               amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+               double single_time, bool verify)
+{
+#ifdef AMREX_USE_GPU
+    amrex::Abort("shots are only available for CPU builds");
+#endif
+    int lanes = batch.lanes;
+    if (lanes == 0) {
+        lanes = (simd_isa == SimdIsa::AVX512) ? 16 : (simd_isa == SimdIsa::AVX2) ? 8 : 4;
+        // No wider than the shots fill.
+        while (lanes > 4 && lanes / 2 >= batch.count) { lanes /= 2; }
+    }
+    switch (lanes) {
+    case 4:  RunShotBatches<HL,4>(batch, prev, next, vel, domain, coeffdv, num_iterations, single_time, verify); break;
+    case 8:  RunShotBatches<HL,8>(batch, prev, next, vel, domain, coeffdv, num_iterations, single_time, verify); break;
+    default: RunShotBatches<HL,16>(batch, prev, next, vel, domain, coeffdv, num_iterations, single_time, verify); break;
+    }
+}
@@ -0,0 +1,234 @@
+#pragma once
+#include <AMReX_Array4.H>
+#include <AMReX_Box.H>
+#include <AMReX_MultiFab.H>
+#include <cstdint>
+#include <string>
+#include "iso3dfd.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ISO3DFD_X86_SIMD 1
+#include <immintrin.h>
+#define ISO3DFD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define ISO3DFD_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+// Hand-vectorized CPU stencil (kernel = simd).
+//
+// Rows are processed a vector at a time with FMA accumulation.  The AVX-512
+// variant keeps the vectors left and right of the current one in registers
+// and forms all x-neighbours with valignd, so each x value is loaded once.
+// The AVX2 variant uses overlapping unaligned loads, which hit L1.  The
+// instruction set is picked at run time from CPUID; simd_isa overrides it.
+
+enum class SimdIsa { Scalar, AVX2, AVX512 };
+
+inline char const* SimdIsaName (SimdIsa isa)
+{
+    switch (isa) {
+    case SimdIsa::AVX512: return "avx512";
+    case SimdIsa::AVX2:   return "avx2";
+    default:              return "scalar";
+    }
+}
+
+inline SimdIsa DetectSimdIsa ()
+{
+#ifdef ISO3DFD_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) { return SimdIsa::AVX512; }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) { return SimdIsa::AVX2; }
+#endif
+    return SimdIsa::Scalar;
+}
+
+// Resolve simd_isa = auto|avx512|avx2|scalar against what the CPU supports.
+inline SimdIsa SelectSimdIsa (std::string const& name)
+{
+    SimdIsa best = DetectSimdIsa();
+    SimdIsa want = best;
+    if (name == "avx512") { want = SimdIsa::AVX512; }
+    else if (name == "avx2") { want = SimdIsa::AVX2; }
+    else if (name == "scalar") { want = SimdIsa::Scalar; }
+    else if (name != "auto") { amrex::Abort("simd_isa must be auto, avx512, avx2 or scalar"); }
+    if (int(want) > int(best)) {
+        amrex::Abort(std::string("simd_isa = ") + name + " is not supported by this CPU");
+    }
+    return want;
+}
+
+namespace detail {
+
+template <int HL>
+void Iso3dfdRowScalar (float* pn, float const* pp, float const* pv, float const* coeff,
+                       int i0, int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    for (int i = i0; i < nx; ++i) {
+        Iso3dfdPoint<HL>(pn, pp, pv, coeff, i, jstride, kstride);
+    }
+}
+
+#ifdef ISO3DFD_X86_SIMD
+
+template <int HL>
+ISO3DFD_TARGET_AVX2
+void Iso3dfdRowAVX2 (float* AMREX_RESTRICT pn, float const* AMREX_RESTRICT pp,
+                     float const* AMREX_RESTRICT pv, float const* coeff,
+                     int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    constexpr int V = 8;
+    __m256 c[HL+1];
+    for (int ir = 0; ir <= HL; ++ir) {
+        c[ir] = _mm256_set1_ps(coeff[ir]);
+    }
+    __m256 const two = _mm256_set1_ps(2.0f);
+    int i = 0;
+    for (; i + V <= nx; i += V) {
+        float const* p = pp + i;
+        __m256 const x0 = _mm256_loadu_ps(p);
+        __m256 value = _mm256_mul_ps(x0, c[0]);
+        for (int ir = 1; ir <= HL; ++ir) {
+            __m256 sum = _mm256_add_ps(_mm256_loadu_ps(p + ir), _mm256_loadu_ps(p - ir));
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + ir*jstride));
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(p - ir*jstride));
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(p + ir*kstride));
+            sum = _mm256_add_ps(sum, _mm256_loadu_ps(p - ir*kstride));
+            value = _mm256_fmadd_ps(c[ir], sum, value);
+        }
+        __m256 const older = _mm256_fmsub_ps(two, x0, _mm256_loadu_ps(pn + i));
+        _mm256_storeu_ps(pn + i, _mm256_fmadd_ps(value, _mm256_loadu_ps(pv + i), older));
+    }
+    Iso3dfdRowScalar<HL>(pn, pp, pv, coeff, i, nx, jstride, kstride);
+}
+
+// x-neighbours i+IR and i-IR of the vector x0, given the vectors xm and xp on
+// either side of it.  The full-mask form of valignd takes x0 as its
+// pass-through operand, where the plain intrinsic passes an undefined vector
+// that GCC warns about with -Wmaybe-uninitialized.
+template <int IR>
+ISO3DFD_TARGET_AVX512
+inline __m512 XPair512 (__m512 xm, __m512 x0, __m512 xp)
+{
+    __m512i const c0 = _mm512_castps_si512(x0);
+    __m512i const right = _mm512_mask_alignr_epi32(c0, __mmask16(0xffff), _mm512_castps_si512(xp), c0, IR);
+    __m512i const left = _mm512_mask_alignr_epi32(c0, __mmask16(0xffff), c0, _mm512_castps_si512(xm), 16-IR);
+    return _mm512_add_ps(_mm512_castsi512_ps(right), _mm512_castsi512_ps(left));
+}
+
+template <int HL, int IR>
+ISO3DFD_TARGET_AVX512
+inline __m512 Accumulate512 (__m512 value, __m512 const* c, float const* p,
+                             __m512 xm, __m512 x0, __m512 xp,
+                             amrex::Long jstride, amrex::Long kstride)
+{
+    __m512 sum = XPair512<IR>(xm, x0, xp);
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(p + IR*jstride));
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(p - IR*jstride));
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(p + IR*kstride));
+    sum = _mm512_add_ps(sum, _mm512_loadu_ps(p - IR*kstride));
+    value = _mm512_fmadd_ps(c[IR], sum, value);
+    if constexpr (IR < HL) {
+        return Accumulate512<HL,IR+1>(value, c, p, xm, x0, xp, jstride, kstride);
+    } else {
+        return value;
+    }
+}
+
+template <int HL>
+ISO3DFD_TARGET_AVX512
+void Iso3dfdRowAVX512 (float* AMREX_RESTRICT pn, float const* AMREX_RESTRICT pp,
+                       float const* AMREX_RESTRICT pv, float const* coeff,
+                       int nx, amrex::Long jstride, amrex::Long kstride)
+{
+    constexpr int V = 16;
+    static_assert(HL <= V, "x-neighbours must fit in the adjacent vectors");
+    __m512 c[HL+1];
+    for (int ir = 0; ir <= HL; ++ir) {
+        c[ir] = _mm512_set1_ps(coeff[ir]);
+    }
+    __m512 const two = _mm512_set1_ps(2.0f);
+    int i = 0;
+    if (nx >= V) {
+        // The loads of xm and xp reach V cells beyond the row, which stay
+        // inside the fab because of the y and z ghost rows.
+        __m512 xm = _mm512_loadu_ps(pp - V);
+        __m512 x0 = _mm512_loadu_ps(pp);
+        for (; i + V <= nx; i += V) {
+            __m512 const xp = _mm512_loadu_ps(pp + i + V);
+            __m512 value = _mm512_mul_ps(x0, c[0]);
+            value = Accumulate512<HL,1>(value, c, pp + i, xm, x0, xp, jstride, kstride);
+            __m512 const older = _mm512_fmsub_ps(two, x0, _mm512_loadu_ps(pn + i));
+            _mm512_storeu_ps(pn + i, _mm512_fmadd_ps(value, _mm512_loadu_ps(pv + i), older));
+            xm = x0;
+            x0 = xp;
+        }
+    }
+    Iso3dfdRowScalar<HL>(pn, pp, pv, coeff, i, nx, jstride, kstride);
+}
+
+#endif
+
+}
+
+// Advance the cells of bx by one time step on the CPU.
+template <int HL>
+void Iso3dfdSimd (amrex::Box const& bx, amrex::Array4<float> const& next,
+                  amrex::Array4<float const> const& prev,
+                  amrex::Array4<float const> const& vel, float const* coeff,
+                  SimdIsa isa)
+{
+    int const nx = bx.length(0);
+    auto const jstride = next.jstride;
+    auto const kstride = next.kstride;
+    for (int k = bx.smallEnd(2); k <= bx.bigEnd(2); ++k) {
+        for (int j = bx.smallEnd(1); j <= bx.bigEnd(1); ++j) {
+            int const i = bx.smallEnd(0);
+            float* pn = next.ptr(i,j,k);
+            float const* pp = prev.ptr(i,j,k);
+            float const* pv = vel.ptr(i,j,k);
+            switch (isa) {
+#ifdef ISO3DFD_X86_SIMD
+            case SimdIsa::AVX512:
+                detail::Iso3dfdRowAVX512<HL>(pn, pp, pv, coeff, nx, jstride, kstride);
+                break;
+            case SimdIsa::AVX2:
+                detail::Iso3dfdRowAVX2<HL>(pn, pp, pv, coeff, nx, jstride, kstride);
+                break;
+#endif
+            default:
+                detail::Iso3dfdRowScalar<HL>(pn, pp, pv, coeff, 0, nx, jstride, kstride);
+            }
+        }
+    }
+}
+
+// Ghost width in x, at least ngrow, that pads the x extent of every fab of
+// ba to a multiple of 16 floats, so that with a 64-byte aligned fab each row
+// starts at the same offset in a cache line as its y- and z-neighbours.  The
+// ghost cells are symmetric, so that needs box lengths in x of one parity and
+// residue mod 16; otherwise ngrow is returned and the rows stay unpadded.
+inline int SimdGhostX (amrex::BoxArray const& ba, int ngrow)
+{
+    int const len = ba[0].length(0);
+    for (int i = 1; i < ba.size(); ++i) {
+        if ((ba[i].length(0) - len) % 16 != 0) { return ngrow; }
+    }
+    if (len % 2 != 0) { return ngrow; }
+    int g = ngrow;
+    while ((len + 2*g) % 16 != 0) { ++g; }
+    return g;
+}
+
+// Whether every local fab of mf is 64-byte aligned with a jstride padded to a
+// multiple of 16.  The kernel only does unaligned loads and stores, so this
+// is a performance hint, not a requirement.
+inline bool SimdRowsAligned (amrex::MultiFab const& mf)
+{
+    for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+        auto const& a = mf.const_array(mfi);
+        if (reinterpret_cast<std::uintptr_t>(a.dataPtr()) % 64 != 0 || a.jstride % 16 != 0) {
+            return false;
+        }
+    }
+    return true;
+}
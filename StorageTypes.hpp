@@ -0,0 +1,139 @@
+#pragma once
+#include <AMReX_Extension.H>
+#include <AMReX_GpuQualifiers.H>
+#include <cstdint>
+#include <cstring>
+#if defined(__F16C__) && !defined(AMREX_USE_GPU)
+#define ISO3DFD_F16C 1
+#include <immintrin.h>
+#endif
+
+// 16-bit storage formats for the wavefields.  Values are widened to float on
+// load and rounded to nearest even on store, so all arithmetic stays in fp32.
+// fp16 uses the F16C conversions when the host compiler targets them.
+struct bf16 { std::uint16_t bits; };
+struct fp16 { std::uint16_t bits; };
+
+template <typename T> struct StorageTraits;
+
+template <> struct StorageTraits<float> {
+    static constexpr char const* name = "fp32";
+    static constexpr float epsilon = 0x1p-24f;
+};
+
+template <> struct StorageTraits<bf16> {
+    static constexpr char const* name = "bf16";
+    static constexpr float epsilon = 0x1p-8f;
+};
+
+template <> struct StorageTraits<fp16> {
+    static constexpr char const* name = "fp16";
+    static constexpr float epsilon = 0x1p-11f;
+};
+
+namespace detail {
+
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+std::uint32_t FloatBits (float x)
+{
+    std::uint32_t u;
+    std::memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float BitsFloat (std::uint32_t u)
+{
+    float x;
+    std::memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+}
+
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float ToFloat (float x) { return x; }
+
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float ToFloat (bf16 x) { return detail::BitsFloat(std::uint32_t(x.bits) << 16); }
+
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float ToFloat (fp16 x)
+{
+#ifdef ISO3DFD_F16C
+    return _cvtsh_ss(x.bits);
+#else
+    std::uint32_t const sign = std::uint32_t(x.bits & 0x8000u) << 16;
+    std::uint32_t const e = (x.bits >> 10) & 0x1fu;
+    std::uint32_t const m = x.bits & 0x3ffu;
+    if (e == 0) {
+        float const f = float(m) * 0x1p-24f;
+        return sign ? -f : f;
+    }
+    if (e == 31) {
+        return detail::BitsFloat(sign | 0x7f800000u | (m << 13));
+    }
+    return detail::BitsFloat(sign | ((e + 112) << 23) | (m << 13));
+#endif
+}
+
+template <typename T>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+T FromFloat (float x);
+
+template <>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float FromFloat<float> (float x) { return x; }
+
+template <>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+bf16 FromFloat<bf16> (float x)
+{
+    std::uint32_t const u = detail::FloatBits(x);
+    if ((u & 0x7fffffffu) > 0x7f800000u) {
+        return bf16{std::uint16_t((u >> 16) | 0x40u)};
+    }
+    return bf16{std::uint16_t((u + 0x7fffu + ((u >> 16) & 1u)) >> 16)};
+}
+
+template <>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+fp16 FromFloat<fp16> (float x)
+{
+#ifdef ISO3DFD_F16C
+    return fp16{_cvtss_sh(x, _MM_FROUND_TO_NEAREST_INT)};
+#else
+    std::uint32_t const u = detail::FloatBits(x);
+    std::uint32_t const sign = (u >> 16) & 0x8000u;
+    std::uint32_t const a = u & 0x7fffffffu;
+    if (a > 0x7f800000u) {
+        return fp16{std::uint16_t(sign | 0x7e00u)};
+    }
+    if (a >= 0x477ff000u) {
+        // Rounds to 65536 or above, which overflows to infinity.
+        return fp16{std::uint16_t(sign | 0x7c00u)};
+    }
+    if (a >= 0x38800000u) {
+        std::uint32_t h = (a - 0x38000000u) >> 13;
+        std::uint32_t const rem = a & 0x1fffu;
+        if (rem > 0x1000u || (rem == 0x1000u && (h & 1u))) { ++h; }
+        return fp16{std::uint16_t(sign | h)};
+    }
+    if (a < 0x33000000u) {
+        return fp16{std::uint16_t(sign)};
+    }
+    // Subnormal half: the result is the full significand shifted down.
+    int const shift = 126 - int(a >> 23);
+    std::uint32_t const m = (a & 0x7fffffu) | 0x800000u;
+    std::uint32_t h = m >> shift;
+    std::uint32_t const rem = m & ((1u << shift) - 1u);
+    std::uint32_t const half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1u))) { ++h; }
+    return fp16{std::uint16_t(sign | h)};
+#endif
+}
+
+// x rounded to the precision of T, as a float.
+template <typename T>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+float RoundTo (float x) { return ToFloat(FromFloat<T>(x)); }
@@ -0,0 +1,182 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <limits>
+#include "iso3dfd.hpp"
+#include "Utils.hpp"
+
+// Temporal blocking (opt = 2): fuse several time steps per pass over memory.
+//
+// Each box is advanced fused_steps steps per halo exchange, which needs a
+// ghost region of HL*fused_steps.  Step s of a chunk updates the box grown by
+// (fused_steps-1-s)*HL, so the ghost cells are recomputed redundantly instead
+// of exchanged.  Inside a box the (x,y) plane is cut into tiles that are
+// skewed back by HL per step, and each tile streams through z as a wavefront
+// in which step s trails step s-1 by HL planes.  With this schedule every
+// read sees exactly the value the step-by-step kernel would see, so the
+// result is bit-for-bit identical.  The threads share out the boxes, or, with
+// fewer boxes than threads, the tiles of each anti-diagonal of a box, which
+// needs tiles in both x and y.
+struct TemporalBlocking
+{
+    int fused_steps = 4;
+    // Tile extent in x and y; 0 means the full width of the box.
+    amrex::IntVect tile_size{0, 16, 0};
+
+    TemporalBlocking ()
+    {
+        amrex::ParmParse pp("tb");
+        pp.query("fused_steps", fused_steps);
+        std::array<int,2> tile{tile_size[0], tile_size[1]};
+        pp.query("tile_size", tile);
+        tile_size[0] = tile[0];
+        tile_size[1] = tile[1];
+        AMREX_ALWAYS_ASSERT(fused_steps >= 1);
+    }
+
+    int nGrow (int half_length) const { return half_length * fused_steps; }
+
+    // Tiles on the longest anti-diagonal of bx, which can run at once.
+    int wavefrontTiles (amrex::Box const& bx) const
+    {
+        int const ntx = tile_size[0] > 0 ? (bx.length(0) + tile_size[0] - 1) / tile_size[0] : 1;
+        int const nty = tile_size[1] > 0 ? (bx.length(1) + tile_size[1] - 1) / tile_size[1] : 1;
+        return std::min(ntx, nty);
+    }
+};
+
+namespace detail {
+
+// Start of tile m along dir, with the first and last tiles left open.
+inline int TileStart (amrex::Box const& region, int dir, int tsize, int m, int ntiles)
+{
+    if (m == 0) { return std::numeric_limits<int>::lowest() / 2; }
+    if (m == ntiles) { return std::numeric_limits<int>::max() / 2; }
+    return region.smallEnd(dir) + m*tsize;
+}
+
+// Advance one box by nsteps steps starting at global step it0, sharing out
+// the tiles among the threads if parallel is set.
+template <int HL>
+void TemporalBlockBox (amrex::Array4<float> const& a, amrex::Array4<float> const& b,
+                       amrex::Array4<float const> const& vel, float const* coeff,
+                       amrex::Box const& vbx, amrex::Box const& domain, int it0, int nsteps,
+                       amrex::IntVect const& tile_size, bool parallel)
+{
+    constexpr int R = HL;
+    amrex::Box const& r0 = amrex::grow(vbx, (nsteps-1)*R) & domain;
+
+    int tx = tile_size[0] > 0 ? tile_size[0] : r0.length(0);
+    int ty = tile_size[1] > 0 ? tile_size[1] : r0.length(1);
+    int ntx = (r0.length(0) + tx - 1) / tx;
+    int nty = (r0.length(1) + ty - 1) / ty;
+
+    auto jstride = a.jstride;
+    auto kstride = a.kstride;
+    auto const lo = a.begin;
+    auto const* pv = vel.dataPtr();
+
+    amrex::Vector<amrex::Box> rs(nsteps);
+    for (int s = 0; s < nsteps; ++s) {
+        rs[s] = amrex::grow(vbx, (nsteps-1-s)*R) & domain;
+    }
+
+    // Tile (mx,my) reads cells that tiles (mx-1,*) and (*,my-1) write in
+    // earlier steps and overwrites cells they still read, so the tiles run
+    // as a wavefront over the anti-diagonals mx+my = d.  The tiles of one
+    // diagonal neither read nor write each other's cells.
+    amrex::ignore_unused(parallel);
+    for (int d = 0; d < ntx + nty - 1; ++d) {
+        int const mxlo = std::max(0, d - (nty-1));
+        int const mxhi = std::min(d, ntx-1);
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for schedule(dynamic) if (parallel && mxhi > mxlo)
+#endif
+        for (int mx = mxlo; mx <= mxhi; ++mx) {
+            int const my = d - mx;
+            int x0 = TileStart(r0, 0, tx, mx, ntx);
+            int x1 = TileStart(r0, 0, tx, mx+1, ntx);
+            int y0 = TileStart(r0, 1, ty, my, nty);
+            int y1 = TileStart(r0, 1, ty, my+1, nty);
+
+            // Step s touches plane w - s*R at wavefront position w.
+            for (int w = r0.smallEnd(2); w <= r0.bigEnd(2) + (nsteps-1)*R; ++w) {
+                for (int s = 0; s < nsteps; ++s) {
+                    int k = w - s*R;
+                    if (k < rs[s].smallEnd(2) || k > rs[s].bigEnd(2)) { continue; }
+                    int ilo = std::max(x0 - s*R, rs[s].smallEnd(0));
+                    int ihi = std::min(x1 - s*R, rs[s].bigEnd(0) + 1);
+                    int jlo = std::max(y0 - s*R, rs[s].smallEnd(1));
+                    int jhi = std::min(y1 - s*R, rs[s].bigEnd(1) + 1);
+
+                    bool even = (it0 + s) % 2 == 0;
+                    float* pn = even ? a.dataPtr() : b.dataPtr();
+                    float const* pp = even ? b.dataPtr() : a.dataPtr();
+                    for (int j = jlo; j < jhi; ++j) {
+                        amrex::Long row = (j-lo.y)*jstride + (k-lo.z)*kstride - lo.x;
+                        for (int i = ilo; i < ihi; ++i) {
+                            Iso3dfdPoint<HL>(pn, pp, pv, coeff, row + i, jstride, kstride);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+}
+
+// Bytes per point and step streamed through memory, assuming each chunk reads
+// and writes the three fields over the region of its first step once.
+inline double TemporalBlockingBytesPerPoint (amrex::BoxArray const& ba, amrex::Box const& domain,
+                                             int fused_steps, int half_length)
+{
+    double streamed = 0.0;
+    for (int i = 0; i < ba.size(); ++i) {
+        streamed += (amrex::grow(ba[i], (fused_steps-1)*half_length) & domain).d_numPts();
+    }
+    return 12.0 * streamed / (domain.d_numPts() * fused_steps);
+}
+
+template <int HL>
+void Iso3dfd_tb (amrex::MultiFab& nextmf, amrex::MultiFab& prevmf, amrex::MultiFab const& velmf,
+                 amrex::Gpu::DeviceVector<float> const& coeffdv, int num_iterations,
+                 TemporalBlocking const& tb, StepTimers& timers)
+{
+    BL_PROFILE("Iso3dfd_tb()");
+#ifdef AMREX_USE_GPU
+    amrex::Abort("opt = 2 (temporal blocking) is only available for CPU builds");
+#endif
+    AMREX_ALWAYS_ASSERT(prevmf.nGrowVect().min() >= tb.nGrow(HL));
+
+    amrex::Box const& domain = prevmf.boxArray().minimalBox();
+    auto const* coeff = coeffdv.data();
+    // The threads share out the boxes if there are enough of them, else the
+    // tiles of each box.
+    bool tile_parallel = false;
+#ifdef AMREX_USE_OMP
+    tile_parallel = nextmf.local_size() < omp_get_max_threads();
+#endif
+    for (int it0 = 0; it0 < num_iterations; it0 += tb.fused_steps) {
+        int nsteps = std::min(tb.fused_steps, num_iterations - it0);
+
+        auto t0 = amrex::second();
+        prevmf.FillBoundary();
+        nextmf.FillBoundary();
+        auto t1 = amrex::second();
+
+#ifdef AMREX_USE_OMP
+#pragma omp parallel if (!tile_parallel)
+#endif
+        for (amrex::MFIter mfi(nextmf); mfi.isValid(); ++mfi) {
+            detail::TemporalBlockBox<HL>(nextmf.array(mfi), prevmf.array(mfi), velmf.const_array(mfi),
+                                     coeff, mfi.validbox(), domain, it0, nsteps, tb.tile_size,
+                                     tile_parallel);
+        }
+        auto t2 = amrex::second();
+
+        timers.record(t1 - t0, t2 - t1);
+    }
+}
@@ -1,5 +1,15 @@
+#pragma once
 #include <sycl/sycl.hpp>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#ifdef AMREX_USE_OMP
+#include <omp.h>
+#endif
 #include "iso3dfd.hpp"
 
 void initialize(float* ptr_prev, float* ptr_next, float* ptr_vel, int n1,
@@ -35,14 +45,15 @@ void initialize(float* ptr_prev, float* ptr_next, float* ptr_vel, int n1,
   }
 }
 
-void printStats (double time, amrex::Box const& domain, int nIterations)
+void printStats (double time, amrex::Box const& domain, int nIterations,
+                 int half_length = kHalfLength, double bytes_per_point = 12.0)
 {
     std::cout << domain.d_numPts() << std::endl;
     auto normalized_time = time / double(nIterations);
     auto throughput_mpoints = domain.d_numPts() / normalized_time / 1.e6;
 
-    auto mflops = (7.0 * double(kHalfLength) + 5.0) * throughput_mpoints / 1.e3;
-    auto mbytes = 12.0 * throughput_mpoints / 1.e3;
+    auto mflops = (7.0 * double(half_length) + 5.0) * throughput_mpoints / 1.e3;
+    auto mbytes = bytes_per_point * throughput_mpoints / 1.e3;
 
     std::cout << "--------------------------------------\n";
     std::cout << "time         : " << time << " secs\n";
@@ -54,40 +65,98 @@ void printStats (double time, amrex::Box const& domain, int nIterations)
 
 }
 
-void printStats(double time, size_t n1, size_t n2, size_t n3,
-                size_t num_iterations) {
-  std::cout << n1*n2*n3 << std::endl;
-  std::cout << "Print Stats " << std::endl;
-  std::cout << time << std::endl;
-  float throughput_mpoints = 0.0f, mflops = 0.0f, normalized_time = 0.0f;
-  double mbytes = 0.0f;
-
-  normalized_time = (double)time / num_iterations;
-  std::cout << normalized_time << std::endl;
-  throughput_mpoints = ((n1 ) * (n2) *
-                        (n3)) /
-                       (normalized_time * 1e3f);
-  mflops = (7.0f * kHalfLength + 5.0f) * throughput_mpoints;
-  mbytes = 12.0f * throughput_mpoints;
-
-  std::cout << "--------------------------------------\n";
-  std::cout << "time         : " << time / 1e3f << " secs\n";
-  std::cout << "throughput   : " << throughput_mpoints << " Mpts/s\n";
-  std::cout << "flops        : " << mflops / 1e3f << " GFlops\n";
-  std::cout << "bytes        : " << mbytes / 1e3f << " GBytes/s\n";
-  std::cout << "\n--------------------------------------\n";
-  std::cout << "\n--------------------------------------\n";
+// Wall-clock time spent in the halo exchange and in the stencil updates, in
+// total and per step (per fused pass for temporal blocking).
+struct StepTimers {
+    double comm = 0.0;
+    double compute = 0.0;
+    std::vector<double> comm_steps;
+    std::vector<double> compute_steps;
+
+    void record (double a_comm, double a_compute)
+    {
+        comm += a_comm;
+        compute += a_compute;
+        comm_steps.push_back(a_comm);
+        compute_steps.push_back(a_compute);
+    }
+};
+
+void printCommStats (StepTimers const& timers, double total_time, int nboxes,
+                     std::string const& scaling)
+{
+    double comm_max = timers.comm;
+    double comm_avg = timers.comm;
+    double compute_max = timers.compute;
+    double compute_avg = timers.compute;
+    amrex::ParallelDescriptor::ReduceRealMax(comm_max);
+    amrex::ParallelDescriptor::ReduceRealSum(comm_avg);
+    amrex::ParallelDescriptor::ReduceRealMax(compute_max);
+    amrex::ParallelDescriptor::ReduceRealSum(compute_avg);
+    auto nprocs = amrex::ParallelDescriptor::NProcs();
+    comm_avg /= nprocs;
+    compute_avg /= nprocs;
+
+    amrex::Print() << "comm time    : " << comm_avg << " secs (avg), "
+                   << comm_max << " secs (max)\n";
+    amrex::Print() << "compute time : " << compute_avg << " secs (avg), "
+                   << compute_max << " secs (max)\n";
+    if (scaling != "none") {
+        int nthreads = 1;
+#ifdef AMREX_USE_OMP
+        nthreads = omp_get_max_threads();
+#endif
+        amrex::Print() << "scaling " << scaling
+                       << " ranks " << nprocs
+                       << " threads " << nthreads
+                       << " boxes " << nboxes
+                       << " time " << total_time
+                       << " comm " << comm_max
+                       << " compute " << compute_max << "\n";
+    }
 }
 
+// The "model name" of the first CPU in /proc/cpuinfo, or "unknown".
+inline std::string CpuModel ()
+{
+    std::ifstream is("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.rfind("model name", 0) == 0) {
+            auto pos = line.find(':');
+            if (pos != std::string::npos) {
+                pos = line.find_first_not_of(" \t", pos + 1);
+                return pos == std::string::npos ? std::string("unknown") : line.substr(pos);
+            }
+        }
+    }
+    return "unknown";
+}
+
+// time in seconds, as for the Box overload.
+void printStats (double time, size_t n1, size_t n2, size_t n3,
+                 size_t num_iterations, int half_length = kHalfLength)
+{
+    printStats(time, amrex::Box(amrex::IntVect(0), amrex::IntVect(int(n1)-1, int(n2)-1, int(n3)-1)),
+               int(num_iterations), half_length);
+}
+
+// Compare output with reference outside the halo of width radius.  The
+// first max_lines cells that differ by more than delta are written to
+// error_diff.txt; the rest are only counted in the summary.
 bool WithinEpsilon(float* output, float* reference, const size_t dim_x,
                    const size_t dim_y, const size_t dim_z,
                    const unsigned int radius, const int zadjust = 0,
-                   const float delta = 0.01f) {
+                   const float delta = 0.01f, double* norm = nullptr,
+                   const size_t max_lines = 100) {
   std::ofstream error_file;
   error_file.open("error_diff.txt");
 
   bool error = false;
   double norm2 = 0;
+  size_t nerrors = 0;
+  float max_difference = 0.0f;
+  size_t max_x = 0, max_y = 0, max_z = 0;
 
   for (size_t iz = 0; iz < dim_z; iz++) {
     for (size_t iy = 0; iy < dim_y; iy++) {
@@ -97,11 +166,18 @@ bool WithinEpsilon(float* output, float* reference, const size_t dim_x,
             iz < (dim_z - radius + zadjust)) {
           float difference = fabsf(*reference - *output);
           norm2 += difference * difference;
+          if (difference > max_difference) {
+            max_difference = difference;
+            max_x = ix; max_y = iy; max_z = iz;
+          }
           if (difference > delta) {
             error = true;
-            error_file << " ERROR: " << ix << ", " << iy << ", " << iz << "   "
-                       << *output << "   instead of " << *reference
-                       << "  (|e|=" << difference << ")\n";
+            if (nerrors < max_lines) {
+              error_file << " ERROR: " << ix << ", " << iy << ", " << iz << "   "
+                         << *output << "   instead of " << *reference
+                         << "  (|e|=" << difference << ")\n";
+            }
+            ++nerrors;
           }
         }
         ++output;
@@ -110,65 +186,102 @@ bool WithinEpsilon(float* output, float* reference, const size_t dim_x,
     }
   }
 
+  if (nerrors > max_lines) {
+    error_file << " ... and " << nerrors - max_lines << " more\n";
+  }
   error_file.close();
   norm2 = sqrt(norm2);
-  if (error) std::cout << "error (Euclidean norm): " << norm2 << "\n";
+  if (norm) *norm = norm2;
+  if (error) {
+    std::cout << nerrors << " cells differ by more than " << delta
+              << ", max |e| = " << max_difference << " at " << max_x << ", "
+              << max_y << ", " << max_z << "\n";
+    std::cout << "error (Euclidean norm): " << norm2 << "\n";
+  }
   return error;
 }
 
+// T is the storage type of the wavefields: every stored value is rounded to
+// it, as the device kernel does.
+template <int HL, typename T = float>
 void inline iso3dfdCPUIteration(float* ptr_next_base, float* ptr_prev_base,
                                 float* ptr_vel_base, float* coeff,
                                 const size_t n1, const size_t n2,
                                 const size_t n3) {
   auto dimn1n2 = n1 * n2;
 
-  auto n3_end = n3 - kHalfLength;
-  auto n2_end = n2 - kHalfLength;
-  auto n1_end = n1 - kHalfLength;
+  auto n3_end = n3 - HL;
+  auto n2_end = n2 - HL;
+  auto n1_end = n1 - HL;
 
-  for (auto iz = kHalfLength; iz < n3_end; iz++) {
-    for (auto iy = kHalfLength; iy < n2_end; iy++) {
-      float* ptr_next = ptr_next_base + iz * dimn1n2 + iy * n1;
-      float* ptr_prev = ptr_prev_base + iz * dimn1n2 + iy * n1;
-      float* ptr_vel = ptr_vel_base + iz * dimn1n2 + iy * n1;
+  // Rows are independent, so the result does not depend on the threading.
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for collapse(2)
+#endif
+  for (auto iz = size_t(HL); iz < n3_end; iz++) {
+    for (auto iy = size_t(HL); iy < n2_end; iy++) {
+      float* AMREX_RESTRICT ptr_next = ptr_next_base + iz * dimn1n2 + iy * n1;
+      float const* AMREX_RESTRICT ptr_prev = ptr_prev_base + iz * dimn1n2 + iy * n1;
+      float const* AMREX_RESTRICT ptr_vel = ptr_vel_base + iz * dimn1n2 + iy * n1;
 
-      for (auto ix = kHalfLength; ix < n1_end; ix++) {
+      for (auto ix = size_t(HL); ix < n1_end; ix++) {
         float value = ptr_prev[ix] * coeff[0];
-        value += STENCIL_LOOKUP(1);
-        value += STENCIL_LOOKUP(2);
-        value += STENCIL_LOOKUP(3);
-        value += STENCIL_LOOKUP(4);
-        value += STENCIL_LOOKUP(5);
-        value += STENCIL_LOOKUP(6);
-        value += STENCIL_LOOKUP(7);
-        value += STENCIL_LOOKUP(8);
-
-        ptr_next[ix] = 2.0f * ptr_prev[ix] - ptr_next[ix] + value * ptr_vel[ix];
+#pragma unroll(HL)
+        for (auto ir = 1; ir <= HL; ir++) {
+          value += STENCIL_LOOKUP(ir);
+        }
+
+        ptr_next[ix] = RoundTo<T>(2.0f * ptr_prev[ix] - ptr_next[ix] + value * ptr_vel[ix]);
       }
     }
   }
 }
 
+template <int HL, typename T = float>
 void CalculateReference(float* next, float* prev, float* vel, float* coeff,
                         const size_t n1, const size_t n2, const size_t n3,
                         const size_t nreps) {
   for (auto it = 0; it < nreps; it += 1) {
-    iso3dfdCPUIteration(next, prev, vel, coeff, n1, n2, n3);
+    iso3dfdCPUIteration<HL, T>(next, prev, vel, coeff, n1, n2, n3);
     std::swap(next, prev);
   }
 }
 
-void VerifyResult( float* prev,  float* next,  float* vel, float* coeff,
+// With a 16-bit T the reference rounds to T as well, with the wavefields
+// scaled by scale and, if round_vel, the velocity rounded to T.  The tolerance
+// is then a few units in the last place of T at the peak amplitude.  A model,
+// of the same padded size, replaces the constant velocity of initialize().
+template <int HL, typename T = float>
+bool VerifyResult( float* prev,  float* next,  float* vel, float* coeff,
                   const size_t n1, const size_t n2, const size_t n3,
-                  const size_t nreps) {
+                  const size_t nreps, float scale = 1.0f,
+                  bool round_vel = false, float const* model = nullptr) {
   std::cout << "Running CPU version for result comparasion: ";
   auto nsize = n1 * n2 * n3;
   //std::cout << nsize << std::endl;
   float* temp = new float[nsize];
   memcpy(temp, prev, nsize * sizeof(float));
   initialize(prev, next, vel, n1, n2, n3);
-  CalculateReference(next, prev, vel, coeff, n1, n2, n3, nreps);
-  bool error = WithinEpsilon(temp, prev, n1, n2, n3, kHalfLength, 0, 0.1f);
+  if (model) {
+    memcpy(vel, model, nsize * sizeof(float));
+  }
+  float delta = 0.1f;
+  if constexpr (!std::is_same_v<T, float>) {
+    for (size_t i = 0; i < nsize; ++i) {
+      prev[i] = RoundTo<T>(prev[i] * scale);
+      if (round_vel) vel[i] = RoundTo<T>(vel[i]);
+    }
+  }
+  CalculateReference<HL, T>(next, prev, vel, coeff, n1, n2, n3, nreps);
+  if constexpr (!std::is_same_v<T, float>) {
+    float peak = 0.0f;
+    for (size_t i = 0; i < nsize; ++i) {
+      prev[i] /= scale;
+      peak = std::max(peak, std::abs(prev[i]));
+    }
+    delta = 4.0f * StorageTraits<T>::epsilon * peak;
+  }
+  bool error = WithinEpsilon(temp, prev, n1, n2, n3, HL, 0, delta);
   if (error) {
     std::cout << "Final wavefields from SYCL device and CPU are not "
               << "equivalent: Fail\n";
@@ -177,4 +290,5 @@ void VerifyResult( float* prev,  float* next,  float* vel, float* coeff,
               << " Success\n";
   }
   delete[] temp;
+  return !error;
 }
@@ -0,0 +1,366 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "iso3dfd.hpp"
+
+// Velocity model files (vel.file).
+//
+// The file is memory-mapped, and each rank converts only the cells of its own
+// fabs, halo included, in parallel straight from the mapping.  The work is
+// split into slabs along the file's slowest axis, and each slab asks the
+// kernel to read ahead only the runs of samples it converts, so startup reads
+// about the bytes a rank owns.  Cells beyond the file take the value of the
+// nearest sample.
+//
+//   vel.format     raw: float32 samples, x fastest, or z fastest with
+//                  vel.order = zyx, byte-swapped with vel.swap_bytes = 1
+//                  segy: 3600-byte file header, then per (x, y), x fastest, a
+//                  240-byte trace header and nz big-endian IEEE (format code 5)
+//                  or IBM (format code 1) samples
+//   vel.dims       nx ny nz of the file, by default the domain plus 2*vel.pad;
+//                  segy takes nz from the file header
+//   vel.pad        cells the file holds around the domain on each side
+//   vel.units      velocity: m/s, converted to v*v*dt*dt;
+//                  coefficient: stored as v*v*dt*dt already
+struct VelocityFile
+{
+    std::string file;
+    std::string format = "raw";
+    std::string order = "xyz";
+    std::string units = "velocity";
+    int swap_bytes = 0;
+    int pad = 0;
+    std::array<int,3> dims{0, 0, 0};
+    int slab_planes = 8;
+
+    explicit VelocityFile (amrex::Box const& domain)
+    {
+        amrex::ParmParse pp("vel");
+        pp.query("file", file);
+        pp.query("format", format);
+        pp.query("order", order);
+        pp.query("units", units);
+        pp.query("swap_bytes", swap_bytes);
+        pp.query("pad", pad);
+        pp.query("slab_planes", slab_planes);
+        for (int d = 0; d < 3; ++d) {
+            dims[d] = domain.length(d) + 2*pad;
+        }
+        pp.query("dims", dims);
+        if (enabled()) {
+            if (format != "raw" && format != "segy") {
+                amrex::Abort("vel.format must be raw or segy");
+            }
+            if (order != "xyz" && order != "zyx") {
+                amrex::Abort("vel.order must be xyz or zyx");
+            }
+            if (units != "velocity" && units != "coefficient") {
+                amrex::Abort("vel.units must be velocity or coefficient");
+            }
+            AMREX_ALWAYS_ASSERT(pad >= 0 && slab_planes >= 1);
+        }
+    }
+
+    bool enabled () const { return !file.empty(); }
+};
+
+namespace detail {
+
+// A read-only mapping of a whole file.
+class MappedFile
+{
+public:
+    explicit MappedFile (std::string const& name)
+    {
+        m_fd = ::open(name.c_str(), O_RDONLY);
+        struct stat st;
+        if (m_fd < 0 || ::fstat(m_fd, &st) != 0) {
+            amrex::Abort("could not open " + name);
+        }
+        m_size = std::size_t(st.st_size);
+        void* p = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (p == MAP_FAILED) {
+            amrex::Abort("could not map " + name);
+        }
+        m_data = static_cast<unsigned char const*>(p);
+    }
+
+    ~MappedFile ()
+    {
+        ::munmap(const_cast<unsigned char*>(m_data), m_size);
+        ::close(m_fd);
+    }
+
+    MappedFile (MappedFile const&) = delete;
+    MappedFile& operator= (MappedFile const&) = delete;
+
+    unsigned char const* data () const { return m_data; }
+    std::size_t size () const { return m_size; }
+
+    // Start reading [begin, end) ahead of the page faults.
+    void willNeed (std::size_t begin, std::size_t end) const
+    {
+        std::size_t const page = std::size_t(::sysconf(_SC_PAGESIZE));
+        begin -= begin % page;
+        end = std::min(end, m_size);
+        if (end > begin) {
+            ::madvise(const_cast<unsigned char*>(m_data) + begin, end - begin, MADV_WILLNEED);
+        }
+    }
+
+private:
+    int m_fd = -1;
+    std::size_t m_size = 0;
+    unsigned char const* m_data = nullptr;
+};
+
+inline std::uint32_t ByteSwap (std::uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00u) | ((v << 8) & 0xff0000u) | (v << 24);
+}
+
+inline std::uint16_t ReadBigEndian16 (unsigned char const* p)
+{
+    return std::uint16_t((p[0] << 8) | p[1]);
+}
+
+// IBM hexadecimal float: sign, excess-64 base-16 exponent, 24-bit fraction.
+inline float IbmToFloat (std::uint32_t bits)
+{
+    double const frac = double(bits & 0xffffffu);
+    int const exp16 = int((bits >> 24) & 0x7fu) - 64;
+    double const v = std::ldexp(frac, 4 * exp16 - 24);
+    return float((bits >> 31) ? -v : v);
+}
+
+// Where sample (i,j,k) of the file lies, in bytes.
+struct SampleLayout
+{
+    std::array<int,3> dims;
+    std::size_t base = 0;
+    std::size_t stride[3] = {0, 0, 0};
+    bool swap = false;
+    bool ibm = false;
+
+    // The axes with the smallest and the largest stride.
+    int fastest () const
+    {
+        int d = 0;
+        for (int n = 1; n < 3; ++n) { if (stride[n] < stride[d]) { d = n; } }
+        return d;
+    }
+
+    int slowest () const
+    {
+        int d = 0;
+        for (int n = 1; n < 3; ++n) { if (stride[n] > stride[d]) { d = n; } }
+        return d;
+    }
+
+    std::size_t end () const
+    {
+        return base + (dims[0]-1) * stride[0] + (dims[1]-1) * stride[1] + (dims[2]-1) * stride[2]
+            + sizeof(float);
+    }
+};
+
+inline SampleLayout MakeSampleLayout (VelocityFile const& vf, MappedFile const& map)
+{
+    SampleLayout l;
+    l.dims = vf.dims;
+    if (vf.format == "segy") {
+        if (map.size() < 3600) {
+            amrex::Abort(vf.file + " has no SEG-Y file header");
+        }
+        l.dims[2] = ReadBigEndian16(map.data() + 3220);
+        int const code = ReadBigEndian16(map.data() + 3224);
+        if (code != 1 && code != 5) {
+            amrex::Abort("SEG-Y sample format code must be 1 (IBM) or 5 (IEEE)");
+        }
+        std::size_t const trace = 240 + std::size_t(l.dims[2]) * sizeof(float);
+        l.base = 3600 + 240;
+        l.stride[0] = trace;
+        l.stride[1] = trace * l.dims[0];
+        l.stride[2] = sizeof(float);
+        l.swap = true;
+        l.ibm = (code == 1);
+    } else {
+        std::size_t const s0 = sizeof(float);
+        if (vf.order == "zyx") {
+            l.stride[2] = s0;
+            l.stride[1] = s0 * l.dims[2];
+            l.stride[0] = s0 * l.dims[2] * l.dims[1];
+        } else {
+            l.stride[0] = s0;
+            l.stride[1] = s0 * l.dims[0];
+            l.stride[2] = s0 * l.dims[0] * l.dims[1];
+        }
+        l.swap = vf.swap_bytes;
+    }
+    AMREX_ALWAYS_ASSERT(l.dims[0] >= 1 && l.dims[1] >= 1 && l.dims[2] >= 1);
+    if (l.end() > map.size()) {
+        amrex::Abort(vf.file + " is smaller than vel.dims");
+    }
+    return l;
+}
+
+// Convert the samples of bx, clamped to the file, into dst, laid out as the
+// box dstbox that contains bx.
+inline void ConvertSlab (MappedFile const& map, SampleLayout const& l, amrex::Box const& bx,
+                         amrex::Box const& dstbox, amrex::IntVect const& file_lo,
+                         bool velocity, float* dst)
+{
+    std::vector<std::size_t> off[3];
+    for (int d = 0; d < 3; ++d) {
+        for (int i = bx.smallEnd(d); i <= bx.bigEnd(d); ++i) {
+            int const fi = std::clamp(i - file_lo[d], 0, l.dims[d] - 1);
+            off[d].push_back(fi * l.stride[d]);
+        }
+    }
+
+    // Read ahead each run of samples along the fastest axis, merging runs
+    // less than a page apart, in file order.
+    {
+        std::size_t const page = std::size_t(::sysconf(_SC_PAGESIZE));
+        int const df = l.fastest();
+        int const ds = l.slowest();
+        int const dm = 3 - df - ds;
+        std::size_t const run = off[df].back() - off[df].front() + sizeof(float);
+        std::size_t rb = 0, re = 0;
+        for (std::size_t os : off[ds]) {
+            for (std::size_t om : off[dm]) {
+                std::size_t const b = l.base + os + om + off[df].front();
+                if (re > rb && b >= rb && b <= re + page) {
+                    re = std::max(re, b + run);
+                } else {
+                    if (re > rb) { map.willNeed(rb, re); }
+                    rb = b;
+                    re = b + run;
+                }
+            }
+        }
+        if (re > rb) { map.willNeed(rb, re); }
+    }
+
+    unsigned char const* src = map.data() + l.base;
+    amrex::IntVect const shift = bx.smallEnd() - dstbox.smallEnd();
+    amrex::Long const nx = dstbox.length(0);
+    amrex::Long const nxy = nx * dstbox.length(1);
+    auto cell = [&] (int i, int j, int k) {
+        std::uint32_t bits;
+        std::memcpy(&bits, src + off[0][i] + off[1][j] + off[2][k], sizeof(bits));
+        if (l.swap) { bits = ByteSwap(bits); }
+        float v;
+        if (l.ibm) {
+            v = IbmToFloat(bits);
+        } else {
+            std::memcpy(&v, &bits, sizeof(v));
+        }
+        if (velocity) { v = v * v * dt * dt; }
+        dst[(i + shift[0]) + (j + shift[1]) * nx + (k + shift[2]) * nxy] = v;
+    };
+    int const n0 = bx.length(0), n1 = bx.length(1), n2 = bx.length(2);
+    // Innermost along the file's fastest axis, so the mapping is read in order.
+    if (l.stride[2] < l.stride[0]) {
+        for (int j = 0; j < n1; ++j) {
+        for (int i = 0; i < n0; ++i) {
+        for (int k = 0; k < n2; ++k) { cell(i, j, k); }
+        }}
+    } else {
+        for (int k = 0; k < n2; ++k) {
+        for (int j = 0; j < n1; ++j) {
+        for (int i = 0; i < n0; ++i) { cell(i, j, k); }
+        }}
+    }
+}
+
+}
+
+// Fill vel, ghost cells included, from the file of vf.
+inline void LoadVelocity (VelocityFile const& vf, amrex::MultiFab& vel, amrex::Box const& domain)
+{
+    BL_PROFILE("LoadVelocity()");
+    auto const t0 = amrex::second();
+    detail::MappedFile map(vf.file);
+    auto const layout = detail::MakeSampleLayout(vf, map);
+    amrex::IntVect const file_lo = domain.smallEnd() - amrex::IntVect(vf.pad);
+    bool const velocity = (vf.units == "velocity");
+
+    // One item per slab of each local fab along the file's slowest axis, so
+    // the samples of an item lie in one narrow stretch of the file: z-slabs
+    // for x-fastest files, x-slabs for vel.order = zyx, y-slabs for SEG-Y.
+    int const ds = layout.slowest();
+    struct Item { amrex::Box box; int fab; };
+    std::vector<Item> items;
+    std::vector<float*> fab_ptr;
+    std::vector<amrex::Box> fab_box;
+    for (amrex::MFIter mfi(vel); mfi.isValid(); ++mfi) {
+        amrex::Box const& fb = mfi.fabbox();
+        for (int s0 = fb.smallEnd(ds); s0 <= fb.bigEnd(ds); s0 += vf.slab_planes) {
+            amrex::Box slab = fb;
+            slab.setSmall(ds, s0);
+            slab.setBig(ds, std::min(s0 + vf.slab_planes - 1, fb.bigEnd(ds)));
+            items.push_back({slab, int(fab_ptr.size())});
+        }
+        fab_ptr.push_back(vel[mfi].dataPtr());
+        fab_box.push_back(fb);
+    }
+
+#ifdef AMREX_USE_GPU
+    // Convert into one pinned buffer while the other is copied to the device
+    // and scattered into the fab.
+    amrex::Gpu::PinnedVector<float> stage[2];
+    amrex::Gpu::DeviceVector<float> dstage[2];
+    for (int n = 0; n < int(items.size()); ++n) {
+        auto const& it = items[n];
+        auto& buf = stage[n % 2];
+        auto& dbuf = dstage[n % 2];
+        buf.resize(it.box.numPts());
+        detail::ConvertSlab(map, layout, it.box, it.box, file_lo, velocity, buf.data());
+        amrex::Gpu::streamSynchronize();
+        dbuf.resize(buf.size());
+        amrex::Gpu::copyAsync(amrex::Gpu::hostToDevice, buf.begin(), buf.end(), dbuf.begin());
+        amrex::Array4<float> const fab(fab_ptr[it.fab], amrex::begin(fab_box[it.fab]),
+                                       amrex::end(fab_box[it.fab]), 1);
+        amrex::Array4<float const> const src(dbuf.data(), amrex::begin(it.box), amrex::end(it.box), 1);
+        amrex::ParallelFor(it.box, [=] AMREX_GPU_DEVICE (int i, int j, int k)
+        {
+            fab(i,j,k) = src(i,j,k);
+        });
+    }
+    amrex::Gpu::streamSynchronize();
+#else
+#ifdef AMREX_USE_OMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int n = 0; n < int(items.size()); ++n) {
+        auto const& it = items[n];
+        detail::ConvertSlab(map, layout, it.box, fab_box[it.fab], file_lo, velocity, fab_ptr[it.fab]);
+    }
+#endif
+
+    double bytes = 0.0;
+    for (auto const& it : items) {
+        bytes += it.box.d_numPts() * sizeof(float);
+    }
+    double dt_load = amrex::second() - t0;
+    amrex::ParallelDescriptor::ReduceRealSum(bytes);
+    amrex::ParallelDescriptor::ReduceRealMax(dt_load);
+    amrex::Print() << "Velocity file: " << vf.file << " (" << vf.format << ", " << layout.dims[0] << " x "
+                   << layout.dims[1] << " x " << layout.dims[2] << "), " << bytes / (1024 * 1024)
+                   << " MB of samples in " << dt_load << " secs, " << bytes / dt_load / 1.e9 << " GBytes/s\n";
+}
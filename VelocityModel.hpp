@@ -0,0 +1,298 @@
+#pragma once
+#include <AMReX_FArrayBox.H>
+#include <AMReX_FabArray.H>
+#include <AMReX_GpuContainers.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Compressed velocity model (vel_model = auto|field|uniform|index8|index16|layered).
+//
+// The opt = 0 kernels read the velocity as vel(i,j,k) through one of the
+// accessors below; field mode passes the Array4 of the full float MultiFab.
+// Earth models are piecewise-layered with few distinct values, so a uniform
+// scalar, a uint8/uint16 index into a lookup table or a per-z profile carries
+// the same values with 0 to 2 bytes per point.  auto picks the smallest mode
+// that represents the model exactly; it is decided from per-rank scans of the
+// local fabs, so the field is never gathered onto one rank.
+
+enum class VelocityMode { Field, Uniform, Index8, Index16, Layered };
+
+struct UniformVelocity
+{
+    float value;
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    float operator() (int, int, int) const noexcept { return value; }
+};
+
+template <typename I>
+struct IndexedVelocity
+{
+    amrex::Array4<I const> index;
+    float const* table;
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    float operator() (int i, int j, int k) const noexcept { return table[index(i,j,k)]; }
+};
+
+struct LayeredVelocity
+{
+    float const* profile;
+    int klo;
+
+    AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+    float operator() (int, int, int k) const noexcept { return profile[k-klo]; }
+};
+
+class VelocityModel
+{
+public:
+    // Analyse vel and build the representation named by mode.  Every rank
+    // scans its own fabs, the ranks combine what they found and the I/O
+    // processor picks the mode, which every rank then builds locally.
+    VelocityModel (amrex::MultiFab const& vel, amrex::Box const& domain, std::string const& mode)
+        : m_field(&vel), m_klo(domain.smallEnd(2))
+    {
+        std::vector<float> table;
+        int imode = int(Choose(vel, domain, mode, table));
+        int const root = amrex::ParallelDescriptor::IOProcessorNumber();
+        amrex::ParallelDescriptor::Bcast(&imode, 1, root);
+        int ntable = int(table.size());
+        amrex::ParallelDescriptor::Bcast(&ntable, 1, root);
+        table.resize(ntable);
+        amrex::ParallelDescriptor::Bcast(table.data(), ntable, root);
+        m_mode = VelocityMode(imode);
+
+        if (m_mode == VelocityMode::Uniform) {
+            m_uniform = table[0];
+            return;
+        }
+        m_table.resize(ntable);
+        amrex::Gpu::copyAsync(amrex::Gpu::hostToDevice, table.begin(), table.end(), m_table.begin());
+        amrex::Gpu::streamSynchronize();
+        if (m_mode == VelocityMode::Index8) {
+            BuildIndex(m_index8, vel);
+        } else if (m_mode == VelocityMode::Index16) {
+            BuildIndex(m_index16, vel);
+        }
+    }
+
+    VelocityMode mode () const { return m_mode; }
+
+    char const* name () const
+    {
+        switch (m_mode) {
+        case VelocityMode::Uniform: return "uniform";
+        case VelocityMode::Index8:  return "index8";
+        case VelocityMode::Index16: return "index16";
+        case VelocityMode::Layered: return "layered";
+        default:                    return "field";
+        }
+    }
+
+    // Velocity bytes streamed per updated point.
+    double bytesPerPoint () const
+    {
+        switch (m_mode) {
+        case VelocityMode::Field:   return sizeof(float);
+        case VelocityMode::Index8:  return sizeof(std::uint8_t);
+        case VelocityMode::Index16: return sizeof(std::uint16_t);
+        default:                    return 0.0;
+        }
+    }
+
+    // Bytes held by this rank, excluding vel itself in field mode.
+    amrex::Long bytes () const
+    {
+        amrex::Long n = amrex::Long(m_table.size() * sizeof(float));
+        if (m_mode == VelocityMode::Index8) {
+            for (amrex::MFIter mfi(m_index8); mfi.isValid(); ++mfi) {
+                n += m_index8[mfi].nBytes();
+            }
+        } else if (m_mode == VelocityMode::Index16) {
+            for (amrex::MFIter mfi(m_index16); mfi.isValid(); ++mfi) {
+                n += m_index16[mfi].nBytes();
+            }
+        }
+        return n;
+    }
+
+    // Call f with the accessor for the box of mfi.
+    template <typename F>
+    void apply (amrex::MFIter const& mfi, F&& f) const
+    {
+        switch (m_mode) {
+        case VelocityMode::Uniform:
+            f(UniformVelocity{m_uniform});
+            break;
+        case VelocityMode::Index8:
+            f(IndexedVelocity<std::uint8_t>{m_index8.const_array(mfi), m_table.data()});
+            break;
+        case VelocityMode::Index16:
+            f(IndexedVelocity<std::uint16_t>{m_index16.const_array(mfi), m_table.data()});
+            break;
+        case VelocityMode::Layered:
+            f(LayeredVelocity{m_table.data(), m_klo});
+            break;
+        default:
+            f(m_field->const_array(mfi));
+        }
+    }
+
+    // Expand the model into the valid cells of vel, which must have the
+    // layout the model was built from.
+    void fill (amrex::MultiFab& vel) const
+    {
+        vel.setVal(0.0f);
+        for (amrex::MFIter mfi(vel); mfi.isValid(); ++mfi) {
+            auto const& v = vel.array(mfi);
+            apply(mfi, [&] (auto const& model) {
+                amrex::ParallelFor(mfi.validbox(), [=] AMREX_GPU_DEVICE (int i, int j, int k)
+                {
+                    v(i,j,k) = model(i,j,k);
+                });
+            });
+        }
+    }
+
+private:
+    // The mode, valid on the I/O processor, and its lookup table there.
+    static VelocityMode Choose (amrex::MultiFab const& vel, amrex::Box const& domain,
+                                std::string const& mode, std::vector<float>& table)
+    {
+        if (mode != "auto" && mode != "field" && mode != "uniform" && mode != "index8"
+            && mode != "index16" && mode != "layered") {
+            amrex::Abort("vel_model must be auto, field, uniform, index8, index16 or layered");
+        }
+        if (mode == "field") { return VelocityMode::Field; }
+
+        // Distinct values of the local fabs, up to what a uint16 index can
+        // address, and the range of every z-plane.
+        constexpr std::size_t max_distinct = 65536;
+        int const klo = domain.smallEnd(2);
+        int const nz = domain.length(2);
+        std::vector<float> plane_min(nz, std::numeric_limits<float>::max());
+        std::vector<float> plane_max(nz, std::numeric_limits<float>::lowest());
+        std::unordered_set<float> distinct;
+#ifdef AMREX_USE_GPU
+        amrex::FArrayBox host;
+#endif
+        for (amrex::MFIter mfi(vel); mfi.isValid(); ++mfi) {
+            auto const& fab = vel[mfi];
+#ifdef AMREX_USE_GPU
+            host.resize(fab.box(), 1, amrex::The_Pinned_Arena());
+            amrex::Gpu::copy(amrex::Gpu::deviceToHost, fab.dataPtr(), fab.dataPtr() + fab.size(), host.dataPtr());
+            auto const& a = host.const_array();
+#else
+            auto const& a = fab.const_array();
+#endif
+            amrex::Dim3 const lo = amrex::lbound(mfi.validbox());
+            amrex::Dim3 const hi = amrex::ubound(mfi.validbox());
+            for (int k = lo.z; k <= hi.z; ++k) {
+                float& pmin = plane_min[k-klo];
+                float& pmax = plane_max[k-klo];
+                for (int j = lo.y; j <= hi.y; ++j) {
+                    for (int i = lo.x; i <= hi.x; ++i) {
+                        float const v = a(i,j,k);
+                        pmin = amrex::min(pmin, v);
+                        pmax = amrex::max(pmax, v);
+                        if (distinct.size() <= max_distinct) { distinct.insert(v); }
+                    }
+                }
+            }
+        }
+
+        // The model is layered if every plane has one value over all ranks.
+        amrex::ParallelDescriptor::ReduceRealMin(plane_min.data(), nz);
+        amrex::ParallelDescriptor::ReduceRealMax(plane_max.data(), nz);
+        bool const layered = (plane_min == plane_max);
+
+        // Merge the distinct values on the I/O processor, unless one rank
+        // alone already has more than an index can address.
+        int const root = amrex::ParallelDescriptor::IOProcessorNumber();
+        int nlocal = int(distinct.size());
+        int nmax = nlocal;
+        amrex::ParallelDescriptor::ReduceIntMax(nmax);
+        std::vector<float> values;
+        std::size_t ndistinct = max_distinct + 1;
+        if (nmax <= int(max_distinct)) {
+            std::vector<float> local(distinct.begin(), distinct.end());
+            int const nprocs = amrex::ParallelDescriptor::NProcs();
+            std::vector<int> counts(nprocs, 0);
+            std::vector<int> disp(nprocs, 0);
+            amrex::ParallelDescriptor::Gather(&nlocal, 1, counts.data(), root);
+            for (int p = 1; p < nprocs; ++p) { disp[p] = disp[p-1] + counts[p-1]; }
+            values.resize(disp[nprocs-1] + counts[nprocs-1]);
+            amrex::ParallelDescriptor::Gatherv(local.data(), nlocal, values.data(), counts, disp, root);
+            std::sort(values.begin(), values.end());
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+            ndistinct = values.size();
+        }
+        if (!amrex::ParallelDescriptor::IOProcessor()) { return VelocityMode::Field; }
+
+        VelocityMode chosen = VelocityMode::Field;
+        if (mode == "auto") {
+            if (ndistinct == 1) { chosen = VelocityMode::Uniform; }
+            else if (layered) { chosen = VelocityMode::Layered; }
+            else if (ndistinct <= 256) { chosen = VelocityMode::Index8; }
+            else if (ndistinct <= max_distinct) { chosen = VelocityMode::Index16; }
+        } else if (mode == "uniform") {
+            chosen = VelocityMode::Uniform;
+            if (ndistinct != 1) { amrex::Abort("vel_model = uniform needs a constant velocity"); }
+        } else if (mode == "index8") {
+            chosen = VelocityMode::Index8;
+            if (ndistinct > 256) { amrex::Abort("vel_model = index8 needs at most 256 distinct velocities"); }
+        } else if (mode == "index16") {
+            chosen = VelocityMode::Index16;
+            if (ndistinct > max_distinct) { amrex::Abort("vel_model = index16 needs at most 65536 distinct velocities"); }
+        } else if (mode == "layered") {
+            chosen = VelocityMode::Layered;
+            if (!layered) { amrex::Abort("vel_model = layered needs a velocity that is constant in every z-plane"); }
+        }
+
+        if (chosen == VelocityMode::Layered) {
+            table = plane_min;
+        } else if (chosen != VelocityMode::Field) {
+            table = values;
+        }
+        return chosen;
+    }
+
+    // index = position of vel in the sorted lookup table.
+    template <typename I>
+    void BuildIndex (amrex::FabArray<amrex::BaseFab<I>>& index, amrex::MultiFab const& vel)
+    {
+        index.define(vel.boxArray(), vel.DistributionMap(), 1, 0);
+        float const* table = m_table.data();
+        int const ntable = int(m_table.size());
+        for (amrex::MFIter mfi(index); mfi.isValid(); ++mfi) {
+            auto const& idx = index.array(mfi);
+            auto const& v = vel.const_array(mfi);
+            amrex::ParallelFor(mfi.validbox(), [=] AMREX_GPU_DEVICE (int i, int j, int k)
+            {
+                int l = 0;
+                int h = ntable - 1;
+                while (l < h) {
+                    int const m = (l + h) / 2;
+                    if (table[m] < v(i,j,k)) { l = m + 1; } else { h = m; }
+                }
+                idx(i,j,k) = I(l);
+            });
+        }
+        amrex::Gpu::streamSynchronize();
+    }
+
+    amrex::MultiFab const* m_field;
+    VelocityMode m_mode = VelocityMode::Field;
+    float m_uniform = 0.0f;
+    int m_klo;
+    amrex::Gpu::DeviceVector<float> m_table;
+    amrex::FabArray<amrex::BaseFab<std::uint8_t>> m_index8;
+    amrex::FabArray<amrex::BaseFab<std::uint16_t>> m_index16;
+};
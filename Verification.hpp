@@ -0,0 +1,184 @@
+#pragma once
+#include <AMReX_BLProfiler.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
+#include <AMReX_ParmParse.H>
+#include <AMReX_Reduce.H>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Verification modes (verify = full|golden|none).
+//
+// full gathers the wavefields and reruns the host reference.  golden reduces
+// the final wavefield on the device to per-z-slab checksums and compares them
+// with a golden file for the same grid, order and step count; the first golden
+// run does a full verification and, if it passes, writes the file.
+struct Verification
+{
+    std::string mode = "full";
+    std::string golden_dir = ".";
+    int slab = 16;
+    double rtol = 1.e-5;
+
+    Verification ()
+    {
+        amrex::ParmParse pp;
+        pp.query("verify", mode);
+        amrex::ParmParse ppv("verify");
+        ppv.query("golden_dir", golden_dir);
+        ppv.query("slab", slab);
+        ppv.query("rtol", rtol);
+        if (mode != "full" && mode != "golden" && mode != "none") {
+            amrex::Abort("verify must be full, golden or none");
+        }
+        AMREX_ALWAYS_ASSERT(slab >= 1);
+    }
+
+    std::string goldenFile (amrex::Box const& domain, int order, int nsteps) const
+    {
+        std::ostringstream os;
+        os << golden_dir << "/golden_" << domain.length(0) << "x" << domain.length(1)
+           << "x" << domain.length(2) << "_o" << order << "_s" << nsteps
+           << "_z" << slab << ".txt";
+        return os.str();
+    }
+};
+
+// Sum, 1-norm, squared 2-norm and max norm of one z-slab.
+struct SlabChecksum
+{
+    double sum = 0.0;
+    double norm1 = 0.0;
+    double norm2sq = 0.0;
+    double norm0 = 0.0;
+};
+
+// Checksums of the valid cells of mf in z-slabs of slab planes.
+inline std::vector<SlabChecksum> SlabChecksums (amrex::MultiFab const& mf, amrex::Box const& domain,
+                                                int slab)
+{
+    BL_PROFILE("SlabChecksums()");
+    int const nslabs = (domain.length(2) + slab - 1) / slab;
+    std::vector<double> sums(3*nslabs, 0.0);
+    std::vector<double> maxs(nslabs, 0.0);
+    for (int s = 0; s < nslabs; ++s) {
+        amrex::Box sbx = domain;
+        sbx.setSmall(2, domain.smallEnd(2) + s*slab);
+        sbx.setBig(2, std::min(domain.bigEnd(2), domain.smallEnd(2) + (s+1)*slab - 1));
+
+        amrex::ReduceOps<amrex::ReduceOpSum, amrex::ReduceOpSum, amrex::ReduceOpSum,
+                         amrex::ReduceOpMax> reduce_op;
+        amrex::ReduceData<double, double, double, double> reduce_data(reduce_op);
+        using ReduceTuple = typename decltype(reduce_data)::Type;
+        for (amrex::MFIter mfi(mf); mfi.isValid(); ++mfi) {
+            amrex::Box const& bx = mfi.validbox() & sbx;
+            if (!bx.ok()) { continue; }
+            auto const& a = mf.const_array(mfi);
+            reduce_op.eval(bx, reduce_data,
+            [=] AMREX_GPU_DEVICE (int i, int j, int k) -> ReduceTuple
+            {
+                double const v = a(i,j,k);
+                double const av = std::abs(v);
+                return {v, av, v*v, av};
+            });
+        }
+        auto const r = reduce_data.value();
+        sums[3*s]   = amrex::get<0>(r);
+        sums[3*s+1] = amrex::get<1>(r);
+        sums[3*s+2] = amrex::get<2>(r);
+        maxs[s]     = amrex::get<3>(r);
+    }
+    amrex::ParallelDescriptor::ReduceRealSum(sums.data(), int(sums.size()));
+    amrex::ParallelDescriptor::ReduceRealMax(maxs.data(), int(maxs.size()));
+
+    std::vector<SlabChecksum> cs(nslabs);
+    for (int s = 0; s < nslabs; ++s) {
+        cs[s] = SlabChecksum{sums[3*s], sums[3*s+1], sums[3*s+2], maxs[s]};
+    }
+    return cs;
+}
+
+inline bool FileExists (std::string const& name)
+{
+    int exists = 0;
+    if (amrex::ParallelDescriptor::IOProcessor()) {
+        exists = std::ifstream(name).good();
+    }
+    amrex::ParallelDescriptor::Bcast(&exists, 1, amrex::ParallelDescriptor::IOProcessorNumber());
+    return exists;
+}
+
+// Write the golden file on the I/O processor.
+inline void WriteGolden (std::string const& name, std::vector<SlabChecksum> const& cs)
+{
+    if (!amrex::ParallelDescriptor::IOProcessor()) { return; }
+    std::ofstream os(name);
+    os << std::setprecision(17);
+    os << "# slab sum norm1 norm2sq norm0\n";
+    for (std::size_t s = 0; s < cs.size(); ++s) {
+        os << s << " " << cs[s].sum << " " << cs[s].norm1 << " "
+           << cs[s].norm2sq << " " << cs[s].norm0 << "\n";
+    }
+    std::cout << "Wrote golden checksums to " << name << std::endl;
+}
+
+// Compare cs with the golden file on the I/O processor.  A slab fails if any
+// checksum differs by more than rtol relative to the golden 1-norm, 2-norm or
+// max norm; at most max_lines failing slabs are listed.
+inline bool CompareGolden (std::string const& name, std::vector<SlabChecksum> const& cs,
+                           double rtol, int max_lines = 10)
+{
+    if (!amrex::ParallelDescriptor::IOProcessor()) { return true; }
+    std::ifstream is(name);
+    std::vector<SlabChecksum> golden;
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.empty() || line[0] == '#') { continue; }
+        std::istringstream ls(line);
+        int s;
+        SlabChecksum g;
+        ls >> s >> g.sum >> g.norm1 >> g.norm2sq >> g.norm0;
+        golden.push_back(g);
+    }
+    if (golden.size() != cs.size()) {
+        std::cout << "Golden file " << name << " has " << golden.size() << " slabs instead of "
+                  << cs.size() << ": Fail\n";
+        return false;
+    }
+
+    int nbad = 0;
+    double worst = 0.0;
+    for (std::size_t s = 0; s < cs.size(); ++s) {
+        auto const& g = golden[s];
+        double const scale1 = std::max(g.norm1, 1.e-30);
+        double const scale0 = std::max(g.norm0, 1.e-30);
+        double const err = std::max({std::abs(cs[s].sum - g.sum) / scale1,
+                                     std::abs(cs[s].norm1 - g.norm1) / scale1,
+                                     std::abs(std::sqrt(cs[s].norm2sq) - std::sqrt(g.norm2sq))
+                                         / std::max(std::sqrt(g.norm2sq), 1.e-30),
+                                     std::abs(cs[s].norm0 - g.norm0) / scale0});
+        worst = std::max(worst, err);
+        if (err > rtol) {
+            if (nbad < max_lines) {
+                std::cout << " slab " << s << ": sum " << cs[s].sum << " instead of " << g.sum
+                          << ", 2-norm " << std::sqrt(cs[s].norm2sq) << " instead of "
+                          << std::sqrt(g.norm2sq) << " (rel. error " << err << ")\n";
+            }
+            ++nbad;
+        }
+    }
+    std::cout << nbad << " of " << cs.size() << " slabs differ from the golden checksums, "
+              << "max rel. error " << worst << "\n";
+    if (nbad > 0) {
+        std::cout << "Final wavefield and golden checksums are not equivalent: Fail\n";
+    } else {
+        std::cout << "Final wavefield and golden checksums are equivalent: Success\n";
+    }
+    return nbad == 0;
+}
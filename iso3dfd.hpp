@@ -1,3 +1,12 @@
+#pragma once
+#include <AMReX_Array.H>
+#include <AMReX_Extension.H>
+#include <AMReX_GpuQualifiers.H>
+#include <AMReX_INT.H>
+#include "StorageTypes.hpp"
+
+// Half-length of the default 16th-order stencil.  Every kernel is templated on
+// the half-length HL; the order = 2*HL is chosen at run time with order=.
 constexpr int kHalfLength = 8;
 constexpr float dxyz = 50.0f;
 constexpr float dt = 0.002f;
@@ -5,4 +14,59 @@ constexpr float dt = 0.002f;
 #define STENCIL_LOOKUP(ir)                                          \
   (coeff[ir] * ((ptr_prev[ix + ir] + ptr_prev[ix - ir]) +           \
                 (ptr_prev[ix + ir * n1] + ptr_prev[ix - ir * n1]) + \
-                (ptr_prev[ix + ir * dimn1n2] + ptr_prev[ix - ir * dimn1n2])))
\ No newline at end of file
+                (ptr_prev[ix + ir * dimn1n2] + ptr_prev[ix - ir * dimn1n2])))
+
+// Coefficients of the order 2*HL central difference for the second
+// derivative, scaled by 1/dxyz^2.  c[0] is the centre weight of all three
+// dimensions together.
+template <int HL>
+constexpr amrex::Array<float,HL+1> StencilCoefficients ()
+{
+    amrex::Array<double,HL+1> c{};
+    for (int m = 1; m <= HL; ++m) {
+        // 2 (-1)^(m+1) (HL!)^2 / (m^2 (HL-m)! (HL+m)!)
+        double w = 2.0 / (double(m) * double(m));
+        for (int i = 1; i <= m; ++i) {
+            w *= double(HL + 1 - i) / double(HL + i);
+        }
+        c[m] = (m % 2 == 1) ? w : -w;
+        c[0] -= 2.0 / (double(m) * double(m));
+    }
+    amrex::Array<float,HL+1> coeff{};
+    coeff[0] = float(3.0 * c[0] / (double(dxyz) * double(dxyz)));
+    for (int m = 1; m <= HL; ++m) {
+        coeff[m] = float(c[m] / (double(dxyz) * double(dxyz)));
+    }
+    return coeff;
+}
+
+// Leapfrog update of the point at offset with velocity term vel.  Kernels
+// that must reproduce the raw-pointer kernel bit-for-bit go through this
+// function.  The wavefields may be stored as T; the update is computed in fp32.
+template <int HL, typename T>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+void Iso3dfdPoint (T* pn, T const* pp, float vel, float const* coeff,
+                   amrex::Long offset, amrex::Long jstride, amrex::Long kstride)
+{
+    float const p0 = ToFloat(pp[offset]);
+    float value = p0 * coeff[0];
+#pragma unroll(HL)
+    for (int ir = 1; ir <= HL; ++ir) {
+        value += coeff[ir] * (ToFloat(pp[offset+ir]) +
+                              ToFloat(pp[offset-ir]) +
+                              ToFloat(pp[offset+ir*jstride]) +
+                              ToFloat(pp[offset-ir*jstride]) +
+                              ToFloat(pp[offset+ir*kstride]) +
+                              ToFloat(pp[offset-ir*kstride]));
+    }
+    pn[offset] = FromFloat<T>(2.0f * p0 - ToFloat(pn[offset]) + value*vel);
+}
+
+// As above with the velocity stored as V at the same offset.
+template <int HL, typename T, typename V>
+AMREX_GPU_HOST_DEVICE AMREX_FORCE_INLINE
+void Iso3dfdPoint (T* pn, T const* pp, V const* pv, float const* coeff,
+                   amrex::Long offset, amrex::Long jstride, amrex::Long kstride)
+{
+    Iso3dfdPoint<HL>(pn, pp, ToFloat(pv[offset]), coeff, offset, jstride, kstride);
+}
@@ -1,243 +1,169 @@
 #include <AMReX.H>
+#include <AMReX_BLProfiler.H>
 #include <AMReX_FArrayBox.H>
+#include <AMReX_MultiFab.H>
+#include <AMReX_ParallelDescriptor.H>
 #include <AMReX_ParmParse.H>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <iostream>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
 #include "Utils.hpp"
+#include "TemporalBlocking.hpp"
+#include "SimdKernel.hpp"
+#include "ReducedPrecision.hpp"
+#include "VelocityModel.hpp"
+#include "VelocityFile.hpp"
+#include "ActiveRegion.hpp"
+#include "Verification.hpp"
+#include "PersistentStepping.hpp"
+#include "Propagators.hpp"
+#include "Autotune.hpp"
+#include "Instrumentation.hpp"
+#include "FabArena.hpp"
+#include "Shots.hpp"
+#include "Rtm.hpp"
+#include "Output.hpp"
+#include "OutOfCore.hpp"
+#include "BrickLayout.hpp"
 using namespace amrex;
 
-
-
-namespace {
-    int use_array4 = true;
-    int use_array4_hack = false;
-}
-
-void Initialize (FArrayBox& prev, FArrayBox& next, FArrayBox& vel)
-{
-    std::cout << "Initializing ... \n";
-
-    prev.template setVal<RunOn::Device>(0.0f);
-    next.template setVal<RunOn::Device>(0.0f);
-    vel.template setVal<RunOn::Device>(2250000.0f * dt * dt);
-
-    // Add a source to initial wavefield as an initial condition
-    auto nx = prev.box().length(0);
-    auto ny = prev.box().length(1);
-    auto nz = prev.box().length(2);
-    std::cout << "nx" << nx << std::endl;
-    std::cout << "ny" << ny << std::endl;
-    std::cout << "nz" << nz << std::endl;
-    float val = 1.f;
-    for (int s = 5; s >= 0; s--)
-    {
-        Box b(IntVect((nx / 4) - s, (ny / 4) - s, (nz / 2) - s),
-              IntVect((nx / 4) + s - 1, (ny / 4) + s + 1, (nz / 2) + s - 1));
-        // std::cout << val << std::endl;
-        prev.template setVal<RunOn::Device>(val, b);
-        val *= 10.f;
-    }
-    //std::cout << prev.array()(0,0,0)<< std::endl;
-    /*amrex::Real host_data;
-    amrex::Gpu::copy(amrex::Gpu::deviceToHost, prev.dataPtr(), prev.dataPtr() + 255, &host_data);
-    std::cout << host_data << std::endl;*/
-    amrex::Print() << "Initial min, max, 1-norm, 2-norm, inf-norm, sum: "
-                   << prev.template min<RunOn::Device>() << ", "
-                   << prev.template max<RunOn::Device>() << ", "
-                   << prev.template norm<RunOn::Device>(1) << ", "
-                   << prev.template norm<RunOn::Device>(2) << ", "
-                   << prev.template norm<RunOn::Device>(0) << ", "
-                   << prev.template sum<RunOn::Device>(0) << "\n";
-}
-          
-void Iso3dfd_opt (FArrayBox& nextfab, FArrayBox& prevfab, FArrayBox const& velfab,
-              Gpu::DeviceVector<float> const& coeffdv, int nIterations, int n1, int n2, int n3, int n1_block, int n2_block, int z_offset, int full_end_z)
+// Time every opt = 0 kernel variant for nsteps steps.  Each variant starts
+// from the current fields with its own active region, so all do equal work.
+template <int HL>
+void CompareKernels (MultiFab& next, MultiFab& prev, VelocityModel const& vmodel,
+                     Gpu::DeviceVector<float> const& coeffdv, int nsteps, Box const& domain,
+                     bool active_region)
 {
-    std::cout << "Using opt" << std::endl;
-    Box const& b = amrex::grow(nextfab.box(), -kHalfLength);
-    auto nx = n1;
-    auto nxy = n1 * n2;
-    auto bx = kHalfLength;
-    auto by = kHalfLength;
-    auto grid_size = nxy * n3;
-    auto const* coeff = coeffdv.data();
-    for (auto it = 0; it < nIterations; it += 1) 
-    {
-        auto const& next = (it % 2 == 0) ? nextfab.array() : prevfab.array();
-        auto const& prev = (it % 2 == 0) ? prevfab.const_array() : nextfab.const_array();
-        auto const& vel = velfab.const_array();
-
-        ParallelFor(b, [=] AMREX_GPU_DEVICE (int i, int j, int k)
-            {
-                auto *pn = next.ptr(i,j,k);
-                auto const* pp = prev.ptr(i,j,k);
-                auto const* pv = vel.ptr(i,j,k);
-                float value = (*pp) * coeff[0];
-                //Iso3dfdIterationGlobal(i,j,k, pn, pp, pv, nx, nxy, bx, by, n3_block, end_z);
-                {
-                    auto begin_z = i * z_offset + kHalfLength;
-                    auto end_z = begin_z + z_offset;
-                    if (end_z > full_end_z)
-                        end_z = full_end_z;
-                    int gid = (k + bx) + (j + by) + (begin_z * nxy);
-
-                    Real front[kHalfLength + 1];
-                    Real back[kHalfLength];
-                    Real c[kHalfLength + 1];
-
-                    for (auto iter = 0; iter <= kHalfLength; iter++)
-                    {
-                        front[iter] = pp[gid + iter * nxy];
-                    }
-
-                    float value = c[0] * front[0];
-                #pragma unroll(kHalfLength)
-                    for (auto iter = 1; iter <= kHalfLength; iter++)
-                    {
-                        value += c[iter] * (front[iter] + back[iter - 1] + pp[gid + iter] + pp[gid - iter] + pp[gid + iter * nx] + pp[gid - iter * nx]);
-                    }
-                    pn[gid] = 2.0f * front[0] - pn[gid] + value * pv[gid];
-
-                    gid += nxy;
-                    begin_z++;
-
-                    while (begin_z < end_z)
-                    {
-                        // Input data in front and back are shifted to discard the
-                        // oldest value and read one new value.
-                        for (auto iter = kHalfLength - 1; iter > 0; iter--)
-                        {
-                            back[iter] = back[iter - 1];
-                        }
-                        back[0] = front[0];
-
-                        for (auto iter = 0; iter < kHalfLength; iter++)
-                        {
-                            front[iter] = front[iter + 1];
-                        }
-
-                        // Only one new data-point read from global memory
-                        // in z-dimension (depth)
-                        front[kHalfLength] = pp[gid + kHalfLength * nxy];
-
-                        // Stencil code to update grid point at position given by global id (gid)
-                        float value = c[0] * front[0];
-                #pragma unroll(kHalfLength)
-                        for (auto iter = 1; iter <= kHalfLength; iter++)
-                        {
-                            value += c[iter] * (front[iter] + back[iter - 1] + pp[gid + iter] +
-                                                pp[gid - iter] + pp[gid + iter * nx] +
-                                                pp[gid - iter * nx]);
-                        }
-
-                        pn[gid] = 2.0f * front[0] - pn[gid] + value * pv[gid];
-
-                        gid += nxy;
-                        begin_z++;
-                    }
-                                                    
-                }
-                
-            });
-        
+    struct Variant { char const* name; int array4; int array4_hack; int simd; };
+    Vector<Variant> variants{{"raw", 0, 0, 0}, {"array4", 1, 0, 0}, {"array4_hack", 1, 1, 0}};
+#ifndef AMREX_USE_GPU
+    if (vmodel.mode() == VelocityMode::Field) {
+        variants.push_back({"simd", 0, 0, 1});
     }
-
+#endif
+    auto saved = std::make_tuple(use_array4, use_array4_hack, use_simd);
+    IntVect const ngrow = next.nGrowVect();
+    MultiFab prev0(prev.boxArray(), prev.DistributionMap(), 1, ngrow);
+    MultiFab next0(next.boxArray(), next.DistributionMap(), 1, ngrow);
+    MultiFab::Copy(prev0, prev, 0, 0, 1, ngrow);
+    MultiFab::Copy(next0, next, 0, 0, 1, ngrow);
+
+    amrex::Print() << "Kernel comparison over " << nsteps << " steps\n";
+    for (auto const& v : variants) {
+        use_array4 = v.array4;
+        use_array4_hack = v.array4_hack;
+        use_simd = v.simd;
+        MultiFab::Copy(prev, prev0, 0, 0, 1, ngrow);
+        MultiFab::Copy(next, next0, 0, 0, 1, ngrow);
+        ActiveRegion active(prev, next, domain, active_region);
+        StepTimers warmup_timers, timers;
+        Iso3dfd<HL>(next, prev, vmodel, coeffdv, 2, active, warmup_timers);
+        double const updated0 = active.updated;
+        ParallelDescriptor::Barrier();
+        auto t0 = amrex::second();
+        Iso3dfd<HL>(next, prev, vmodel, coeffdv, nsteps, active, timers);
+        auto t1 = amrex::second();
+        // Over the cells updated, so the skipped ones do not count.
+        amrex::Print() << "  " << v.name << " : " << (active.updated - updated0) / (t1-t0) / 1.e6
+                       << " Mpts/s\n";
+    }
+    std::tie(use_array4, use_array4_hack, use_simd) = saved;
 }
 
+// Repeat the run with the wavefields stored as T, then report the gain over
+// the fp32 run and the error against the fp32 reference in ref_cpu.
+template <int HL, typename T>
+void RunReducedPrecision (MultiFab& prev, MultiFab& next, MultiFab& vel, Box const& domain,
+                          Gpu::DeviceVector<float> const& coeff_dv, float* coeff,
+                          int num_iterations, double fp32_time, double fp32_bytes_per_point,
+                          bool active_region, ReducedPrecision const& rp, FArrayBox& ref_cpu,
+                          std::vector<float> const& model)
+{
+    using StorageFab = FabArray<BaseFab<T>>;
+    char const* name = StorageTraits<T>::name;
+
+    Initialize<HL>(prev, next, domain);
+    float const scale = StorageScale<T>(prev.norm0());
+    StorageFab prev_r(prev.boxArray(), prev.DistributionMap(), 1, prev.nGrowVect());
+    StorageFab next_r(prev.boxArray(), prev.DistributionMap(), 1, prev.nGrowVect());
+    StorageFab vel_r;
+    ToStorage(prev_r, prev, scale);
+    ToStorage(next_r, next, scale);
+    if (rp.store_vel) {
+        vel_r.define(vel.boxArray(), vel.DistributionMap(), 1, vel.nGrowVect());
+        ToStorage(vel_r, vel, 1.0f);
+    }
+    ActiveRegion active(prev, next, domain, active_region);
+    amrex::Print() << "Storage " << name << ", velocity " << (rp.store_vel ? name : "fp32")
+                   << ", wavefield scale " << scale << "\n";
+
+    auto advance = [&] (int nsteps, StepTimers& step_timers) {
+        if (rp.store_vel) {
+            Iso3dfd_storage<HL>(next_r, prev_r, vel_r, coeff_dv, nsteps, active, step_timers);
+        } else {
+            Iso3dfd_storage<HL>(next_r, prev_r, vel, coeff_dv, nsteps, active, step_timers);
+        }
+    };
 
+    StepTimers warmup_timers;
+    advance(20, warmup_timers); // warm up
+    Gpu::streamSynchronize();
 
-void Iso3dfd (FArrayBox& nextfab, FArrayBox& prevfab, FArrayBox const& velfab,
-              Gpu::DeviceVector<float> const& coeffdv, int num_iterations)
-{
-    Box const& b = amrex::grow(nextfab.box(), -kHalfLength);
-    auto const* coeff = coeffdv.data();
-    //std::cout << coeff[]
-    for (int it = 0; it < num_iterations; ++it) {
-        auto const& next = (it % 2 == 0) ? nextfab.array() : prevfab.array();
-        auto const& prev = (it % 2 == 0) ? prevfab.const_array() : nextfab.const_array();
-        auto const& vel = velfab.const_array();
-        if (use_array4) {
-            if (use_array4_hack) {
-                if(it == 0)
-                    std::cout << "Using array4 hack" << std::endl;
-                ParallelFor(b, [=] AMREX_GPU_DEVICE (int i, int j, int k)
-                {
-                    auto *pn = next.ptr(i,j,k);
-                    auto const* pp = prev.ptr(i,j,k);
-                    auto const* pv = vel.ptr(i,j,k);
-                    float value = (*pp) * coeff[0];
-#pragma unroll(kHalfLength)
-                    for (int ir = 1; ir <= kHalfLength; ++ir) {
-                        value += coeff[ir] * (pp[ ir] +
-                                              pp[-ir] +
-                                              pp[ ir*prev.jstride] +
-                                              pp[-ir*prev.jstride] +
-                                              pp[ ir*prev.kstride] +
-                                              pp[-ir*prev.kstride]);
-                    }
-                    *pn = 2.0f * (*pp) - (*pn) + value*(*pv);
-                });
-            } else {
-                if (it == 0)
-                    std::cout << "Using array4" << std::endl;
-                ParallelFor(b, [=] AMREX_GPU_DEVICE (int i, int j, int k)
-                {
-                    float value = prev(i,j,k) * coeff[0];
-                    //AMREX_DEVICE_PRINTF(" %f coeff_old:", coeff[0]);
-                    //AMREX_DEVICE_PRINTF(" %f value_old:", value);
-                    //AMREX_DEVICE_PRINTF(" %f prev_old:", prev(i,j,k));
-                    //AMREX_DEVICE_PRINTF(" %f vel_old:", vel(i,j,k));
-
-#pragma unroll(kHalfLength)
-                    for (int ir = 1; ir <= kHalfLength; ++ir) {
-                        value += coeff[ir] * (prev(i-ir,j   ,k   ) +
-                                              prev(i+ir,j   ,k   ) +
-                                              prev(i   ,j-ir,k   ) +
-                                              prev(i   ,j+ir,k   ) +
-                                              prev(i   ,j   ,k-ir) +
-                                              prev(i   ,j   ,k+ir));
-                        
-                    }
-                    //AMREX_DEVICE_PRINTF(" %f value_new:", value);
-                    next(i,j,k) = 2.0f * prev(i,j,k) - next(i,j,k) + value*vel(i,j,k);
-                });
-            }
-        } 
-        
-        
-        else {
-            if(it ==0)
-            std::cout << "Using raw pointer" << std::endl;
-            auto* pn = next.ptr(0,0,0);
-            auto const* pp = prev.ptr(0,0,0);
-            auto const* pv = vel.ptr(0,0,0);
-            auto jstride = next.jstride;
-            auto kstride = next.kstride;
-            ParallelFor(b, [=] AMREX_GPU_DEVICE (int i, int j, int k)
-            {
-                auto offset = i + j*jstride + k*kstride;
-                float value = pp[offset] * coeff[0];
-#pragma unroll(kHalfLength)
-                for (int ir = 1; ir <= kHalfLength; ++ir) {
-                    value += coeff[ir] * (pp[offset+ir] +
-                                          pp[offset-ir] +
-                                          pp[offset+ir*jstride] +
-                                          pp[offset-ir*jstride] +
-                                          pp[offset+ir*kstride] +
-                                          pp[offset-ir*kstride]);
-                }
-                pn[offset] = 2.0f * pp[offset] - pn[offset] + value*pv[offset];
-            });
+    StepTimers timers;
+    ParallelDescriptor::Barrier();
+    auto t0 = amrex::second();
+    advance(num_iterations, timers);
+    Gpu::streamSynchronize();
+    auto t1 = amrex::second();
+    if (ParallelDescriptor::IOProcessor()) {
+        printStats(t1-t0, domain, num_iterations, HL, rp.bytesPerPoint());
+    }
+    amrex::Print() << "bytes/pt     : " << rp.bytesPerPoint() << " (" << fp32_bytes_per_point << " for fp32)\n";
+    amrex::Print() << "gain vs fp32 : " << fp32_time / (t1-t0) << "x throughput, "
+                   << rp.bytesPerPoint() * fp32_time / (fp32_bytes_per_point * (t1-t0)) << "x bytes/s\n";
+
+    // The newest wavefield is in prev_r, as it is in prev for the fp32 run.
+    FromStorage(next, prev_r, scale);
+    FArrayBox out_cpu, next_cpu, vel_cpu;
+    if (ParallelDescriptor::IOProcessor()) {
+        Box fabbox = amrex::grow(domain,HL);
+        out_cpu.resize(fabbox,1,The_Pinned_Arena());
+        next_cpu.resize(fabbox,1,The_Pinned_Arena());
+        vel_cpu.resize(fabbox,1,The_Pinned_Arena());
+    }
+    GatherToHost(next, domain, out_cpu, HL);
+
+    if (ParallelDescriptor::IOProcessor()) {
+        size_t n1 = domain.length(0) + 2*HL;
+        size_t n2 = domain.length(1) + 2*HL;
+        size_t n3 = domain.length(2) + 2*HL;
+        double norm = 0.0;
+        WithinEpsilon(out_cpu.dataPtr(), ref_cpu.dataPtr(), n1, n2, n3, HL, 0,
+                      std::numeric_limits<float>::max(), &norm);
+        double ref_norm = 0.0;
+        for (Long i = 0; i < ref_cpu.size(); ++i) {
+            ref_norm += double(ref_cpu.dataPtr()[i]) * double(ref_cpu.dataPtr()[i]);
         }
-        Gpu::streamSynchronize();
+        ref_norm = std::sqrt(ref_norm);
+        std::cout << name << " error vs fp32 reference (Euclidean norm): " << norm
+                  << ", relative " << norm / ref_norm << std::endl;
+
+        std::cout << "Starting " << name << " verification " << std::endl;
+        VerifyResult<HL, T>(out_cpu.dataPtr(), next_cpu.dataPtr(), vel_cpu.dataPtr(), coeff,
+                            n1, n2, n3, num_iterations + 20, scale, rp.store_vel,
+                            model.empty() ? nullptr : model.data());
     }
-
 }
 
-
-
-void main_main ()
+template <int HL>
+void RunIso3dfd ()
 {
-    static_assert(std::is_same_v<float,Real>);
 
     std::array<int,3> grid_sizes{256,256,256};
     
@@ -246,6 +172,14 @@ void main_main ()
     int n3_block = 64;
     int num_iterations = 10;
     int opt = 1;
+    int max_grid_size = 128;
+    int compare_kernels = 0;
+    std::string scaling = "none";
+    std::string simd_isa_name = "auto";
+    std::string vel_model = "auto";
+    int active_region = 1;
+    std::string arena = "default";
+    bool arena_given = false;
     {
         ParmParse pp;
         pp.query("grid_sizes", grid_sizes);
@@ -253,6 +187,41 @@ void main_main ()
         pp.query("use_array4", use_array4);
         pp.query("use_array4_hack", use_array4_hack);
         pp.query("opt" , opt);
+        pp.query("n1_block", n1_block);
+        pp.query("n2_block", n2_block);
+        pp.query("n3_block", n3_block);
+        pp.query("max_grid_size", max_grid_size);
+        pp.query("scaling", scaling);
+        pp.query("compare_kernels", compare_kernels);
+        pp.query("simd_isa", simd_isa_name);
+        pp.query("vel_model", vel_model);
+        pp.query("active_region", active_region);
+        arena_given = pp.query("arena", arena);
+
+        // kernel = raw|array4|array4_hack|simd overrides the use_array4 flags.
+        std::string kernel;
+        if (pp.query("kernel", kernel)) {
+            use_array4 = (kernel == "array4" || kernel == "array4_hack");
+            use_array4_hack = (kernel == "array4_hack");
+            use_simd = (kernel == "simd");
+            if (kernel != "raw" && !use_array4 && !use_simd) {
+                amrex::Abort("kernel must be raw, array4, array4_hack or simd");
+            }
+        }
+    }
+#ifdef AMREX_USE_GPU
+    if (use_simd) {
+        amrex::Abort("kernel = simd is only available for CPU builds");
+    }
+#else
+    simd_isa = SelectSimdIsa(simd_isa_name);
+#endif
+
+    if (scaling == "weak") {
+        // grid_sizes is the per-rank problem; stack the ranks along z.
+        grid_sizes[2] *= ParallelDescriptor::NProcs();
+    } else if (scaling != "none" && scaling != "strong") {
+        amrex::Abort("scaling must be none, strong or weak");
     }
 
     size_t n1 = grid_sizes[0];
@@ -262,85 +231,361 @@ void main_main ()
      Box domain(IntVect(0),IntVect(grid_sizes[0]-1,
                                   grid_sizes[1]-1,
                                   grid_sizes[2]-1));
-    //float* prev_cpu, next_cpu, vel_cpu;
-    FArrayBox prev, next, vel;
-    FArrayBox prev_cpu, next_cpu, vel_cpu;
-    {
-        Box fabbox = amrex::grow(domain,kHalfLength);
-        prev.resize(fabbox,1);
-        next.resize(fabbox,1);
-        vel.resize(fabbox,1);
-        prev_cpu.resize(fabbox,1,The_Pinned_Arena() );
-        next_cpu.resize(fabbox,1, The_Pinned_Arena() );
-        vel_cpu.resize(fabbox,1, The_Pinned_Arena() );
-
-    }
-
-    // Compute coefficients to be used in wavefield update
-    Array<float,kHalfLength+1> coeff
-        {-3.0548446f,   +1.7777778f,     -3.1111111e-1f,
-         +7.572087e-2f, -1.76767677e-2f, +3.480962e-3f,
-         -5.180005e-4f, +5.074287e-5f,   -2.42812e-6f};
-    // Apply the DX DY and DZ to coefficients
-    coeff[0] = (3.0f * coeff[0]) / (dxyz * dxyz);
-    for (int i = 1; i <= kHalfLength; i++) {
-        coeff[i] = coeff[i] / (dxyz * dxyz);
+    BoxArray ba(domain);
+    ba.maxSize(max_grid_size);
+    DistributionMapping dm(ba);
+
+    ReducedPrecision rp;
+    Verification verify;
+    ShotBatch shots(domain, HL);
+    RtmParams rtm(domain, HL, num_iterations);
+    OutputParams output_params(domain, HL);
+    VelocityFile vfile(domain);
+    BrickParams bricks(HL);
+    Diagnostics diag;
+    if (diag.enabled() && (opt > 1 || use_simd)) {
+        amrex::Abort("diag.interval needs opt = 0 or 1 with a non-simd kernel");
+    }
+    if (vfile.enabled() && verify.mode == "golden") {
+        amrex::Abort("golden files are for the constant model; use verify = full or none with vel.file");
+    }
+    if (output_params.enabled && opt > 1) {
+        amrex::Abort("output = 1 stages every step and needs opt = 0 or 1");
+    }
+    if (rp.enabled() && (opt != 0 || use_simd)) {
+        amrex::Abort("storage = bf16|fp16 is compared against opt = 0 with a non-simd kernel");
     }
+
+    // Coefficients to be used in wavefield update, with DX DY and DZ applied
+    auto coeff = StencilCoefficients<HL>();
     Gpu::DeviceVector<float> coeff_dv(coeff.size());
     Gpu::copyAsync(Gpu::hostToDevice, coeff.begin(), coeff.end(), coeff_dv.begin());
 
-    std::cout << "Grid Sizes: " << grid_sizes[0] << " " << grid_sizes[1] << " "
-              << grid_sizes[2] << "\n";
-    std::cout << "Memory Usage: " << ((3*prev.nBytes()) / (1024 * 1024)) << " MB\n";
+    // The fields stay in files and stream through memory a z-slab at a time.
+    OutOfCore ooc;
+    if (ooc.enabled) {
+        RunOutOfCore<HL>(ooc, domain, coeff.data(), num_iterations);
+        return;
+    }
 
+    TemporalBlocking tb;
+    PersistentStepping ps;
+    {
+        TuneKnobs knobs;
+        knobs.block = IntVect(n1_block, n2_block, n3_block);
+        knobs.mfiter_tile = FabArrayBase::mfiter_tile_size;
+        knobs.fused_steps = tb.fused_steps;
+        knobs.tb_tile = tb.tile_size;
+        knobs.slabs_per_thread = ps.slabs_per_thread;
+#ifdef AMREX_USE_OMP
+        knobs.threads = omp_get_max_threads();
+#endif
+        Autotune<HL>(knobs, ba, dm, domain, opt, coeff_dv);
+        n1_block = knobs.block[0];
+        n2_block = knobs.block[1];
+        n3_block = knobs.block[2];
+        tb.fused_steps = knobs.fused_steps;
+        tb.tile_size = knobs.tb_tile;
+        ps.slabs_per_thread = knobs.slabs_per_thread;
+    }
 
-    Initialize(prev, next, vel);
-    Gpu::streamSynchronize();
+    IntVect ngrow((opt == 2) ? tb.nGrow(HL) : HL);
+    if (use_simd) {
+        ngrow[0] = SimdGhostX(ba, ngrow[0]);
+    }
+    auto fab_arena = MakeFabArena(arena);
+    // The default arena only aligns fabs to 16 bytes, so unless it was asked
+    // for, kernel = simd allocates them 64-byte aligned.
+    AlignedArena simd_arena;
+    MFInfo const fab_info = (use_simd && !(arena_given && arena == "default"))
+        ? SimdFabInfo(fab_arena, simd_arena) : FabInfo(fab_arena);
+    MultiFab prev(ba, dm, 1, ngrow, fab_info);
+    MultiFab next(ba, dm, 1, ngrow, fab_info);
+    MultiFab vel(ba, dm, 1, ngrow, fab_info);
+    if (use_simd && !(SimdRowsAligned(prev) && SimdRowsAligned(next) && SimdRowsAligned(vel))) {
+        // See SimdGhostX; the results are the same, only the loads are slower.
+        amrex::Print() << "kernel = simd: rows are not padded to 64 bytes\n";
+    }
+    if (fab_arena) {
+        MFItInfo const tiling = KernelTiling(opt, IntVect(n1_block, n2_block, n3_block));
+        FirstTouch(prev, tiling);
+        FirstTouch(next, tiling);
+        FirstTouch(vel, tiling);
+        ReportPlacement(prev, *fab_arena);
+    }
 
-    if(opt){
-        Iso3dfd_opt(next, prev, vel, coeff_dv, 2, n1, n2, n3, n1_block, n2_block, n3_block, n3 - kHalfLength); //warm up
-        Gpu::streamSynchronize();
+    Long fab_points = 0;
+    for (int i = 0; i < ba.size(); ++i) {
+        fab_points += amrex::grow(ba[i], ngrow).numPts();
+    }
+    amrex::Print() << "Grid Sizes: " << grid_sizes[0] << " " << grid_sizes[1] << " "
+                   << grid_sizes[2] << "\n";
+    amrex::Print() << "Boxes: " << ba.size() << " (max_grid_size " << max_grid_size
+                   << ") on " << ParallelDescriptor::NProcs() << " ranks\n";
+    amrex::Print() << "Memory Usage: " << ((3*fab_points*sizeof(float)) / (1024 * 1024)) << " MB\n";
+
+    BL_PROFILE_VAR("RunIso3dfd::init", blp_init);
+    Initialize<HL>(prev, next, vel, domain);
+    vel.FillBoundary();
+    if (vfile.enabled()) {
+        LoadVelocity(vfile, vel, domain);
+    }
+    Gpu::streamSynchronize();
 
-        auto t0 = amrex::second();
-        Iso3dfd_opt(next, prev, vel, coeff_dv, num_iterations, n1, n2, n3, n1_block, n2_block, n3_block, n3 - kHalfLength);
-        Gpu::streamSynchronize();
-        auto t1 = amrex::second();
-        printStats((t1-t0) * 1e-3, n1, n2, n3, num_iterations);
+    // Only the opt = 0 scalar kernels read the velocity through VelocityModel.
+    if (opt != 0 || use_simd) {
+        if (vel_model != "auto" && vel_model != "field") {
+            amrex::Abort("vel_model other than field needs opt = 0 and a non-simd kernel");
+        }
+        vel_model = "field";
+    }
+    VelocityModel vmodel(vel, domain, vel_model);
+    Long vmodel_bytes = vmodel.bytes();
+    ParallelDescriptor::ReduceLongSum(vmodel_bytes);
+    if (vmodel.mode() != VelocityMode::Field) {
+        vel.clear();
+    } else {
+        vmodel_bytes = fab_points * sizeof(float);
+    }
+    amrex::Print() << "Velocity model: " << vmodel.name() << ", "
+                   << vmodel.bytesPerPoint() << " bytes/pt, "
+                   << vmodel_bytes / (1024 * 1024) << " MB\n";
+
+    ActiveRegion active(prev, next, domain, active_region && opt < 2);
+    BL_PROFILE_VAR_STOP(blp_init);
+
+    if (opt == 1) {
+        amrex::Print() << "Using opt, blocks " << n1_block << " " << n2_block << " " << n3_block << "\n";
+    } else if (opt == 2) {
+        amrex::Print() << "Using temporal blocking, fused_steps " << tb.fused_steps
+                       << ", tile_size " << tb.tile_size[0] << " " << tb.tile_size[1] << "\n";
+#ifdef AMREX_USE_OMP
+        // The threads share out the boxes, or the tiles of one wavefront.
+        int width = next.local_size();
+        for (MFIter mfi(next); mfi.isValid(); ++mfi) {
+            width = amrex::max(width, tb.wavefrontTiles(mfi.validbox()));
+        }
+        if (width < omp_get_max_threads()) {
+            amrex::Print() << "opt = 2 keeps at most " << width << " of " << omp_get_max_threads()
+                           << " threads busy; use a smaller max_grid_size or tb.tile_size with tiles in x and y\n";
+        }
+#endif
+    } else if (opt == 3) {
+        amrex::Print() << "Using persistent stepping with " << KernelName()
+                       << ", slabs_per_thread " << ps.slabs_per_thread << "\n";
+    } else {
+        amrex::Print() << "Using " << KernelName() << "\n";
     }
-    else{
-    Iso3dfd(next, prev, vel, coeff_dv, 20); // warm up
+
+    // Advance the wavefield with the kernel selected by opt.
+    auto advance = [&] (int nsteps, StepTimers& step_timers) {
+        if (opt == 1) {
+            Iso3dfd_opt<HL>(next, prev, vel, coeff_dv, nsteps, n1_block, n2_block, n3_block, active, step_timers,
+                            diag.enabled() ? &diag : nullptr);
+        } else if (opt == 2) {
+            Iso3dfd_tb<HL>(next, prev, vel, coeff_dv, nsteps, tb, step_timers);
+        } else if (opt == 3) {
+            Iso3dfd_persistent<HL>(next, prev, vel, coeff_dv, nsteps, ps, step_timers);
+        } else {
+            Iso3dfd<HL>(next, prev, vmodel, coeff_dv, nsteps, active, step_timers,
+                        diag.enabled() ? &diag : nullptr);
+        }
+    };
+
+    BL_PROFILE_VAR("RunIso3dfd::warmup", blp_warmup);
+    StepTimers warmup_timers;
+    advance(20, warmup_timers); // warm up
     Gpu::streamSynchronize();
+    BL_PROFILE_VAR_STOP(blp_warmup);
+
+    Instrumentation instrument;
+    std::unique_ptr<PerfCounters> counters;
+    if (instrument.enabled && instrument.counters) {
+        counters = std::make_unique<PerfCounters>();
+    }
 
+    OutputWriter output(output_params, prev, domain);
+
+    BL_PROFILE_VAR("RunIso3dfd::stepping", blp_stepping);
+    StepTimers timers;
+    double const skipped0 = active.skipped;
+    double const updated0 = active.updated;
+    ParallelDescriptor::Barrier();
+    if (counters) { counters->start(); }
     auto t0 = amrex::second();
-    Iso3dfd(next, prev, vel, coeff_dv, num_iterations);
+    if (output.enabled()) {
+        // One step at a time, swapping the fields so each step writes next.
+        output.begin();
+        for (int s = 1; s <= num_iterations; ++s) {
+            advance(1, timers);
+            output.step(next, s);
+            std::swap(prev, next);
+        }
+        if (num_iterations % 2 != 0) {
+            std::swap(prev, next);
+        }
+    } else {
+        advance(num_iterations, timers);
+    }
     Gpu::streamSynchronize();
     auto t1 = amrex::second();
-    printStats((t1-t0) * 1e3, n1, n2, n3, num_iterations);
-    printStats(t1-t0, domain, num_iterations);
+    if (counters) { counters->stop(); }
+    BL_PROFILE_VAR_STOP(blp_stepping);
+    if (output.enabled()) {
+        output.finish((num_iterations % 2 == 0) ? prev : next, num_iterations);
+    }
+    if (ParallelDescriptor::IOProcessor()) {
+        printStats(t1-t0, domain, num_iterations, HL, 8.0 + vmodel.bytesPerPoint());
+    }
+    if (active_region && opt < 2) {
+        // printStats counts every cell of every step; these count the cells
+        // that were actually updated.
+        double const mpoints = (active.updated - updated0) / (t1-t0) / 1.e6;
+        amrex::Print() << "active region: " << active.box << ", skipped "
+                       << 100.0 * (active.skipped - skipped0) / (domain.d_numPts() * num_iterations)
+                       << "% of the cell updates\n";
+        amrex::Print() << "throughput over the updated cells: " << mpoints << " Mpts/s, "
+                       << (7.0 * HL + 5.0) * mpoints / 1.e3 << " GFlops (effective above)\n";
+    }
+    printCommStats(timers, t1-t0, ba.size(), scaling);
+    diag.printSummary();
+    if (opt == 2) {
+        double bytes_per_point = TemporalBlockingBytesPerPoint(ba, domain, tb.fused_steps, HL);
+        double mpoints = domain.d_numPts() * num_iterations / (t1-t0) / 1.e6;
+        amrex::Print() << "effective bytes/pt : " << bytes_per_point
+                       << " (12 without temporal blocking)\n";
+        amrex::Print() << "effective bytes    : " << bytes_per_point * mpoints / 1.e3
+                       << " GBytes/s\n";
+    }
+    if (instrument.enabled) {
+        PrintHistogram("comm per step   ", timers.comm_steps, instrument.nbins);
+        PrintHistogram("compute per step", timers.compute_steps, instrument.nbins);
+        double const stream_gbs = instrument.stream ? StreamTriad(instrument.stream_size, 5) : 0.0;
+        if (counters) {
+            double const model_bytes = (opt == 2) ? TemporalBlockingBytesPerPoint(ba, domain, tb.fused_steps, HL)
+                                                  : 8.0 + vmodel.bytesPerPoint();
+            PrintCounterReport(*counters, domain.d_numPts() * num_iterations, t1-t0,
+                               7.0*HL + 5.0, model_bytes, stream_gbs);
+        }
+    }
 
-    amrex::Print() << "Final min, max, 1-norm, 2-norm, inf-norm, sum: "
-                   << next.template min<RunOn::Device>() << ", "
-                   << next.template max<RunOn::Device>() << ", "
-                   << next.template norm<RunOn::Device>(1) << ", "
-                   << next.template norm<RunOn::Device>(2) << ", "
-                   << next.template norm<RunOn::Device>(0) << ", "
-                   << next.template sum<RunOn::Device>(0) << "\n";
+    BL_PROFILE_VAR("RunIso3dfd::reductions", blp_reductions);
+    PrintStats("Final", Stats(next));
+    BL_PROFILE_VAR_STOP(blp_reductions);
 
-    
-    
-   // next.copyToHost();
-    std::cout << next.array().size() << std::endl;
-    amrex::Gpu::copy(amrex::Gpu::deviceToHost, next.dataPtr(), next.dataPtr() + next.size(), next_cpu.dataPtr());
-    amrex::Gpu::copy(amrex::Gpu::deviceToHost, prev.dataPtr(), prev.dataPtr() + prev.size(), prev_cpu.dataPtr());
-    amrex::Gpu::copy(amrex::Gpu::deviceToHost, vel.dataPtr(), vel.dataPtr() + vel.size(), vel_cpu.dataPtr());
-    //Gpu::streamSynchronize();
-    std::cout << prev_cpu.array()(67, 67, 119) << std::endl;
-    std::cout << next_cpu.array()(67, 67, 119) << std::endl;
-    std::cout << vel_cpu.array()(67, 67, 119) << std::endl;
-
-    std::cout << "Starting verification " << std::endl;
-    VerifyResult(prev_cpu.array().dataPtr(), next_cpu.array().dataPtr(), vel_cpu.array().dataPtr(), coeff.data(), n1 + 2*kHalfLength, n2 +  2*kHalfLength, n3 +  2*kHalfLength, num_iterations + 20);
+    if (!vel.ok()) {
+        vel.define(ba, dm, 1, ngrow);
+        vmodel.fill(vel);
+    }
+
+    // The newest wavefield is in prev.  golden mode checks it on the device;
+    // the host reference only runs for verify = full or to seed a golden file.
+    int const nsteps = num_iterations + 20;
+    std::string const golden = verify.goldenFile(domain, 2*HL, nsteps);
+    bool const write_golden = verify.mode == "golden" && !FileExists(golden);
+    bool const full = verify.mode == "full" || write_golden;
+    BL_PROFILE_VAR("RunIso3dfd::verification", blp_verification);
+    auto tv0 = amrex::second();
+    std::vector<SlabChecksum> checksums;
+    if (verify.mode == "golden") {
+        checksums = SlabChecksums(prev, domain, verify.slab);
+        if (!write_golden) {
+            CompareGolden(golden, checksums, verify.rtol);
+        }
+    }
+
+    FArrayBox prev_cpu, next_cpu, vel_cpu;
+    std::vector<float> model;
+    if (full || rp.enabled()) {
+        if (ParallelDescriptor::IOProcessor()) {
+            Box fabbox = amrex::grow(domain,HL);
+            prev_cpu.resize(fabbox,1,The_Pinned_Arena() );
+            next_cpu.resize(fabbox,1, The_Pinned_Arena() );
+            vel_cpu.resize(fabbox,1, The_Pinned_Arena() );
+        }
+        GatherToHost(next, domain, next_cpu, HL);
+        GatherToHost(prev, domain, prev_cpu, HL);
+        GatherToHost(vel, domain, vel_cpu, HL);
+
+        if (ParallelDescriptor::IOProcessor()) {
+            // The host reference replaces its constant velocity with a loaded one.
+            if (vfile.enabled()) {
+                model.assign(vel_cpu.dataPtr(), vel_cpu.dataPtr() + vel_cpu.size());
+            }
+            if (domain.contains(IntVect(67, 67, 119))) {
+                std::cout << prev_cpu.array()(67, 67, 119) << std::endl;
+                std::cout << next_cpu.array()(67, 67, 119) << std::endl;
+                std::cout << vel_cpu.array()(67, 67, 119) << std::endl;
+            }
+        }
+    }
+
+    if (full && ParallelDescriptor::IOProcessor()) {
+        std::cout << "Starting verification " << std::endl;
+        bool passed = VerifyResult<HL>(prev_cpu.array().dataPtr(), next_cpu.array().dataPtr(), vel_cpu.array().dataPtr(), coeff.data(), n1 + 2*HL, n2 +  2*HL, n3 +  2*HL, nsteps,
+                                   1.0f, false, model.empty() ? nullptr : model.data());
+        if (write_golden) {
+            if (passed) {
+                WriteGolden(golden, checksums);
+            } else {
+                std::cout << "Not writing " << golden << " from a failed run\n";
+            }
+        }
+    }
+    amrex::Print() << "verification time : " << amrex::second() - tv0 << " secs (" << verify.mode << ")\n";
+    BL_PROFILE_VAR_STOP(blp_verification);
+
+    // The same steps on the same fields stored in bricks.
+    if (bricks.enabled()) {
+        bool const exact = opt == 1 || opt == 2 || (!use_simd && (!use_array4 || use_array4_hack));
+        RunBricked<HL>(bricks, prev, next, vel, domain, coeff_dv, num_iterations, t1-t0, exact);
+    }
+
+    // prev_cpu now holds the fp32 host reference, or the fp32 result verified
+    // against the golden checksums.
+    if (rp.storage == "bf16") {
+        RunReducedPrecision<HL, bf16>(prev, next, vel, domain, coeff_dv, coeff.data(), num_iterations,
+                                      t1-t0, 8.0 + vmodel.bytesPerPoint(), active_region, rp, prev_cpu, model);
+    } else if (rp.storage == "fp16") {
+        RunReducedPrecision<HL, fp16>(prev, next, vel, domain, coeff_dv, coeff.data(), num_iterations,
+                                      t1-t0, 8.0 + vmodel.bytesPerPoint(), active_region, rp, prev_cpu, model);
+    }
+
+    // One velocity model for many sources, against the single-shot time.
+    if (shots.enabled()) {
+        RunShots<HL>(shots, prev, next, vel, domain, coeff_dv, num_iterations, t1-t0,
+                     verify.mode != "none");
+    }
+
+    if (rtm.enabled) {
+        RunRtm<HL>(rtm, prev, next, vel, domain, coeff_dv);
+    }
+
+    if (compare_kernels > 0) {
+        // The brick, bf16/fp16, shot and RTM runs above reinitialized the fields.
+        CompareKernels<HL>(next, prev, vmodel, coeff_dv, compare_kernels, domain, active_region);
+    }
 }
+
+void main_main ()
+{
+    static_assert(std::is_same_v<float,Real>);
+
+    // Spatial order of accuracy; each order runs a fully unrolled instantiation.
+    int order = 2*kHalfLength;
+    {
+        ParmParse pp;
+        pp.query("order", order);
+    }
+    amrex::Print() << "Stencil order: " << order << "\n";
+
+    switch (order) {
+    case 2:  RunIso3dfd<1>(); break;
+    case 4:  RunIso3dfd<2>(); break;
+    case 8:  RunIso3dfd<4>(); break;
+    case 16: RunIso3dfd<8>(); break;
+    default: amrex::Abort("order must be 2, 4, 8 or 16");
+    }
 }
 
 int main(int argc, char* argv[])